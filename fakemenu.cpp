@@ -10,17 +10,99 @@
 #include <uxtheme.h>
 #include <dwmapi.h>
 #include <assert.h>
+#include <stdlib.h>
 #include "fakemenu.h"
+#include "fakemenu_trace.h"
+#include "fakemenu_nav.h"
 
 // Constants
 #define FAKEMENU_MARGIN 8
 #define FAKEMENU_CX_SPACE 24
 #define FAKEMENU_CX_SEP 6
 #define FAKEMENU_CY_SEP 6
-#define FAKEMENU_REFRESH_TIMER 999
-#define FAKEMENU_REFRESH_INTERVAL 150
-#define FAKEMENU_ANIMATION_TIMER 888
-#define FAKEMENU_ANIMATION_DELAY 150
+#define FAKEMENU_ANIMATION_INTERVAL 15
+#define FAKEMENU_ANIMATION_OPEN_TIME 120
+#define FAKEMENU_ANIMATION_FLASH_TIME 100
+#define FAKEMENU_ANIMATION_BLINK_TIME 50
+#define FAKEMENU_ANIMATION_CLOSE_TIME 150
+#define FAKEMENU_ANIMATION_SLIDE 8
+#define FAKEMENU_MAX_CLOSE 16
+#define FAKEMENU_CLOSE_TIMEOUT 200      // The total wait for the menus of the other processes
+#define FAKEMENU_SHARED_SLOTS 64
+#define FAKEMENU_SHARED_NAME L"katahiromz's FakeMenu Registry"
+#define FAKEMENU_CHECK_NAME L"katahiromz's FakeMenu Check"
+#define FAKEMENU_TYPEAHEAD_MAX 64
+#define FAKEMENU_TYPEAHEAD_TIMEOUT 1000
+#define FAKEMENU_SEARCH_MAX 64
+#define FAKEMENU_SEARCH_RESULTS 20
+#define FAKEMENU_SEARCH_PATH_SEP L" > "
+#define FAKEMENU_HOVER_TIMER 1
+#define FAKEMENU_RECORD_MAGIC 0x43524D46 // "FMRC"
+#define FAKEMENU_RECORD_VERSION 1
+#define FAKEMENU_RECORD_SEARCH (-2)     // The menu index of the search results
+#define FAKEMENU_RECORD_MAX_DEPTH 64
+#define FAKEMENU_REPLAY_DONE 0x80000000  // The internal flag of FAKEMENU_REPLAY
+#define FAKEMENU_TRIM_INTERVAL 1000      // The check of the idle trees, in milliseconds
+#define FAKEMENU_KEYUP_TIMEOUT 500       // The wait for the eaten key-ups after the tracking
+#define FAKEMENU_OWNERDATA_CACHE 128     // The cached rows of an owner-data menu
+#define FAKEMENU_OWNERDATA_TEXT 256      // The label buffer of the callback
+
+#define WM_FAKEMENU_REPAINT (WM_USER + 101)
+#define WM_FAKEMENU_RESULT (WM_USER + 102)  // Reports the asynchronous tracking to the callback
+
+// The performance counters (FAKEMENU_ENABLE_STATS)
+enum FAKEMENU_STAT
+{
+    FAKEMENU_STAT_ITEMS_MEASURED,
+    FAKEMENU_STAT_MEASURE_TIME,     // In ticks
+    FAKEMENU_STAT_PAINTS,
+    FAKEMENU_STAT_PAINT_TIME,       // In ticks
+    FAKEMENU_STAT_HIT_TESTS,
+    FAKEMENU_STAT_IS_ALIVE,
+    FAKEMENU_STAT_LOOP_ITERATIONS,
+    FAKEMENU_STAT_WAKEUPS,
+    FAKEMENU_STAT_IDLE_WAKEUPS,
+    FAKEMENU_STAT_WINDOWS_CREATED,
+    FAKEMENU_STAT_GDI_OBJECTS,
+    FAKEMENU_STAT_TRACKS,
+    FAKEMENU_STAT_FIRST_PAINT_TIME, // In ticks
+    FAKEMENU_STAT_ALLOCATIONS,      // Process-wide only
+    FAKEMENU_STAT_MAX
+};
+
+#ifdef FAKEMENU_ENABLE_STATS
+    class FakeMenu;
+    static VOID AddStat(FakeMenu* pMenu, INT iStat, LONG64 n);
+    #define FAKEMENU_STAT_ADD(pMenu, iStat, n) AddStat((pMenu), (iStat), (n))
+    #define FAKEMENU_STAT_TICKS(var) LONGLONG var = GetStatTicks()
+    #define FAKEMENU_STAT_ADD_TIME(pMenu, iStat, var) \
+        AddStat((pMenu), (iStat), GetStatTicks() - (var))
+
+    // The input-to-paint latency (FAKEMENU_EVENT_...)
+    static VOID MarkLatency(FakeMenu* pMenu, INT nEvent);
+    static VOID RecordLatency(FakeMenu* pMenu, BOOL bEnd);
+    #define FAKEMENU_LATENCY_MARK(pMenu, nEvent) MarkLatency((pMenu), (nEvent))
+    #define FAKEMENU_LATENCY_PAINTED(pMenu) RecordLatency((pMenu), FALSE)
+    #define FAKEMENU_LATENCY_END() RecordLatency(NULL, TRUE)
+#else
+    #define FAKEMENU_STAT_ADD(pMenu, iStat, n)
+    #define FAKEMENU_STAT_TICKS(var)
+    #define FAKEMENU_STAT_ADD_TIME(pMenu, iStat, var)
+    #define FAKEMENU_LATENCY_MARK(pMenu, nEvent)
+    #define FAKEMENU_LATENCY_PAINTED(pMenu)
+    #define FAKEMENU_LATENCY_END()
+#endif
+
+// The log-linear latency histogram: 16 buckets per power of two, in milliseconds
+#define FAKEMENU_LATENCY_SUB_BUCKETS 16
+#define FAKEMENU_LATENCY_BUCKETS (17 * FAKEMENU_LATENCY_SUB_BUCKETS)
+#define FAKEMENU_LATENCY_MAX ((1 << 20) - 1)
+
+// Animation kinds
+#define FAKEMENU_ANIMATION_NONE 0
+#define FAKEMENU_ANIMATION_OPEN 1
+#define FAKEMENU_ANIMATION_FLASH 2
+#define FAKEMENU_ANIMATION_CLOSE 3
 
 #ifdef __REACTOS__
     void *operator new(size_t size)
@@ -35,26 +117,57 @@
     }
 #endif
 
+#ifdef FAKEMENU_ENABLE_STATS
+static inline LONGLONG GetStatTicks(VOID)
+{
+    LARGE_INTEGER li;
+    ::QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+#endif
+
+// The heap of the library. The allocations are counted
+static inline LPVOID AllocMemory(SIZE_T cb)
+{
+    FAKEMENU_STAT_ADD(NULL, FAKEMENU_STAT_ALLOCATIONS, 1);
+    return malloc(cb);
+}
+
+static inline LPVOID ReallocMemory(LPVOID pv, SIZE_T cb)
+{
+    FAKEMENU_STAT_ADD(NULL, FAKEMENU_STAT_ALLOCATIONS, 1);
+    return realloc(pv, cb);
+}
+
+static inline LPWSTR DupString(LPCWSTR psz)
+{
+    FAKEMENU_STAT_ADD(NULL, FAKEMENU_STAT_ALLOCATIONS, 1);
+    return _wcsdup(psz);
+}
+
+static HDC GetMaskDC(SIZE size, HBITMAP* phbmMask);
+static VOID FreeMaskDC(VOID);
+static VOID FreeAllMaskDCs(VOID);
+
 static VOID
 MaskedDrawFrameControl(HDC hdc, LPRECT prc, UINT uType, UINT uState, COLORREF rgbFore)
 {
     SIZE size = { prc->right - prc->left, prc->bottom - prc->top };
     RECT rc = *prc;
     OffsetRect(&rc, -prc->left, -prc->top);
-    HBITMAP hbmMask = ::CreateBitmap(size.cx, size.cy, 1, 1, NULL);
-    HDC hdcMem = ::CreateCompatibleDC(NULL);
+    HBITMAP hbmMask;
+    HDC hdcMem = GetMaskDC(size, &hbmMask);
+    if (!hdcMem)
+        return;
 
-    HGDIOBJ hbmOld = ::SelectObject(hdcMem, hbmMask);
+    // The cached bitmap can be larger
+    ::PatBlt(hdcMem, 0, 0, size.cx, size.cy, WHITENESS);
     ::DrawFrameControl(hdcMem, &rc, uType, uState);
 
     ::SelectObject(hdc, GetStockBrush(DC_BRUSH));
     ::SetDCBrushColor(hdc, rgbFore);
     ::MaskBlt(hdc, prc->left, prc->top, size.cx, size.cy, hdc, prc->left, prc->top,
               hbmMask, 0, 0, MAKEROP4(SRCCOPY, PATCOPY));
-
-    ::SelectObject(hdcMem, hbmOld);
-    ::DeleteDC(hdcMem);
-    ::DeleteObject(hbmMask);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -66,10 +179,17 @@ class FakeMenu;
 class FakeMenuItem
 {
 public:
+    SLIST_ENTRY m_entryDirty;   // In the dirty list of the owner menu
+    volatile LONG m_fDirty;     // In the dirty list?
     INT m_nID;          // The item ID
     UINT m_fType;       // Same as MENUITEMINFO.fType
     UINT m_fState;      // Same as MENUITEMINFO.fState
     LPWSTR m_pszText;   // malloc'ed
+    LPWSTR m_pszDisplay;    // The text without the prefixes (malloc'ed)
+    INT m_iUnderline;       // The index of the underlined character in m_pszDisplay, or -1
+    WCHAR m_chAccess;       // The folded access key, or zero
+    INT m_xUnderline;       // The underline position (by DoMeasureItem)
+    INT m_cxUnderline;      // The underline width (by DoMeasureItem)
     INT m_cxyItem;      // The item height
     FakeMenu* m_pSubMenu;
 
@@ -82,6 +202,9 @@ public:
     FakeMenuItem(const MENUITEMINFO* pmii);
     virtual ~FakeMenuItem();
 
+    static void* operator new(size_t size) { return AllocMemory(size); }
+    static void operator delete(void* ptr) { free(ptr); }
+
     BOOL IsSep() const
     {
         return (m_fType & MFT_SEPARATOR);
@@ -91,38 +214,209 @@ public:
     {
         return (m_fState & (MFS_GRAYED | MFS_DISABLED));
     }
+
+    BOOL ChangeState(UINT fMask, UINT fValue);
+    VOID SetRow(const MENUITEMINFO* pmii, LPWSTR pszText, LPWSTR pszDisplay);
+
+protected:
+    VOID ParseText();
+};
+
+// The position index entry
+struct FAKEMENU_POSITION
+{
+    FakeMenuItem* pItem;
+    INT iNextSelectable;    // For GetNextSelectable (cyclic)
+    INT iPrevSelectable;    // For GetNextSelectable (cyclic)
+};
+
+// The cache slot of an owner-data row
+struct FAKEMENU_OWNERDATA_ROW
+{
+    INT iItem;              // The cached position, or -1
+    INT cSubItems;          // The rows of the sub-menu
+    LPARAM lParam;          // The lParamMenu of the sub-menu
+    FakeMenuItem* pItem;    // Refilled in place by the next row of the slot
+    LPWSTR pszText;         // The texts of pItem (malloc'ed), also refilled in place
+    LPWSTR pszDisplay;
+    INT cchMax;             // The capacity of pszText and pszDisplay
+};
+
+// The access key table entry
+struct FAKEMENU_ACCESS
+{
+    WCHAR chAccess;     // The folded access key
+    INT iItem;          // The item position
+};
+
+// The search index entry
+struct FAKEMENU_SEARCH_ENTRY
+{
+    FakeMenuItem* pItem;
+    INT nID;
+    LPWSTR pszPath;         // "File > Open" (malloc'ed)
+    LPWSTR pszFolded;       // The lowercase pszPath (malloc'ed)
+    ULONGLONG maskChars;    // The characters in pszFolded
+};
+
+// The type-ahead index entry
+struct FAKEMENU_PREFIX
+{
+    LPCWSTR pszText;    // The lowercase display text of the item (in the block of m_pPrefix)
+    INT iItem;          // The item position
+};
+
+// The recorded input message
+struct FAKEMENU_RECORD_EVENT
+{
+    DWORD dwTime;       // From the beginning of the tracking, in milliseconds
+    INT iMenu;          // The pre-order index of the menu in the tree, or FAKEMENU_RECORD_SEARCH
+    UINT uMsg;
+    DWORD wParam;
+    DWORD lParam;
+};
+
+// The growing output of the recording
+struct FAKEMENU_BUFFER
+{
+    LPBYTE pb;
+    SIZE_T cb;
+    SIZE_T cbMax;
+    BOOL bError;
+};
+
+// The input of the replay
+struct FAKEMENU_READER
+{
+    const BYTE* pb;
+    SIZE_T cb;
+    SIZE_T ib;
+    BOOL bError;
 };
 
-// The FakeMenu
-class FakeMenu
+// The FakeMenu. FakeMenuNav has the navigation and FakeMenu is its Win32 view
+class FakeMenu : public FakeMenuNav
 {
 protected:
     HWND m_hwnd;                // The window handle
     BOOL m_fKeyboardUsing;      // Using Keyboard?
+    BOOL m_fMouseTracking;      // Waiting for WM_MOUSELEAVE?
 #ifndef __REACTOS__
     HTHEME m_hTheme;            // The window theme
 #endif
     INT m_cItems;               // The # of items
     FakeMenuItem* m_pItems;     // The fake menu items
+    FAKEMENU_POSITION* m_pPositions;    // The items by position
+    INT m_cPositionsMax;
+    BOOL m_fSelectableDirty;    // Rebuild the selectable links of m_pPositions?
     FakeMenu* m_pParent;        // The parent
     HFONT m_hFont;              // The font
+    BOOL m_fOwnFont;            // m_hFont is created for this menu? The sub-menus share it
     INT m_iParentItem;          // The index from the parent
     MARGINS m_marginsItem;      // The margins
 
-    // Hot-keys
-    INT m_nHotKeyLeft;
-    INT m_nHotKeyRight;
-    INT m_nHotKeyUp;
-    INT m_nHotKeyDown;
-    INT m_nHotKeyReturn;
-    INT m_nHotKeyEscape;
-
     BOOL m_fDone;               // The task is done?
     BOOL m_fDestroying;         // Is it destroying the window?
-    BOOL m_fDelayed;            // Delayed for animation?
     INT m_idResult;             // The ID to return
-    INT m_iOpenSubMenu;         // The index to the sub menu that is open
-    INT m_iSelected;            // The selected index
+    POINT m_ptLastMouse;        // The last mouse position in screen coordinates
+
+    // Scrolling. m_rcItem is in the content coordinates
+    INT m_yScroll;              // The content position at the client top
+    INT m_cyContent;            // The height of the items
+    INT m_cyView;               // The client height
+
+    // The layout of MeasureItems, kept while the items and the font are unchanged
+    BOOL m_fLayoutDirty;
+    SIZE m_sizeLayout;
+
+    // Animation
+    BOOL m_fAnimate;            // Animate the tree? (root only)
+    BOOL m_fDestroyLater;       // Destroy the tree after the animation? (root only)
+    INT m_nAnimation;           // FAKEMENU_ANIMATION_...
+    DWORD m_dwAnimationStart;   // The tick count when the animation started
+    BYTE m_bAlpha;              // The current opacity of the window
+    BYTE m_bAlphaFrom;          // The opacity when the animation started
+    INT m_iFlashItem;           // The item to flash
+    POINT m_ptAnimation;        // The final position of the window
+    FakeMenu* m_pNextAnimating; // The next one in the animating list
+
+    // Tracking (root only)
+    HANDLE m_hCancelEvent;      // Signaled by FakeMenu_Cancel
+    volatile LONG m_fCancelled; // Cancelled by FakeMenu_Cancel?
+    BOOL m_fForegroundChanged;  // Set by OnWinEvent
+    BOOL m_fStdMenuShown;       // Set by OnWinEvent
+    HWINEVENTHOOK m_hForegroundHook;
+    HWINEVENTHOOK m_hMenuPopupHook;
+    HHOOK m_hKeyboardHook;
+
+    // Asynchronous tracking (root only)
+    volatile LONG m_fAsync;     // Tracking asynchronously? Read by Cancel of any thread
+    BOOL m_fCheckPending;       // s_uCheckMessage has been posted?
+    DWORD m_dwThreadId;         // The tracking thread
+    HHOOK m_hGetMessageHook;
+    FAKEMENUPROC m_pfnCallback;
+    LPVOID m_pCallbackContext;
+    FakeMenu* m_pNextLive;      // The next one in the live-menu registry
+    LONG m_lSharedHwnd;         // The window in the shared registry
+
+    // The items whose states are changed by any thread
+    SLIST_HEADER m_listDirty;
+    volatile LONG m_fRepaintPending;    // WM_FAKEMENU_REPAINT has been posted?
+
+    // The access keys sorted by the key and the position (built on demand)
+    FAKEMENU_ACCESS* m_pAccess;
+    INT m_cAccess;
+    BOOL m_fAccessDirty;        // Rebuild m_pAccess?
+
+    // The type-ahead search
+    FAKEMENU_PREFIX* m_pPrefix; // Sorted by the lowercase text (built on demand)
+    INT* m_piPrefixRank;        // The item position --> the index in m_pPrefix, or -1
+    INT m_cPrefix;
+    BOOL m_fPrefixDirty;        // Rebuild m_pPrefix?
+    WCHAR m_szTypeAhead[FAKEMENU_TYPEAHEAD_MAX];
+    INT m_cchTypeAhead;
+    DWORD m_dwTypeAheadTime;    // The message time of the last typed character
+
+    // Search mode (root only)
+    BOOL m_fSearchEnabled;
+    FakeMenu* m_pSearch;        // The menu of the results
+    FAKEMENU_SEARCH_ENTRY* m_pSearchIndex;  // Built when the search starts
+    INT m_cSearchIndex;
+    INT m_cSearchIndexMax;
+    WCHAR m_szQuery[FAKEMENU_SEARCH_MAX];
+    INT m_cchQuery;
+    INT* m_piSearchMatches;     // The entries matched by the first m_cchMatched characters
+    INT m_cSearchMatches;
+    INT m_cchMatched;           // Zero if m_piSearchMatches is not valid
+
+    // Recording (root only)
+    LPWSTR m_pszRecordFile;     // Record the trackings to the file (malloc'ed)
+    FAKEMENU_RECORD_EVENT* m_pRecord;
+    INT m_cRecord;
+    INT m_cRecordMax;
+    DWORD m_dwRecordStart;      // The tick count when the tracking began
+    INT m_iTreeIndex;           // The pre-order index in the tree
+
+    // Trimming
+    BOOL m_fTrimming;           // Destroying the window to trim?
+    DWORD m_dwLastUsed;         // The tick count when the tracking ended (root only)
+    FakeMenu* m_pNextIdle;      // The next one in s_pIdleRoots (root only)
+    BOOL m_fIdle;               // In s_pIdleRoots, or being trimmed from it?
+    BOOL m_fIdleTrimming;       // Detached from s_pIdleRoots and trimmed by the owner thread
+
+    // Owner data. The rows are fetched by m_pfnData into the slot of iItem % FAKEMENU_OWNERDATA_CACHE
+    INT m_cOwnerData;           // The # of rows
+    FAKEMENUDATAPROC m_pfnData;
+    LPVOID m_pDataContext;
+    LPARAM m_lParamData;        // The lParamMenu of the callback
+    FAKEMENU_OWNERDATA_ROW* m_pRows;    // The cache (allocated on the first fetch)
+    INT m_cyRow;                // The rows have one height
+    FakeMenu* m_pDataSub;       // The sub-menu shared by the rows
+
+#ifdef FAKEMENU_ENABLE_STATS
+    LONG64 m_aStats[FAKEMENU_STAT_MAX]; // The counters of the tree (root only)
+    LONGLONG m_qwTrackStart;            // The ticks of TrackPopup until the first paint
+#endif
 
     VOID InitStatus();
     BOOL DoMeasureItem(INT iItem, FakeMenuItem* pItem, LPMEASUREITEMSTRUCT pMeasure);
@@ -133,22 +427,58 @@ protected:
     void ChooseLocation(POINT& pt, INT cx, INT cy, LPCRECT prcExclude = NULL);
     static LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
     INT GetNextSelectable(INT iItem, BOOL bNext);
+    VOID BuildSelectable();
+    INT ItemFromY(INT y);
+    INT GetPageItem(INT iItem, BOOL bNext);
+    VOID ScrollTo(INT yScroll);
     INT GetNextIndex(INT iItem, BOOL bNext);
     BOOL IsFamilyHWND(HWND hwnd);
-    static BOOL CALLBACK EnumCloseProc(HWND hwnd, LPARAM lParam);
-    static BOOL CALLBACK EnumFindStdMenuProc(HWND hwnd, LPARAM lParam);
+    VOID CloseOtherMenus();
     VOID SetActiveMenu(FakeMenu *pActive);
-    VOID SetHotKeys(BOOL bSet);
+    VOID SetAlpha(BYTE bAlpha);
+    VOID StartAnimation(INT nAnimation);
+    VOID StopAnimation();
+    BOOL StepAnimation(DWORD dwNow);
+    BOOL IsClosing() const;
+    BOOL IsTreeAnimating();
+    VOID HideWindow(BOOL bFlash);
+    static VOID CALLBACK OnFrameTimer(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime);
+    static VOID CALLBACK OnWinEvent(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hwnd,
+                                    LONG idObject, LONG idChild, DWORD idEventThread,
+                                    DWORD dwmsEventTime);
+    static LRESULT CALLBACK OnKeyboardLL(INT nCode, WPARAM wParam, LPARAM lParam);
+    static VOID CALLBACK OnKeyUpTimer(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime);
+    static VOID ReleaseKeyUpHook();
+    static LRESULT CALLBACK OnGetMessage(INT nCode, WPARAM wParam, LPARAM lParam);
+    VOID BeginTracking();
+    VOID EndTracking();
+    VOID ScheduleCheck();
+    VOID ShowPopup(POINT pt, BOOL fKeyboard, LPCRECT prcExclude);
+    VOID OpenSubMenu(INT iItem, BOOL fKeyboard);
+    FakeMenu* GetOpenSubMenu();
+    BOOL IsInSafeTriangle(POINT ptPrev, POINT pt);
+    VOID MarkDirty(FakeMenuItem* pItem);
+    INT ApplyStates(const FAKEMENU_STATE_CHANGE** ppById, INT cById, BYTE* pbFound,
+                    const FAKEMENU_STATE_CHANGE** ppByPos, INT cByPos);
+    VOID FlushDirty(HWND hwnd);
 
 public:
     static BOOL DoRegisterClass(VOID);
+#ifdef FAKEMENU_ENABLE_STATS
+    friend VOID AddStat(FakeMenu* pMenu, INT iStat, LONG64 n);
+    BOOL GetStats(FAKEMENU_STATS* pStats);
+    VOID ResetStats();
+#endif
 
     FakeMenu();
     static FakeMenu* FromHWND(HWND hwnd);
+    static void* operator new(size_t size) { return AllocMemory(size); }
+    static void operator delete(void* ptr) { free(ptr); }
     static FakeMenu* FromHMENU(HMENU hMenu, FakeMenu* pParent = NULL);
     virtual ~FakeMenu();
 
     void SetLogFont(LPLOGFONT plf = NULL);
+    VOID ShareFont(HFONT hFont);
 
     FakeMenu* GetRoot();
 
@@ -162,6 +492,7 @@ public:
     BOOL CheckItem(INT iItem, UINT uCheck = MF_BYPOSITION | MF_CHECKED);
     BOOL CheckRadioItem(INT iFirst, INT iLast, INT iCheck, BOOL bByPosition = TRUE);
     BOOL EnableItem(INT iItem, UINT uEnable = MF_BYPOSITION | MF_ENABLED);
+    INT SetItemStates(const FAKEMENU_STATE_CHANGE* pChanges, INT cChanges);
 
     BOOL AddString(UINT nID, LPCWSTR text, UINT fState = MFS_ENABLED);
     INT AppendItem(const MENUITEMINFO* pmii);
@@ -171,11 +502,19 @@ public:
     void SetCurSel(HWND hwnd, INT iSelected);
 
     INT HitTest(INT x, INT y);
+    VOID EnsureVisible(INT iItem);
+    BOOL SelectItem(INT iItem);
 
     INT TrackPopup(POINT pt, BOOL fKeyboard = FALSE, LPCRECT prcExclude = NULL);
-    VOID HideTree(INT idResult);
-    VOID HideTreeDelay(INT idResult, HWND hwndDelay);
+    BOOL TrackPopupAsync(POINT pt, FAKEMENUPROC pfnCallback, LPVOID pContext);
+    VOID FinishAsync(BOOL bDefer = FALSE);
+    VOID ReportAsync();
+    VOID HideTree(INT idResult, FakeMenu* pFlash = NULL);
     void DestroyTree(INT idResult);
+    BOOL DestroyLater();
+    VOID Cancel();
+    VOID EnableSearch(BOOL bEnable);
+    VOID EndSearch();
 
     virtual LRESULT CALLBACK
     WindowProcDx(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
@@ -183,7 +522,6 @@ public:
 protected:
     BOOL OnCreate(HWND hwnd, LPCREATESTRUCT lpCreateStruct);
     void OnShowWindow(HWND hwnd, BOOL fShow, UINT status);
-    void OnHotKey(HWND hwnd, int idHotKey, UINT fuModifiers, UINT vk);
     void OnPaint(HWND hwnd);
     void OnMouseMove(HWND hwnd, INT x, INT y, UINT keyFlags);
     void OnLButtonDown(HWND hwnd, BOOL fDoubleClick, int x, int y, UINT keyFlags);
@@ -195,32 +533,251 @@ protected:
     void OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT flags);
     void OnChar(HWND hwnd, TCHAR ch, int cRepeat);
     void OnSysChar(HWND hwnd, TCHAR ch, int cRepeat);
+    void OnMouseLeave(HWND hwnd);
     void OnTimer(HWND hwnd, UINT id);
+    void OnMouseWheel(HWND hwnd, int xPos, int yPos, int zDelta, UINT fwKeys);
     void OnDestroy(HWND hwnd);
-    void OnReturn();
-    void OnLeft();
-    void OnRight();
-    void OnEscape();
+
+    // FakeMenuNav
+    virtual int NavGetCount();
+    virtual unsigned NavGetItemFlags(int iItem);
+    virtual int NavGetNextSelectable(int iItem, bool bNext);
+    virtual int NavGetPageItem(int iItem, bool bNext);
+    virtual bool NavIsSubMenuOpen();
+    virtual FakeMenuNav* NavGetParent();
+    virtual void NavSetCurSel(int iItem, bool bEnsureVisible);
+    virtual void NavOpenSubMenu(int iItem, bool fKeyboard);
+    virtual void NavClose();
+    virtual void NavChoose(int iItem, FakeMenuNav* pRoot);
 
     BOOL IsAlive();
-    INT FindItemByAccessChar(TCHAR ch);
+    BOOL PreTranslate(MSG& msg);
+    VOID BuildAccessTable();
+    INT FindItemByAccessChar(TCHAR ch, INT* pcMatches);
+    VOID BuildPrefixIndex();
+    INT FindItemByPrefix(LPCWSTR pszPrefix, INT cchPrefix, BOOL bNext);
+    INT TypeAhead(TCHAR ch);
+    VOID AddSearchEntries(FakeMenu* pMenu, LPCWSTR pszPath);
+    VOID BuildSearchIndex();
+    VOID FreeSearchIndex();
+    VOID Search();
+    VOID OnSearchChar(TCHAR ch);
+    BOOL IsSearchResults() const;
     void DoMessageLoop(MSG& msg);
+    INT AssignTreeIndexes(INT iNext);
+    INT CollectTree(FakeMenu** ppMenus, INT iNext);
+    VOID RecordInput(UINT uMsg, WPARAM wParam, LPARAM lParam, DWORD dwTime);
+    VOID WriteRecordedMenu(FAKEMENU_BUFFER* pBuffer);
+    static FakeMenu* ReadRecordedMenu(FAKEMENU_READER* pReader, FakeMenu* pParent, INT iDepth);
+    BOOL SaveRecording();
+    VOID TrimTree(INT nLevel);
+    VOID AddMemoryUsage(FAKEMENU_MEMORY* pMemory);
+    VOID SetIdle(BOOL bIdle);
+    INT GetCount() const { return (m_pfnData ? m_cOwnerData : m_cItems); }
+    FakeMenuItem* FetchRow(INT iItem);
+    VOID ClearRows();
+    VOID FreeRows();
+    VOID MeasureRows(SIZE& size);
+    VOID BindDataSub(INT iItem);
+    static VOID CALLBACK OnTrimTimer(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime);
+
+public:
+    BOOL Record(LPCWSTR pszFileName);
+    static BOOL Replay(LPCWSTR pszFileName, FAKEMENU_REPLAY* pReplay);
+    BOOL GetMemoryUsage(FAKEMENU_MEMORY* pMemory);
+    BOOL Trim(INT nLevel);
+    static VOID TrimIdleRoots(BOOL bAll);
+    BOOL SetOwnerData(INT cItems, FAKEMENUDATAPROC pfnData, LPARAM lParam, LPVOID pContext);
+    VOID InvalidateOwnerData(INT iFirst, INT iLast);
 };
 
 // static variables
-static FakeMenu* s_pActiveMenu = NULL;
-static HWND s_hwndOldActive = NULL;
-static HWND s_hwndOldForeground = NULL;
+#ifdef _MSC_VER
+    #define FAKEMENU_THREAD __declspec(thread)
+#else
+    #define FAKEMENU_THREAD __thread
+#endif
+
+// The mask of MaskedDrawFrameControl of a thread. Listed so that FakeMenu_ExitInstance frees
+// the masks of all threads
+struct FAKEMENU_MASK
+{
+    HDC hdc;
+    HBITMAP hbm;
+    HGDIOBJ hbmOld;
+    SIZE size;
+    FAKEMENU_MASK* pNext;
+};
+
+// The tracking state of a thread. The threads can track their menus at the same time
+struct FAKEMENU_SESSION
+{
+    FakeMenu* pActiveMenu;
+    HWND hwndOldActive;
+    HWND hwndOldForeground;
+    FakeMenu* pTrackingRoot;    // The root being tracked
+    DWORD vkLastDown;           // For the repeat flag of the keyboard hook
+    BYTE abKeysEaten[256 / 8];  // The keys whose key-down the keyboard hook ate
+    HHOOK hKeyUpHook;           // The keyboard hook kept after the tracking for the eaten key-ups
+    UINT_PTR idKeyUpTimer;      // Releases hKeyUpHook
+    FakeMenu* pAnimating;       // The menus being animated by the frame clock
+    UINT_PTR idFrameTimer;      // The frame clock
+    FakeMenu* pRecording;       // The root whose input is recorded
+    UINT_PTR idTrimTimer;       // Checks the idle roots of the thread
+    FAKEMENU_MASK* pMask;       // The mask of MaskedDrawFrameControl (until trimmed)
+    LONG nMaskGeneration;       // pMask is freed if not s_nMaskGeneration
+#ifdef FAKEMENU_ENABLE_STATS
+    INT iPendingEvent;          // The input waiting for the paint (FAKEMENU_EVENT_... + 1), or zero
+    DWORD dwPendingTime;        // The message time of the input
+    FakeMenu* pPendingMenu;     // The menu whose paint reflects the input
+#endif
+};
+static FAKEMENU_THREAD FAKEMENU_SESSION s_session;
+
+// The live-menu registry: the roots being tracked in this process
+static FakeMenu* s_pLiveRoots = NULL;
+static CRITICAL_SECTION s_csLiveRoots;
+static DWORD s_dwKeyboardThread = 0;    // The thread that gets the keyboard (the latest root)
+
+// Posted to the tracking thread to check the asynchronous tracking. Registered so that it
+// cannot collide with the thread messages of the host
+static UINT s_uCheckMessage = 0;
+
+// The automatic trimming (FakeMenu_SetAutoTrim)
+static DWORD s_dwAutoTrimIdle = 0;      // Zero if disabled
+static INT s_nAutoTrimLevel = FAKEMENU_TRIM_WINDOWS;
+static HANDLE s_hLowMemory = NULL;      // The low-memory resource notification
+
+// The roots to be trimmed automatically, of all threads. Guarded by s_csLiveRoots, for a root
+// can be deleted by another thread. Each thread trims its own (m_dwThreadId) by its timer
+static FakeMenu* s_pIdleRoots = NULL;
+
+// The optional live-menu registry shared among processes
+struct FAKEMENU_SHARED_REGISTRY
+{
+    volatile LONG ahwnd[FAKEMENU_SHARED_SLOTS]; // The root windows (HandleToLong)
+};
+static HANDLE s_hSharedRegistry = NULL;
+static FAKEMENU_SHARED_REGISTRY* s_pSharedRegistry = NULL;
+
+// The masks of all threads. Guarded by s_csLiveRoots
+static FAKEMENU_MASK* s_pMasks = NULL;
+static LONG s_nMaskGeneration = 0;      // Incremented by FreeAllMaskDCs
+
+static VOID DeleteMask(FAKEMENU_MASK* pMask)
+{
+    ::SelectObject(pMask->hdc, pMask->hbmOld);
+    ::DeleteDC(pMask->hdc);
+    ::DeleteObject(pMask->hbm);
+    free(pMask);
+}
+
+// The memory DC of the thread with the monochrome bitmap of the size at least
+static HDC GetMaskDC(SIZE size, HBITMAP* phbmMask)
+{
+    if (s_session.nMaskGeneration != s_nMaskGeneration) // Freed by FreeAllMaskDCs?
+    {
+        s_session.pMask = NULL;
+        s_session.nMaskGeneration = s_nMaskGeneration;
+    }
+
+    auto pMask = s_session.pMask;
+    if (pMask && pMask->size.cx >= size.cx && pMask->size.cy >= size.cy)
+    {
+        *phbmMask = pMask->hbm;
+        return pMask->hdc;
+    }
+
+    if (pMask)
+    {
+        size.cx = max(size.cx, pMask->size.cx);
+        size.cy = max(size.cy, pMask->size.cy);
+        FreeMaskDC();
+    }
+
+    pMask = (FAKEMENU_MASK*)AllocMemory(sizeof(FAKEMENU_MASK));
+    HDC hdcMem = ::CreateCompatibleDC(NULL);
+    HBITMAP hbmMask = ::CreateBitmap(size.cx, size.cy, 1, 1, NULL);
+    if (!pMask || !hdcMem || !hbmMask)
+    {
+        free(pMask);
+        if (hdcMem)
+            ::DeleteDC(hdcMem);
+        if (hbmMask)
+            ::DeleteObject(hbmMask);
+        return NULL;
+    }
+    FAKEMENU_STAT_ADD(NULL, FAKEMENU_STAT_GDI_OBJECTS, 2);
+
+    pMask->hdc = hdcMem;
+    pMask->hbm = hbmMask;
+    pMask->hbmOld = ::SelectObject(hdcMem, hbmMask);
+    pMask->size = size;
+
+    ::EnterCriticalSection(&s_csLiveRoots);
+    pMask->pNext = s_pMasks;
+    s_pMasks = pMask;
+    ::LeaveCriticalSection(&s_csLiveRoots);
+
+    s_session.pMask = pMask;
+    *phbmMask = hbmMask;
+    return hdcMem;
+}
+
+// Free the mask of the thread
+static VOID FreeMaskDC(VOID)
+{
+    auto pMask = s_session.pMask;
+    if (!pMask || s_session.nMaskGeneration != s_nMaskGeneration)
+    {
+        s_session.pMask = NULL;
+        return;
+    }
+
+    ::EnterCriticalSection(&s_csLiveRoots);
+    for (FAKEMENU_MASK** ppMask = &s_pMasks; *ppMask; ppMask = &(*ppMask)->pNext)
+    {
+        if (*ppMask == pMask)
+        {
+            *ppMask = pMask->pNext;
+            break;
+        }
+    }
+    ::LeaveCriticalSection(&s_csLiveRoots);
+
+    DeleteMask(pMask);
+    s_session.pMask = NULL;
+}
+
+// Free the masks of all threads. The threads must not be drawing
+static VOID FreeAllMaskDCs(VOID)
+{
+    ::EnterCriticalSection(&s_csLiveRoots);
+    while (s_pMasks)
+    {
+        auto pMask = s_pMasks;
+        s_pMasks = pMask->pNext;
+        DeleteMask(pMask);
+    }
+    ::InterlockedIncrement(&s_nMaskGeneration);
+    ::LeaveCriticalSection(&s_csLiveRoots);
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////////
 // FakeMenuItem impl
 
 FakeMenuItem::FakeMenuItem(const MENUITEMINFO* pmii)
 {
+    m_entryDirty.Next = NULL;
+    m_fDirty = FALSE;
     m_nID = 0;
     m_fType = pmii->fType;
     m_fState = pmii->fState;
     m_pszText = NULL;
+    m_pszDisplay = NULL;
+    m_iUnderline = -1;
+    m_chAccess = 0;
+    m_xUnderline = m_cxUnderline = 0;
     m_pSubMenu = NULL;
     m_cxyItem = 0;
     m_pNext = m_pPrev = NULL;
@@ -228,7 +785,8 @@ FakeMenuItem::FakeMenuItem(const MENUITEMINFO* pmii)
     if (!(pmii->fType & MFT_SEPARATOR))
     {
         m_nID = pmii->wID;
-        m_pszText = _wcsdup((LPCTSTR)pmii->dwTypeData);
+        m_pszText = DupString((LPCTSTR)pmii->dwTypeData);
+        ParseText();
     }
 
     SetRectEmpty(&m_rcItem);
@@ -237,6 +795,83 @@ FakeMenuItem::FakeMenuItem(const MENUITEMINFO* pmii)
 FakeMenuItem::~FakeMenuItem()
 {
     free(m_pszText);
+    free(m_pszDisplay);
+}
+
+// Refill the owner-data row in place. The texts go to the buffers of the cache slot
+VOID FakeMenuItem::SetRow(const MENUITEMINFO* pmii, LPWSTR pszText, LPWSTR pszDisplay)
+{
+    m_nID = 0;
+    m_fType = pmii->fType;
+    m_fState = pmii->fState;
+    m_pszText = NULL;
+    m_pszDisplay = NULL;
+    m_iUnderline = -1;
+    m_chAccess = 0;
+    m_xUnderline = m_cxUnderline = 0;
+    m_pSubMenu = NULL;
+    m_cxyItem = 0;
+    SetRectEmpty(&m_rcItem);
+
+    if (!(pmii->fType & MFT_SEPARATOR))
+    {
+        m_nID = pmii->wID;
+        lstrcpyW(pszText, (LPCWSTR)pmii->dwTypeData);
+        m_pszText = pszText;
+        m_pszDisplay = pszDisplay;
+        ParseText();
+    }
+}
+
+static inline WCHAR FoldAccessChar(WCHAR ch)
+{
+    return (WCHAR)(ULONG_PTR)::CharUpperW((LPWSTR)(ULONG_PTR)ch);
+}
+
+// "&File" --> "File" with the underline at 0. "&&" --> "&"
+VOID FakeMenuItem::ParseText()
+{
+    if (!m_pszText)
+        return;
+
+    if (!m_pszDisplay) // Not the buffer of SetRow?
+        m_pszDisplay = (LPWSTR)AllocMemory((lstrlenW(m_pszText) + 1) * sizeof(WCHAR));
+    if (!m_pszDisplay)
+        return;
+
+    INT iDisplay = 0;
+    for (LPCWSTR pch = m_pszText; *pch; ++pch)
+    {
+        if (*pch == L'&')
+        {
+            ++pch;
+            if (!*pch)
+                break;
+
+            if (*pch != L'&' && m_iUnderline < 0)
+            {
+                m_iUnderline = iDisplay;
+                m_chAccess = FoldAccessChar(*pch);
+            }
+        }
+        m_pszDisplay[iDisplay++] = *pch;
+    }
+    m_pszDisplay[iDisplay] = 0;
+}
+
+// Update the state atomically. Returns TRUE if changed
+BOOL FakeMenuItem::ChangeState(UINT fMask, UINT fValue)
+{
+    auto pfState = (volatile LONG*)&m_fState;
+    for (;;)
+    {
+        LONG fOld = *pfState;
+        LONG fNew = (LONG)((fOld & ~fMask) | (fValue & fMask));
+        if (fNew == fOld)
+            return FALSE;
+        if (::InterlockedCompareExchange(pfState, fNew, fOld) == fOld)
+            return TRUE;
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -274,14 +909,19 @@ BOOL FakeMenu::DoMeasureItem(INT iItem, FakeMenuItem* pItem, LPMEASUREITEMSTRUCT
 
         // Get text extent
         SIZE size;
-        ::GetTextExtentPoint32W(hdc, pItem->m_pszText, lstrlenW(pItem->m_pszText), &size);
+        ::GetTextExtentPoint32W(hdc, pItem->m_pszDisplay, lstrlenW(pItem->m_pszDisplay), &size);
 
-        INT cxCheck = ::GetSystemMetrics(SM_CXMENUCHECK);
-        if (cxCheck < (pItem->m_cxyItem * 2 / 3))
-            cxCheck = (pItem->m_cxyItem * 2 / 3);
+        // Get the underline position
+        if (pItem->m_iUnderline >= 0)
+        {
+            SIZE sizeUnderline;
+            ::GetTextExtentPoint32W(hdc, pItem->m_pszDisplay, pItem->m_iUnderline, &sizeUnderline);
+            pItem->m_xUnderline = sizeUnderline.cx;
+            ::GetTextExtentPoint32W(hdc, &pItem->m_pszDisplay[pItem->m_iUnderline], 1, &sizeUnderline);
+            pItem->m_cxUnderline = sizeUnderline.cx;
+        }
 
-        // Calculate width and height of item
-        INT itemWidth = size.cx + cxCheck + (2 * FAKEMENU_MARGIN) + (2 * FAKEMENU_CX_SPACE);
+        // Calculate height of item
         INT itemHeight = tm.tmHeight + 2 * FAKEMENU_MARGIN;
 
         // Adjust the height
@@ -289,6 +929,14 @@ BOOL FakeMenu::DoMeasureItem(INT iItem, FakeMenuItem* pItem, LPMEASUREITEMSTRUCT
         if (itemHeight < cyMenuCheck + (2 * FAKEMENU_MARGIN))
             itemHeight = cyMenuCheck + (2 * FAKEMENU_MARGIN);
 
+        // The check mark is as large as the height allows, so the first layout is the last
+        INT cxCheck = ::GetSystemMetrics(SM_CXMENUCHECK);
+        if (cxCheck < (itemHeight * 2 / 3))
+            cxCheck = (itemHeight * 2 / 3);
+
+        // Calculate width of item
+        INT itemWidth = size.cx + cxCheck + (2 * FAKEMENU_MARGIN) + (2 * FAKEMENU_CX_SPACE);
+
         pMeasure->itemWidth = itemWidth;
         pMeasure->itemHeight = itemHeight;
 
@@ -444,7 +1092,7 @@ BOOL FakeMenu::DoDrawItem(INT iItem, FakeMenuItem* pItem, LPDRAWITEMSTRUCT pDraw
         }
     }
 
-    if (pItem->m_pszText) // Draw text?
+    if (pItem->m_pszDisplay) // Draw text?
     {
         INT cxCheck = ::GetSystemMetrics(SM_CXMENUCHECK);
         if (cxCheck < (pItem->m_cxyItem * 2 / 3))
@@ -456,19 +1104,37 @@ BOOL FakeMenu::DoDrawItem(INT iItem, FakeMenuItem* pItem, LPDRAWITEMSTRUCT pDraw
 
         HGDIOBJ hFontOld = ::SelectObject(hdc, m_hFont);
 
-        UINT dwFlags = DT_SINGLELINE | DT_LEFT | DT_VCENTER;
+        // The prefixes are already parsed
+        UINT dwFlags = DT_SINGLELINE | DT_LEFT | DT_VCENTER | DT_NOPREFIX;
 #ifndef __REACTOS__
         if (m_hTheme)
         {
             ::DrawThemeText(m_hTheme, hdc, MENU_POPUPITEM, state,
-                            pItem->m_pszText, -1, dwFlags, 0, &rcText);
+                            pItem->m_pszDisplay, -1, dwFlags, 0, &rcText);
+            ::GetThemeColor(m_hTheme, MENU_POPUPITEM, state, TMT_TEXTCOLOR, &rgbText);
         }
         else
 #endif
         {
             ::SetTextColor(hdc, rgbText);
             ::SetBkMode(hdc, TRANSPARENT);
-            ::DrawTextW(hdc, pItem->m_pszText, -1, &rcText, dwFlags);
+            ::DrawTextW(hdc, pItem->m_pszDisplay, -1, &rcText, dwFlags);
+        }
+
+        // Draw the underline of the access key
+        if (pItem->m_iUnderline >= 0)
+        {
+            TEXTMETRIC tm;
+            ::GetTextMetrics(hdc, &tm);
+
+            RECT rcLine;
+            rcLine.left = rcText.left + pItem->m_xUnderline;
+            rcLine.top = rcText.top + (rcText.bottom - rcText.top - tm.tmHeight) / 2 + tm.tmAscent + 1;
+            rcLine.right = rcLine.left + pItem->m_cxUnderline;
+            rcLine.bottom = rcLine.top + 1;
+
+            ::SetDCBrushColor(hdc, rgbText);
+            ::FillRect(hdc, &rcLine, (HBRUSH)::GetStockObject(DC_BRUSH));
         }
 
         ::SelectObject(hdc, hFontOld);
@@ -481,33 +1147,101 @@ VOID FakeMenu::InitStatus()
 {
     m_fDone = FALSE;
     m_fDestroying = FALSE;
-    m_fDelayed = FALSE;
     m_idResult = 0;
     m_iOpenSubMenu = -1;
     m_iSelected = -1;
+    m_yScroll = 0;
 }
 
 FakeMenu::FakeMenu()
     : m_hwnd(NULL)
     , m_fKeyboardUsing(FALSE)
+    , m_fMouseTracking(FALSE)
 #ifndef __REACTOS__
     , m_hTheme(NULL)
 #endif
     , m_cItems(0)
     , m_pItems(NULL)
+    , m_pPositions(NULL)
+    , m_cPositionsMax(0)
+    , m_fSelectableDirty(TRUE)
     , m_pParent(NULL)
     , m_hFont(GetStockFont(DEFAULT_GUI_FONT))
+    , m_fOwnFont(FALSE)
     , m_iParentItem(-1)
-    , m_iOpenSubMenu(0)
+    , m_cyContent(0)
+    , m_cyView(0)
+    , m_fLayoutDirty(TRUE)
+    , m_sizeLayout()
+    , m_fAnimate(FALSE)
+    , m_fDestroyLater(FALSE)
+    , m_nAnimation(FAKEMENU_ANIMATION_NONE)
+    , m_dwAnimationStart(0)
+    , m_bAlpha(255)
+    , m_bAlphaFrom(255)
+    , m_iFlashItem(-1)
+    , m_pNextAnimating(NULL)
+    , m_hCancelEvent(NULL)
+    , m_fCancelled(FALSE)
+    , m_fForegroundChanged(FALSE)
+    , m_fStdMenuShown(FALSE)
+    , m_hForegroundHook(NULL)
+    , m_hMenuPopupHook(NULL)
+    , m_hKeyboardHook(NULL)
+    , m_fAsync(FALSE)
+    , m_fCheckPending(FALSE)
+    , m_dwThreadId(0)
+    , m_hGetMessageHook(NULL)
+    , m_pfnCallback(NULL)
+    , m_pCallbackContext(NULL)
+    , m_pNextLive(NULL)
+    , m_lSharedHwnd(0)
+    , m_fRepaintPending(FALSE)
+    , m_pAccess(NULL)
+    , m_cAccess(0)
+    , m_fAccessDirty(TRUE)
+    , m_pPrefix(NULL)
+    , m_piPrefixRank(NULL)
+    , m_cPrefix(0)
+    , m_fPrefixDirty(TRUE)
+    , m_cchTypeAhead(0)
+    , m_dwTypeAheadTime(0)
+    , m_fSearchEnabled(FALSE)
+    , m_pSearch(NULL)
+    , m_pSearchIndex(NULL)
+    , m_cSearchIndex(0)
+    , m_cSearchIndexMax(0)
+    , m_cchQuery(0)
+    , m_piSearchMatches(NULL)
+    , m_cSearchMatches(0)
+    , m_cchMatched(0)
+    , m_pszRecordFile(NULL)
+    , m_pRecord(NULL)
+    , m_cRecord(0)
+    , m_cRecordMax(0)
+    , m_dwRecordStart(0)
+    , m_iTreeIndex(0)
+    , m_fTrimming(FALSE)
+    , m_dwLastUsed(0)
+    , m_pNextIdle(NULL)
+    , m_fIdle(FALSE)
+    , m_fIdleTrimming(FALSE)
+    , m_cOwnerData(0)
+    , m_pfnData(NULL)
+    , m_pDataContext(NULL)
+    , m_lParamData(0)
+    , m_pRows(NULL)
+    , m_cyRow(0)
+    , m_pDataSub(NULL)
 {
     ZeroMemory(&m_marginsItem, sizeof(m_marginsItem));
-
-    m_nHotKeyLeft = 0;
-    m_nHotKeyRight = 0;
-    m_nHotKeyUp = 0;
-    m_nHotKeyDown = 0;
-    m_nHotKeyReturn = 0;
-    m_nHotKeyEscape = 0;
+    m_ptAnimation.x = m_ptAnimation.y = 0;
+    m_ptLastMouse.x = m_ptLastMouse.y = MAXLONG;
+#ifdef FAKEMENU_ENABLE_STATS
+    ZeroMemory(m_aStats, sizeof(m_aStats));
+    m_qwTrackStart = 0;
+#endif
+    ::InitializeSListHead(&m_listDirty);
 
     InitStatus();
 }
@@ -515,24 +1249,92 @@ FakeMenu::FakeMenu()
 FakeMenu::FakeMenu(HMENU hMenu, FakeMenu* pParent/* = NULL*/)
     : m_hwnd(NULL)
     , m_fKeyboardUsing(FALSE)
+    , m_fMouseTracking(FALSE)
 #ifndef __REACTOS__
     , m_hTheme(NULL)
 #endif
     , m_cItems(0)
     , m_pItems(NULL)
+    , m_pPositions(NULL)
+    , m_cPositionsMax(0)
+    , m_fSelectableDirty(TRUE)
     , m_pParent(pParent)
     , m_hFont(GetStockFont(DEFAULT_GUI_FONT))
+    , m_fOwnFont(FALSE)
     , m_iParentItem(-1)
-    , m_iOpenSubMenu(0)
+    , m_cyContent(0)
+    , m_cyView(0)
+    , m_fLayoutDirty(TRUE)
+    , m_sizeLayout()
+    , m_fAnimate(FALSE)
+    , m_fDestroyLater(FALSE)
+    , m_nAnimation(FAKEMENU_ANIMATION_NONE)
+    , m_dwAnimationStart(0)
+    , m_bAlpha(255)
+    , m_bAlphaFrom(255)
+    , m_iFlashItem(-1)
+    , m_pNextAnimating(NULL)
+    , m_hCancelEvent(NULL)
+    , m_fCancelled(FALSE)
+    , m_fForegroundChanged(FALSE)
+    , m_fStdMenuShown(FALSE)
+    , m_hForegroundHook(NULL)
+    , m_hMenuPopupHook(NULL)
+    , m_hKeyboardHook(NULL)
+    , m_fAsync(FALSE)
+    , m_fCheckPending(FALSE)
+    , m_dwThreadId(0)
+    , m_hGetMessageHook(NULL)
+    , m_pfnCallback(NULL)
+    , m_pCallbackContext(NULL)
+    , m_pNextLive(NULL)
+    , m_lSharedHwnd(0)
+    , m_fRepaintPending(FALSE)
+    , m_pAccess(NULL)
+    , m_cAccess(0)
+    , m_fAccessDirty(TRUE)
+    , m_pPrefix(NULL)
+    , m_piPrefixRank(NULL)
+    , m_cPrefix(0)
+    , m_fPrefixDirty(TRUE)
+    , m_cchTypeAhead(0)
+    , m_dwTypeAheadTime(0)
+    , m_fSearchEnabled(FALSE)
+    , m_pSearch(NULL)
+    , m_pSearchIndex(NULL)
+    , m_cSearchIndex(0)
+    , m_cSearchIndexMax(0)
+    , m_cchQuery(0)
+    , m_piSearchMatches(NULL)
+    , m_cSearchMatches(0)
+    , m_cchMatched(0)
+    , m_pszRecordFile(NULL)
+    , m_pRecord(NULL)
+    , m_cRecord(0)
+    , m_cRecordMax(0)
+    , m_dwRecordStart(0)
+    , m_iTreeIndex(0)
+    , m_fTrimming(FALSE)
+    , m_dwLastUsed(0)
+    , m_pNextIdle(NULL)
+    , m_fIdle(FALSE)
+    , m_fIdleTrimming(FALSE)
+    , m_cOwnerData(0)
+    , m_pfnData(NULL)
+    , m_pDataContext(NULL)
+    , m_lParamData(0)
+    , m_pRows(NULL)
+    , m_cyRow(0)
+    , m_pDataSub(NULL)
 {
     ZeroMemory(&m_marginsItem, sizeof(m_marginsItem));
-
-    m_nHotKeyLeft = 0;
-    m_nHotKeyRight = 0;
-    m_nHotKeyUp = 0;
-    m_nHotKeyDown = 0;
-    m_nHotKeyReturn = 0;
-    m_nHotKeyEscape = 0;
+    m_ptAnimation.x = m_ptAnimation.y = 0;
+    m_ptLastMouse.x = m_ptLastMouse.y = MAXLONG;
+#ifdef FAKEMENU_ENABLE_STATS
+    ZeroMemory(m_aStats, sizeof(m_aStats));
+    m_qwTrackStart = 0;
+#endif
+    ::InitializeSListHead(&m_listDirty);
 
     InitStatus();
 
@@ -569,9 +1371,7 @@ FakeMenu::FakeMenu(HMENU hMenu, FakeMenu* pParent/* = NULL*/)
                 auto pSubMenu = FakeMenu::FromHMENU(mii.hSubMenu, this);
                 pSubMenu->m_iParentItem = iItem;
 
-                LOGFONT lf;
-                ::GetObject(m_hFont, sizeof(lf), &lf);
-                pSubMenu->SetLogFont(&lf);
+                pSubMenu->ShareFont(m_hFont);
 
                 pItem->m_pSubMenu = pSubMenu;
             }
@@ -581,20 +1381,50 @@ FakeMenu::FakeMenu(HMENU hMenu, FakeMenu* pParent/* = NULL*/)
 
 void FakeMenu::SetLogFont(LPLOGFONT plf)
 {
-    if (m_hFont)
-        ::DeleteObject(m_hFont);
-
+    HFONT hFont = NULL;
     if (plf)
-        m_hFont = ::CreateFontIndirect(plf);
-    else
-        m_hFont = GetStockFont(DEFAULT_GUI_FONT);
+    {
+        hFont = ::CreateFontIndirect(plf);
+        if (hFont)
+            FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_GDI_OBJECTS, 1);
+    }
+
+    HFONT hFontOld = (m_fOwnFont ? m_hFont : NULL);
+    m_hFont = (hFont ? hFont : GetStockFont(DEFAULT_GUI_FONT));
+    m_fOwnFont = (hFont != NULL);
+    m_fLayoutDirty = TRUE;
+
+    // One font for the tree
+    for (INT i = 0; i < m_cItems; ++i)
+    {
+        auto pSubMenu = GetSubMenu(i);
+        if (pSubMenu)
+            pSubMenu->ShareFont(m_hFont);
+    }
+    if (m_pDataSub)
+        m_pDataSub->ShareFont(m_hFont);
+
+    if (hFontOld)
+        ::DeleteObject(hFontOld);
+}
+
+// Use the font of the parent. The parent deletes it
+VOID FakeMenu::ShareFont(HFONT hFont)
+{
+    if (m_fOwnFont)
+        ::DeleteObject(m_hFont);
+    m_hFont = hFont;
+    m_fOwnFont = FALSE;
+    m_fLayoutDirty = TRUE;
 
     for (INT i = 0; i < m_cItems; ++i)
     {
         auto pSubMenu = GetSubMenu(i);
         if (pSubMenu)
-            pSubMenu->SetLogFont(plf);
+            pSubMenu->ShareFont(hFont);
     }
+    if (m_pDataSub)
+        m_pDataSub->ShareFont(hFont);
 }
 
 /*static*/ FakeMenu* FakeMenu::FromHWND(HWND hwnd)
@@ -617,8 +1447,32 @@ void FakeMenu::SetLogFont(LPLOGFONT plf)
 
 FakeMenu::~FakeMenu()
 {
+    SetIdle(FALSE);
+    StopAnimation();
+    delete m_pSearch;
+    delete m_pDataSub;
+    FreeSearchIndex();
     DeleteItems();
-    ::DeleteObject(m_hFont);
+    FreeRows();
+    free(m_pPositions);
+    free(m_pAccess);
+    free(m_pPrefix);
+    free(m_piPrefixRank);
+    if (m_fOwnFont) // Not the stock font nor the parent's?
+        ::DeleteObject(m_hFont);
+
+    if (m_hCancelEvent)
+        ::CloseHandle(m_hCancelEvent);
+
+    if (s_session.pRecording == this)
+        s_session.pRecording = NULL;
+    free(m_pszRecordFile);
+    free(m_pRecord);
+
+#ifdef FAKEMENU_ENABLE_STATS
+    if (s_session.pPendingMenu == this) // Never painted
+        s_session.iPendingEvent = 0;
+#endif
 }
 
 FakeMenu* FakeMenu::GetRoot()
@@ -639,17 +1493,13 @@ FakeMenu::GetItem(INT iItem, BOOL bByPosition/* = TRUE*/, FakeMenu** ppOwner/* =
 
     if (bByPosition)
     {
+        if (m_pfnData) // Owner data?
+            return FetchRow(iItem);
+
         if (iItem < 0 || m_cItems <= iItem)
             return NULL;
 
-        auto pItem = m_pItems;
-        for (INT i = 0; i < m_cItems; ++i)
-        {
-            if (iItem == i)
-                return pItem;
-
-            pItem = pItem->m_pNext;
-        }
+        return m_pPositions[iItem].pItem;
     }
     else
     {
@@ -677,14 +1527,17 @@ FakeMenu* FakeMenu::GetSubMenu(INT iItem, BOOL bByPosition/* = TRUE*/)
 BOOL FakeMenu::EnableItem(INT iItem, UINT uEnable/* = MF_BYPOSITION | MF_ENABLED*/)
 {
     BOOL bByPosition = (uEnable & MF_BYPOSITION);
-    auto pItem = GetItem(iItem, bByPosition);
-    if (!pItem)
+    if (bByPosition && m_pfnData) // Don't fetch the row
         return FALSE;
 
-    if (uEnable & (MF_GRAYED | MFS_DISABLED))
-        pItem->m_fState |= (MFS_GRAYED | MFS_DISABLED);
-    else
-        pItem->m_fState &= ~(MFS_GRAYED | MFS_DISABLED);
+    auto pOwner = this;
+    auto pItem = GetItem(iItem, bByPosition, &pOwner);
+    if (!pItem || pOwner->m_pfnData) // The states of the rows come from the callback
+        return FALSE;
+
+    UINT fState = ((uEnable & (MF_GRAYED | MFS_DISABLED)) ? (MFS_GRAYED | MFS_DISABLED) : 0);
+    if (pItem->ChangeState(MFS_GRAYED | MFS_DISABLED, fState))
+        pOwner->MarkDirty(pItem);
 
     return TRUE;
 }
@@ -692,17 +1545,20 @@ BOOL FakeMenu::EnableItem(INT iItem, UINT uEnable/* = MF_BYPOSITION | MF_ENABLED
 BOOL FakeMenu::CheckItem(INT iItem, UINT uCheck/* = MF_BYPOSITION | MF_CHECKED*/)
 {
     BOOL bByPosition = (uCheck & MF_BYPOSITION);
+    if (bByPosition && m_pfnData) // Don't fetch the row
+        return FALSE;
 
-    auto pItem = GetItem(iItem, bByPosition);
-    if (!pItem)
+    auto pOwner = this;
+    auto pItem = GetItem(iItem, bByPosition, &pOwner);
+    if (!pItem || pOwner->m_pfnData) // The states of the rows come from the callback
         return FALSE;
 
-    if (uCheck & MF_CHECKED)
-        pItem->m_fState |= MFS_CHECKED;
-    else
-        pItem->m_fState &= ~MFS_CHECKED;
+    BOOL bChanged = pItem->ChangeState(MFS_CHECKED, ((uCheck & MF_CHECKED) ? MFS_CHECKED : 0));
+    if (::InterlockedAnd((volatile LONG*)&pItem->m_fType, ~MFT_RADIOCHECK) & MFT_RADIOCHECK)
+        bChanged = TRUE;
+    if (bChanged)
+        pOwner->MarkDirty(pItem);
 
-    pItem->m_fType &= ~MFT_RADIOCHECK;
     return TRUE;
 }
 
@@ -723,74 +1579,236 @@ BOOL FakeMenu::CheckRadioItem(INT iFirst, INT iLast, INT iCheck, BOOL bByPositio
         pOwner = pOwner1;
     }
 
+    if (pOwner->m_pfnData) // The states of the rows come from the callback
+        return FALSE;
+
     for (INT i = iFirst; i <= iLast; ++i)
     {
         auto pItem = pOwner->GetItem(i, TRUE);
         if (pItem)
         {
-            pItem->m_fType |= MFT_RADIOCHECK;
-            if (i == iCheck)
-                pItem->m_fState |= MFS_CHECKED;
-            else
-                pItem->m_fState &= ~MFS_CHECKED;
+            BOOL bChanged = pItem->ChangeState(MFS_CHECKED, ((i == iCheck) ? MFS_CHECKED : 0));
+            if (!(::InterlockedOr((volatile LONG*)&pItem->m_fType, MFT_RADIOCHECK) & MFT_RADIOCHECK))
+                bChanged = TRUE;
+            if (bChanged)
+                pOwner->MarkDirty(pItem);
         }
     }
 
     return TRUE;
 }
 
-INT FakeMenu::IdFromIndex(INT iItem)
+// Sort the changes by the item, then in the given order
+static int __cdecl CompareStateChange(const void* p1, const void* p2)
 {
-    auto pItem = GetItem(iItem);
-    if (pItem)
-        return pItem->m_nID;
+    auto pChange1 = *(const FAKEMENU_STATE_CHANGE**)p1;
+    auto pChange2 = *(const FAKEMENU_STATE_CHANGE**)p2;
+    if (pChange1->iItem != pChange2->iItem)
+        return (pChange1->iItem < pChange2->iItem) ? -1 : 1;
+    if (pChange1 != pChange2)
+        return (pChange1 < pChange2) ? -1 : 1;
     return 0;
 }
 
-INT FakeMenu::IndexFromId(INT nID, FakeMenu** ppOwner/* = NULL*/)
+// Find the first change of the item
+static INT FindStateChange(const FAKEMENU_STATE_CHANGE** ppChanges, INT cChanges, INT iItem)
 {
-    if (ppOwner)
-        *ppOwner = NULL;
+    INT iLow = 0, iHigh = cChanges;
+    while (iLow < iHigh)
+    {
+        INT iMid = (iLow + iHigh) / 2;
+        if (ppChanges[iMid]->iItem < iItem)
+            iLow = iMid + 1;
+        else
+            iHigh = iMid;
+    }
+    return iLow;
+}
 
-    if (nID == 0) // Invalid ID?
-        return -1;
+// Apply the sorted changes to this tree. An ID changes its first item in the order of
+// IndexFromId, like EnableItem and CheckItem. pbFound marks the changes by ID already applied.
+// The changed rows are queued by MarkDirty, so any thread can call this
+INT FakeMenu::ApplyStates(const FAKEMENU_STATE_CHANGE** ppById, INT cById, BYTE* pbFound,
+                          const FAKEMENU_STATE_CHANGE** ppByPos, INT cByPos)
+{
+    INT cChanged = 0;
 
-    // Search the items
     auto pItem = m_pItems;
-    for (INT iItem = 0; iItem < m_cItems; iItem++)
+    for (INT iItem = 0; iItem < m_cItems; ++iItem, pItem = pItem->m_pNext)
     {
-        if (pItem->m_nID == nID) // Matched?
+        BOOL bChanged = FALSE;
+
+        for (INT i = FindStateChange(ppByPos, cByPos, iItem); i < cByPos; ++i)
         {
-            if (ppOwner)
+            if (ppByPos[i]->iItem != iItem)
+                break;
+            if (pItem->ChangeState(ppByPos[i]->fMask, ppByPos[i]->fState))
+                bChanged = TRUE;
+        }
+
+        if (pItem->m_nID)
+        {
+            INT i = FindStateChange(ppById, cById, pItem->m_nID);
+            if (i < cById && !pbFound[i]) // Not an item of the same ID found before?
             {
-                *ppOwner = this;
-                return iItem;
+                for (; i < cById && ppById[i]->iItem == pItem->m_nID; ++i)
+                {
+                    pbFound[i] = TRUE;
+                    if (pItem->ChangeState(ppById[i]->fMask, ppById[i]->fState))
+                        bChanged = TRUE;
+                }
             }
         }
-        pItem = pItem->m_pNext;
+
+        if (bChanged)
+        {
+            MarkDirty(pItem);
+            ++cChanged;
+        }
     }
 
-    // Search sub-menus
-    for (INT iItem = 0; iItem < m_cItems; iItem++)
+    // The sub-menus after the items, like IndexFromId
+    if (cById > 0)
     {
-        auto pSubMenu = GetSubMenu(iItem, TRUE);
-        if (pSubMenu)
+        pItem = m_pItems;
+        for (INT iItem = 0; iItem < m_cItems; ++iItem, pItem = pItem->m_pNext)
         {
-            INT i = pSubMenu->IndexFromId(nID, ppOwner);
-            if (i >= 0)
-                return i;
+            if (pItem->m_pSubMenu)
+                cChanged += pItem->m_pSubMenu->ApplyStates(ppById, cById, pbFound, NULL, 0);
         }
     }
 
-    return -1;
+    return cChanged;
 }
 
-BOOL FakeMenu::GetItemRect(INT iItem, LPRECT prc, BOOL bByPosition/* = TRUE*/)
+// Apply many state changes in one pass. Returns the number of the changed items
+INT FakeMenu::SetItemStates(const FAKEMENU_STATE_CHANGE* pChanges, INT cChanges)
 {
-    auto pItem = GetItem(iItem, bByPosition);
-    if (pItem)
+    if (!pChanges || cChanges <= 0)
+        return 0;
+
+    auto ppChanges = (const FAKEMENU_STATE_CHANGE**)AllocMemory(
+        cChanges * (sizeof(FAKEMENU_STATE_CHANGE*) + sizeof(BYTE)));
+    if (!ppChanges)
+        return 0;
+
+    auto pbFound = (BYTE*)(ppChanges + cChanges);
+    ZeroMemory(pbFound, cChanges * sizeof(BYTE));
+
+    // The changes by ID first, then the ones by position
+    INT cById = 0, cByPos = 0;
+    for (INT i = 0; i < cChanges; ++i)
+    {
+        if (!(pChanges[i].uFlags & MF_BYPOSITION))
+            ppChanges[cById++] = &pChanges[i];
+    }
+    for (INT i = 0; i < cChanges; ++i)
+    {
+        if (pChanges[i].uFlags & MF_BYPOSITION)
+            ppChanges[cById + cByPos++] = &pChanges[i];
+    }
+
+    qsort(ppChanges, cById, sizeof(*ppChanges), CompareStateChange);
+    qsort(ppChanges + cById, cByPos, sizeof(*ppChanges), CompareStateChange);
+
+    INT cChanged = ApplyStates(ppChanges, cById, pbFound, ppChanges + cById, cByPos);
+
+    free(ppChanges);
+    return cChanged;
+}
+
+// Called by any thread. Queue the item and post one repaint request
+VOID FakeMenu::MarkDirty(FakeMenuItem* pItem)
+{
+    if (::InterlockedExchange(&pItem->m_fDirty, TRUE))
+        return; // Already queued
+
+    ::InterlockedPushEntrySList(&m_listDirty, &pItem->m_entryDirty);
+
+    HWND hwnd = m_hwnd;
+    if (hwnd && !::InterlockedExchange(&m_fRepaintPending, TRUE))
+    {
+        // The queue may be full or the window gone. The next change posts it again
+        if (!::PostMessageW(hwnd, WM_FAKEMENU_REPAINT, 0, 0))
+            ::InterlockedExchange(&m_fRepaintPending, FALSE);
+    }
+}
+
+// Called by the UI thread. Invalidate the queued rows if hwnd is non-NULL
+VOID FakeMenu::FlushDirty(HWND hwnd)
+{
+    ::InterlockedExchange(&m_fRepaintPending, FALSE);
+
+    auto pEntry = ::InterlockedFlushSList(&m_listDirty);
+    while (pEntry)
+    {
+        auto pItem = CONTAINING_RECORD(pEntry, FakeMenuItem, m_entryDirty);
+        pEntry = pEntry->Next;
+
+        ::InterlockedExchange(&pItem->m_fDirty, FALSE);
+        if (hwnd)
+        {
+            RECT rcItem = pItem->m_rcItem;
+            ::OffsetRect(&rcItem, 0, -m_yScroll);
+            ::InvalidateRect(hwnd, &rcItem, FALSE);
+        }
+    }
+}
+
+INT FakeMenu::IdFromIndex(INT iItem)
+{
+    auto pItem = GetItem(iItem);
+    if (pItem)
+        return pItem->m_nID;
+    return 0;
+}
+
+INT FakeMenu::IndexFromId(INT nID, FakeMenu** ppOwner/* = NULL*/)
+{
+    if (ppOwner)
+        *ppOwner = NULL;
+
+    if (nID == 0) // Invalid ID?
+        return -1;
+
+    // Search the items
+    auto pItem = m_pItems;
+    for (INT iItem = 0; iItem < m_cItems; iItem++)
+    {
+        if (pItem->m_nID == nID) // Matched?
+        {
+            if (ppOwner)
+            {
+                *ppOwner = this;
+                return iItem;
+            }
+        }
+        pItem = pItem->m_pNext;
+    }
+
+    // Search sub-menus
+    for (INT iItem = 0; iItem < m_cItems; iItem++)
+    {
+        auto pSubMenu = GetSubMenu(iItem, TRUE);
+        if (pSubMenu)
+        {
+            INT i = pSubMenu->IndexFromId(nID, ppOwner);
+            if (i >= 0)
+                return i;
+        }
+    }
+
+    return -1;
+}
+
+BOOL FakeMenu::GetItemRect(INT iItem, LPRECT prc, BOOL bByPosition/* = TRUE*/)
+{
+    FakeMenu* pOwner = this;
+    auto pItem = GetItem(iItem, bByPosition, &pOwner);
+    if (pItem)
     {
         *prc = pItem->m_rcItem;
+        ::OffsetRect(prc, 0, -pOwner->m_yScroll); // To the client coordinates
         return TRUE;
     }
     SetRectEmpty(prc);
@@ -810,7 +1828,21 @@ BOOL FakeMenu::GetItemText(INT iItem, LPWSTR pszText, INT cchText, BOOL bByPosit
 
 INT FakeMenu::AppendItem(const MENUITEMINFO* pmii)
 {
+    if (m_pfnData) // The rows come from the callback
+        return FALSE;
+
+    if (m_cItems >= m_cPositionsMax)
+    {
+        INT cMax = (m_cPositionsMax ? m_cPositionsMax * 2 : 16);
+        auto pNew = (FAKEMENU_POSITION*)ReallocMemory(m_pPositions, cMax * sizeof(FAKEMENU_POSITION));
+        if (!pNew)
+            return FALSE;
+        m_pPositions = pNew;
+        m_cPositionsMax = cMax;
+    }
+
     auto pItem = new FakeMenuItem(pmii);
+    m_pPositions[m_cItems].pItem = pItem;
 
     // m_pItems is a cyclic linked list
     if (m_pItems)
@@ -828,6 +1860,7 @@ INT FakeMenu::AppendItem(const MENUITEMINFO* pmii)
     }
 
     ++m_cItems;
+    m_fAccessDirty = m_fPrefixDirty = m_fSelectableDirty = m_fLayoutDirty = TRUE;
     return TRUE;
 }
 
@@ -852,7 +1885,8 @@ void FakeMenu::UpdateVisuals(HWND hwnd)
     }
 #endif
 
-    // Force to repaint
+    // Measure again and repaint
+    m_fLayoutDirty = TRUE;
     ::InvalidateRect(hwnd, NULL, TRUE);
 }
 
@@ -864,141 +1898,16 @@ BOOL FakeMenu::OnCreate(HWND hwnd, LPCREATESTRUCT lpCreateStruct)
 
 void FakeMenu::OnShowWindow(HWND hwnd, BOOL fShow, UINT status)
 {
-    if (fShow)
-    {
-        ::SetTimer(hwnd, FAKEMENU_REFRESH_TIMER, FAKEMENU_REFRESH_INTERVAL, NULL);
-    }
-    else
-    {
-        ::KillTimer(hwnd, FAKEMENU_REFRESH_TIMER);
-        SetHotKeys(FALSE);
-    }
-}
-
-void FakeMenu::OnHotKey(HWND hwnd, int idHotKey, UINT fuModifiers, UINT vk)
-{
-    if (idHotKey == m_nHotKeyLeft)
-    {
-        SendMessageW(hwnd, WM_KEYDOWN, VK_LEFT, 0);
-        return;
-    }
-    if (idHotKey == m_nHotKeyRight)
-    {
-        SendMessageW(hwnd, WM_KEYDOWN, VK_RIGHT, 0);
-        return;
-    }
-    if (idHotKey == m_nHotKeyUp)
-    {
-        SendMessageW(hwnd, WM_KEYDOWN, VK_UP, 0);
-        return;
-    }
-    if (idHotKey == m_nHotKeyDown)
-    {
-        SendMessageW(hwnd, WM_KEYDOWN, VK_DOWN, 0);
-        return;
-    }
-    if (idHotKey == m_nHotKeyReturn)
-    {
-        SendMessageW(hwnd, WM_KEYDOWN, VK_RETURN, 0);
-        return;
-    }
-    if (idHotKey == m_nHotKeyEscape)
+    if (!fShow)
     {
-        SendMessageW(hwnd, WM_KEYDOWN, VK_ESCAPE, 0);
-        return;
+        m_fMouseTracking = FALSE;
     }
 }
 
 VOID FakeMenu::SetActiveMenu(FakeMenu *pActive)
 {
-    if (s_pActiveMenu != pActive)
-    {
-        if (s_pActiveMenu)
-        {
-            s_pActiveMenu->SetHotKeys(FALSE);
-        }
-
-        s_pActiveMenu = pActive;
-
-        if (s_pActiveMenu)
-        {
-            s_pActiveMenu->SetHotKeys(TRUE);
-        }
-    }
-}
-
-VOID FakeMenu::SetHotKeys(BOOL bSet)
-{
-    ::UnregisterHotKey(m_hwnd, m_nHotKeyLeft);
-    ::UnregisterHotKey(m_hwnd, m_nHotKeyRight);
-    ::UnregisterHotKey(m_hwnd, m_nHotKeyUp);
-    ::UnregisterHotKey(m_hwnd, m_nHotKeyDown);
-    ::UnregisterHotKey(m_hwnd, m_nHotKeyReturn);
-    ::UnregisterHotKey(m_hwnd, m_nHotKeyEscape);
-    m_nHotKeyLeft = m_nHotKeyRight = m_nHotKeyUp = m_nHotKeyDown = 0;
-    m_nHotKeyReturn = m_nHotKeyEscape = 0;
-
-    if (bSet && ::IsWindow(m_hwnd))
-    {
-        m_nHotKeyLeft = ::GlobalAddAtomW(L"fakemenu left");
-        ::RegisterHotKey(m_hwnd, m_nHotKeyLeft, 0, VK_LEFT);
-
-        m_nHotKeyRight = ::GlobalAddAtomW(L"fakemenu right");
-        ::RegisterHotKey(m_hwnd, m_nHotKeyRight, 0, VK_RIGHT);
-
-        m_nHotKeyUp = ::GlobalAddAtomW(L"fakemenu up");
-        ::RegisterHotKey(m_hwnd, m_nHotKeyUp, 0, VK_UP);
-
-        m_nHotKeyDown = ::GlobalAddAtomW(L"fakemenu down");
-        ::RegisterHotKey(m_hwnd, m_nHotKeyDown, 0, VK_DOWN);
-
-        m_nHotKeyReturn = ::GlobalAddAtomW(L"fakemenu return");
-        ::RegisterHotKey(m_hwnd, m_nHotKeyReturn, 0, VK_RETURN);
-
-        m_nHotKeyEscape = ::GlobalAddAtomW(L"fakemenu escape");
-        ::RegisterHotKey(m_hwnd, m_nHotKeyEscape, 0, VK_ESCAPE);
-    }
-}
-
-void FakeMenu::OnTimer(HWND hwnd, UINT id)
-{
-    if (id == FAKEMENU_ANIMATION_TIMER) // Animation?
-    {
-        KillTimer(hwnd, FAKEMENU_ANIMATION_TIMER);
-        ::ShowWindow(m_hwnd, SW_HIDE);
-
-        SetActiveMenu(NULL);
-
-        m_fDelayed = FALSE;
-        m_fDone = TRUE;
-        ::SetWindowRgn(m_hwnd, NULL, TRUE);
-        return;
-    }
-
-    if (m_fDelayed)
-        return;
-
-    if (id == FAKEMENU_REFRESH_TIMER) // Refresh?
-    {
-        if (!m_fKeyboardUsing) // Mouse moving?
-        {
-            POINT pt;
-            ::GetCursorPos(&pt);
-            ::ScreenToClient(hwnd, &pt); // Convert to client coordinates
-
-            INT iSelected = HitTest(pt.x, pt.y);
-            SetCurSel(hwnd, iSelected); // Select it
-        }
-
-        // Check foreground window
-        HWND hwndForeground = ::GetForegroundWindow();
-        if (hwndForeground && hwndForeground != s_hwndOldForeground)
-        {
-            auto pRoot = GetRoot();
-            if (pRoot && !pRoot->m_fDestroying)
-                pRoot->HideTree(pRoot->m_idResult); // Hide it
-        }
-    }
+    // The keyboard hook of the tracking sends the keys to s_session.pActiveMenu
+    s_session.pActiveMenu = pActive;
 }
 
 void FakeMenu::DestroyTree(INT idResult)
@@ -1006,6 +1915,8 @@ void FakeMenu::DestroyTree(INT idResult)
     if (m_fDestroying) // Destroying the window?
         return;
 
+    FAKEMENU_TRACE_SCOPE("DestroyTree");
+
     m_fDestroying = TRUE;
     m_idResult = idResult;
 
@@ -1019,16 +1930,22 @@ void FakeMenu::DestroyTree(INT idResult)
         }
     }
 
+    // Destroy the search results and the sub-menu of the rows
+    if (m_pSearch)
+        m_pSearch->DestroyTree(idResult);
+    if (m_pDataSub)
+        m_pDataSub->DestroyTree(idResult);
+
     ::DestroyWindow(m_hwnd);
     m_fDone = TRUE;
 }
 
 void FakeMenu::OnDestroy(HWND hwnd)
 {
-    KillTimer(hwnd, FAKEMENU_REFRESH_TIMER);
+    StopAnimation();
 
     auto pRoot = GetRoot();
-    if (pRoot)
+    if (pRoot && !m_fTrimming) // Not trimmed?
     {
         pRoot->HideTree(m_idResult);
         pRoot->DestroyTree(m_idResult);
@@ -1036,6 +1953,8 @@ void FakeMenu::OnDestroy(HWND hwnd)
 
     if (m_pParent)
         m_pParent->m_iOpenSubMenu = -1;
+    else
+        ReportAsync(); // WM_FAKEMENU_RESULT will not come
 
 #ifndef __REACTOS__
     if (m_hTheme)
@@ -1048,6 +1967,9 @@ void FakeMenu::OnDestroy(HWND hwnd)
 
 void FakeMenu::OnPaint(HWND hwnd)
 {
+    FAKEMENU_TRACE_SCOPE("OnPaint");
+    FAKEMENU_STAT_TICKS(qwStart);
+
     // Start the painting
     PAINTSTRUCT ps;
     HDC hdc = BeginPaint(hwnd, &ps);
@@ -1057,10 +1979,20 @@ void FakeMenu::OnPaint(HWND hwnd)
         return;
     }
 
-    // For all items...
-    auto pItem = m_pItems;
-    for (INT iItem = 0; iItem < m_cItems; iItem++)
+    // Draw in the content coordinates
+    ::SetViewportOrgEx(hdc, 0, -m_yScroll, NULL);
+
+    // For the items in the update rectangle...
+    INT iFirst = ItemFromY(ps.rcPaint.top + m_yScroll);
+    INT cItems = GetCount();
+    for (INT iItem = max(iFirst, 0); iItem < cItems; iItem++)
     {
+        auto pItem = GetItem(iItem);
+        if (!pItem)
+            break;
+        if (pItem->m_rcItem.top >= ps.rcPaint.bottom + m_yScroll)
+            break;
+
         if (RectVisible(hdc, &pItem->m_rcItem))
         {
             DRAWITEMSTRUCT DrawItem = { ODT_MENU };
@@ -1083,12 +2015,23 @@ void FakeMenu::OnPaint(HWND hwnd)
             // Draw the item
             DoDrawItem(iItem, pItem, &DrawItem);
         }
-
-        pItem = pItem->m_pNext;
     }
 
     // End the painting
     EndPaint(hwnd, &ps);
+
+#ifdef FAKEMENU_ENABLE_STATS
+    FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_PAINTS, 1);
+    FAKEMENU_STAT_ADD_TIME(this, FAKEMENU_STAT_PAINT_TIME, qwStart);
+    FAKEMENU_LATENCY_PAINTED(this);
+
+    auto pRoot = GetRoot();
+    if (pRoot == this && m_qwTrackStart)
+    {
+        FAKEMENU_STAT_ADD_TIME(this, FAKEMENU_STAT_FIRST_PAINT_TIME, m_qwTrackStart);
+        m_qwTrackStart = 0;
+    }
+#endif
 }
 
 INT FakeMenu::GetCurSel()
@@ -1103,6 +2046,12 @@ void FakeMenu::SetCurSel(HWND hwnd, INT iSelected)
     if (m_iSelected == iSelected)
         return;
 
+    if (!hwnd)
+    {
+        m_iSelected = iSelected;
+        return;
+    }
+
     if (m_iSelected >= 0) // Old value?
     {
         GetItemRect(m_iSelected, &rc);
@@ -1120,806 +2069,3464 @@ void FakeMenu::SetCurSel(HWND hwnd, INT iSelected)
 
 INT FakeMenu::HitTest(INT x, INT y)
 {
-    POINT pt = { x, y };
+    FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_HIT_TESTS, 1);
 
-    auto pItem = m_pItems;
-    for (INT iItem = 0; iItem < m_cItems; ++iItem)
-    {
-        if (!pItem->IsSep() && !pItem->IsGrayed())
-        {
-            if (PtInRect(&pItem->m_rcItem, pt))
-                return iItem; // Found!
-        }
+    POINT pt = { x, y + m_yScroll }; // In the content coordinates
 
-        pItem = pItem->m_pNext;
-    }
+    INT iItem = ItemFromY(pt.y);
+    if (iItem < 0)
+        return -1;
+
+    auto pItem = GetItem(iItem);
+    if (pItem && !pItem->IsSep() && !pItem->IsGrayed() && PtInRect(&pItem->m_rcItem, pt))
+        return iItem; // Found!
 
     return -1; // Not found
 }
 
-void FakeMenu::OnMouseMove(HWND hwnd, INT x, INT y, UINT keyFlags)
+// The item at the content position y. The items are sorted by y
+INT FakeMenu::ItemFromY(INT y)
 {
-    m_fKeyboardUsing = FALSE;
+    if (m_pfnData) // The rows have one height
+    {
+        if (y < 0 || m_cyRow <= 0)
+            return -1;
+        INT iItem = y / m_cyRow;
+        return (iItem < m_cOwnerData ? iItem : -1);
+    }
 
-    INT iSelected = HitTest(x, y);
-    SetCurSel(hwnd, iSelected);
+    if (m_cItems <= 0 || y < m_pPositions[0].pItem->m_rcItem.top)
+        return -1;
+
+    INT iLow = 0, iHigh = m_cItems - 1;
+    while (iLow < iHigh)
+    {
+        INT iMid = (iLow + iHigh + 1) / 2;
+        if (m_pPositions[iMid].pItem->m_rcItem.top <= y)
+            iLow = iMid;
+        else
+            iHigh = iMid - 1;
+    }
+
+    if (y >= m_pPositions[iLow].pItem->m_rcItem.bottom)
+        return -1;
+
+    return iLow;
 }
 
-void FakeMenu::OnButtonDown(HWND hwnd, INT x, INT y, BOOL fDoubleClick)
+VOID FakeMenu::ScrollTo(INT yScroll)
 {
-    if (fDoubleClick)
+    if (yScroll > m_cyContent - m_cyView)
+        yScroll = m_cyContent - m_cyView;
+    if (yScroll < 0)
+        yScroll = 0;
+    if (yScroll == m_yScroll)
         return;
 
-    POINT pt = { x, y };
-    INT iItem = HitTest(x, y);
-    auto pItem = GetItem(iItem, TRUE);
-    if (!pItem || pItem->IsSep() || pItem->IsGrayed())
-        return; // The action is disabled
-
-    SetCurSel(hwnd, iItem); // Select it now
-
-    auto pSubMenu = pItem->m_pSubMenu;
-    if (!pSubMenu)
-        return; // No sub-menu
+    INT dy = m_yScroll - yScroll;
+    m_yScroll = yScroll;
+    if (m_hwnd)
+        ::ScrollWindowEx(m_hwnd, 0, dy, NULL, NULL, NULL, NULL, SW_INVALIDATE);
+}
 
-    // Get the item rect in screen coordinates
-    RECT rcItem = pItem->m_rcItem;
-    pt.x = rcItem.right;
-    pt.y = rcItem.top;
-    ::ClientToScreen(m_hwnd, &pt);
-    MapWindowRect(m_hwnd, NULL, &rcItem);
+VOID FakeMenu::EnsureVisible(INT iItem)
+{
+    auto pItem = GetItem(iItem);
+    if (!pItem || m_cyView <= 0)
+        return;
 
-    // Open the sub-menu
-    pSubMenu->TrackPopup(pt, FALSE, &rcItem);
+    if (pItem->m_rcItem.top < m_yScroll)
+        ScrollTo(pItem->m_rcItem.top);
+    else if (pItem->m_rcItem.bottom > m_yScroll + m_cyView)
+        ScrollTo(pItem->m_rcItem.bottom - m_cyView);
 }
 
-void FakeMenu::OnLButtonDown(HWND hwnd, BOOL fDoubleClick, int x, int y, UINT keyFlags)
+BOOL FakeMenu::SelectItem(INT iItem)
 {
-    OnButtonDown(hwnd, x, y, fDoubleClick);
+    if (iItem < -1 || GetCount() <= iItem)
+        return FALSE;
+
+    SetCurSel(m_hwnd, iItem);
+    EnsureVisible(iItem);
+    return TRUE;
 }
 
-void FakeMenu::OnRButtonDown(HWND hwnd, BOOL fDoubleClick, int x, int y, UINT keyFlags)
+void FakeMenu::OnMouseWheel(HWND hwnd, int xPos, int yPos, int zDelta, UINT fwKeys)
 {
-    OnButtonDown(hwnd, x, y, fDoubleClick);
+    UINT cLines = 3;
+    ::SystemParametersInfoW(SPI_GETWHEELSCROLLLINES, 0, &cLines, 0);
+    if (cLines == WHEEL_PAGESCROLL)
+        cLines = 1 + m_cyView / ::GetSystemMetrics(SM_CYMENU);
+
+    auto pFirst = GetItem(0);
+    INT cyLine = (pFirst ? pFirst->m_cxyItem : ::GetSystemMetrics(SM_CYMENU));
+    ScrollTo(m_yScroll - zDelta * (INT)cLines * cyLine / WHEEL_DELTA);
 }
 
-// Is menu animation disabled?
-static BOOL IsMenuAnimationDisabled(VOID)
+// The hover delay in milliseconds. Negative means SPI_GETMENUSHOWDELAY
+static INT s_nHoverDelay = -1;
+
+static INT GetHoverDelay(VOID)
 {
-    DWORD dwValue = FALSE;
-    HKEY hKey;
-    if (RegOpenKeyExW(HKEY_CURRENT_USER,
-                      L"Software\\Microsoft\\Windows\\CurrentVersion\\Policies\\Explorer",
-                      0,
-                      KEY_READ,
-                      &hKey) == ERROR_SUCCESS)
-    {
-        DWORD cbValue = sizeof(dwValue);
-        RegQueryValueExW(hKey, L"NoChangeAnimation", NULL, NULL,
-                         (LPBYTE)&dwValue, &cbValue);
-        RegCloseKey(hKey);
-    }
-    return dwValue;
+    if (s_nHoverDelay >= 0)
+        return s_nHoverDelay;
+
+    DWORD dwDelay = 400;
+    ::SystemParametersInfoW(SPI_GETMENUSHOWDELAY, 0, &dwDelay, 0);
+    return (INT)dwDelay;
 }
 
-void FakeMenu::OnButtonUp(HWND hwnd, INT x, INT y)
+// The visible sub-menu of m_iOpenSubMenu
+FakeMenu* FakeMenu::GetOpenSubMenu()
 {
-    INT iSelected = HitTest(x, y);
-    if (iSelected == -1)
-        return;
+    if (m_iOpenSubMenu < 0)
+        return NULL;
 
-    SetCurSel(hwnd, iSelected); // Select it
+    auto pSubMenu = GetSubMenu(m_iOpenSubMenu);
+    if (!pSubMenu || !::IsWindowVisible(pSubMenu->m_hwnd) || pSubMenu->IsClosing())
+        return NULL;
 
-    auto pItem = GetItem(iSelected);
-    if (!pItem || pItem->IsSep() || pItem->m_pSubMenu)
-        return; // The action is disabled
+    return pSubMenu;
+}
 
-    RECT rc;
-    GetWindowRect(hwnd, &rc);
+// Is the mouse heading for the open sub-menu? The triangle is made of the previous
+// position and the near edge of the sub-menu
+BOOL FakeMenu::IsInSafeTriangle(POINT ptPrev, POINT pt)
+{
+    auto pSubMenu = GetOpenSubMenu();
+    if (!pSubMenu || ptPrev.x == MAXLONG)
+        return FALSE;
 
-    BOOL bDelay = !IsMenuAnimationDisabled();
-    if (bDelay) // Animation?
-    {
-        // Get the item rect in window coordinates
-        RECT rcItem = pItem->m_rcItem;
-        MapWindowRect(hwnd, NULL, &rcItem);
-        OffsetRect(&rcItem, -rc.left, -rc.top);
+    RECT rcSub;
+    ::GetWindowRect(pSubMenu->m_hwnd, &rcSub);
 
-        // Create the window region of the item
-        HRGN hRgn = CreateRectRgnIndirect(&rcItem);
-        bDelay = SetWindowRgn(hwnd, hRgn, TRUE);
-        if (!bDelay)
-            DeleteObject(hRgn);
-    }
+    LONG xEdge = (rcSub.left >= ptPrev.x) ? rcSub.left : rcSub.right;
+    POINT apt[3] = { ptPrev, { xEdge, rcSub.top }, { xEdge, rcSub.bottom } };
 
-    // Hide the tree from thr root
-    INT idResult = IdFromIndex(iSelected);
-    auto pRoot = GetRoot();
-    if (pRoot)
+    // The signs of the cross products
+    LONGLONG d[3];
+    for (INT i = 0; i < 3; ++i)
     {
-        if (bDelay)
-            pRoot->HideTreeDelay(idResult, hwnd);
-        else
-            pRoot->HideTree(idResult);
+        const POINT& pt1 = apt[i];
+        const POINT& pt2 = apt[(i + 1) % 3];
+        d[i] = (LONGLONG)(pt2.x - pt1.x) * (pt.y - pt1.y) - (LONGLONG)(pt2.y - pt1.y) * (pt.x - pt1.x);
     }
-}
 
-void FakeMenu::OnLButtonUp(HWND hwnd, INT x, INT y, UINT keyFlags)
-{
-    OnButtonUp(hwnd, x, y);
+    BOOL bNegative = (d[0] < 0 || d[1] < 0 || d[2] < 0);
+    BOOL bPositive = (d[0] > 0 || d[1] > 0 || d[2] > 0);
+    return !(bNegative && bPositive);
 }
 
-void FakeMenu::OnRButtonUp(HWND hwnd, int x, int y, UINT flags)
+void FakeMenu::OnMouseMove(HWND hwnd, INT x, INT y, UINT keyFlags)
 {
-    OnButtonUp(hwnd, x, y);
+    POINT pt = { x, y };
+    ::ClientToScreen(hwnd, &pt);
+    if (pt.x == m_ptLastMouse.x && pt.y == m_ptLastMouse.y)
+        return; // Not moved (e.g. the window appeared under the cursor)
+
+    POINT ptPrev = m_ptLastMouse;
+    m_ptLastMouse = pt;
+
+    m_fKeyboardUsing = FALSE;
+
+    // A move posted away from the cursor (a replay or a test) is not tracked, or
+    // TrackMouseEvent reports at once that the real cursor is not here
+    DWORD dwPos = ::GetMessagePos();
+    BOOL bCursor = (GET_X_LPARAM(dwPos) == pt.x && GET_Y_LPARAM(dwPos) == pt.y);
+
+    if (!m_fMouseTracking && bCursor) // Get WM_MOUSELEAVE when the mouse leaves
+    {
+        TRACKMOUSEEVENT tme = { sizeof(tme), TME_LEAVE, hwnd };
+        m_fMouseTracking = ::TrackMouseEvent(&tme);
+    }
+
+    INT iSelected = HitTest(x, y);
+    INT nDelay = GetHoverDelay();
+
+    // Heading for the open sub-menu? Keep it until the mouse rests
+    if (iSelected != m_iOpenSubMenu && IsInSafeTriangle(ptPrev, pt))
+    {
+        ::SetTimer(hwnd, FAKEMENU_HOVER_TIMER, nDelay, NULL);
+        return;
+    }
+
+    if (iSelected != m_iSelected)
+        FAKEMENU_LATENCY_MARK(this, FAKEMENU_EVENT_HOVER);
+    SetCurSel(hwnd, iSelected);
+
+    if (iSelected >= 0 && iSelected == m_iOpenSubMenu && GetOpenSubMenu())
+    {
+        ::KillTimer(hwnd, FAKEMENU_HOVER_TIMER);
+        return;
+    }
+
+    // Open the sub-menu or close the open one after the delay
+    auto pItem = GetItem(iSelected);
+    BOOL bSubMenu = (pItem && pItem->m_pSubMenu && !pItem->IsGrayed());
+    if (bSubMenu || GetOpenSubMenu())
+    {
+        // Moving toward the sub-menu arrow opens it sooner
+        if (bSubMenu && pt.x - ptPrev.x > abs(pt.y - ptPrev.y))
+            nDelay /= 2;
+        ::SetTimer(hwnd, FAKEMENU_HOVER_TIMER, nDelay, NULL);
+    }
+    else
+    {
+        ::KillTimer(hwnd, FAKEMENU_HOVER_TIMER);
+    }
+}
+
+void FakeMenu::OnTimer(HWND hwnd, UINT id)
+{
+    if (id != FAKEMENU_HOVER_TIMER)
+        return;
+
+    ::KillTimer(hwnd, id);
+
+    if (m_fKeyboardUsing || IsClosing())
+        return;
+
+    // The item where the mouse rests. The last move rather than the cursor, so that
+    // the posted moves open the sub-menus too
+    if (m_ptLastMouse.x == MAXLONG) // Left?
+        return;
+    POINT pt = m_ptLastMouse;
+    ::ScreenToClient(hwnd, &pt);
+    INT iItem = HitTest(pt.x, pt.y);
+    if (iItem < 0)
+        return;
+
+    SetCurSel(hwnd, iItem);
+
+    auto pOpen = GetOpenSubMenu();
+    if (pOpen && iItem == m_iOpenSubMenu)
+        return; // Already open
+
+    if (pOpen) // Close the other sub-menu
+    {
+        pOpen->HideTree(0);
+        SetActiveMenu(this);
+    }
+
+    auto pItem = GetItem(iItem);
+    if (pItem && pItem->m_pSubMenu && !pItem->IsGrayed())
+        OpenSubMenu(iItem, FALSE);
+}
+
+void FakeMenu::OpenSubMenu(INT iItem, BOOL fKeyboard)
+{
+    auto pSubMenu = GetSubMenu(iItem);
+    if (!pSubMenu)
+        return;
+
+    FAKEMENU_TRACE_SCOPE_ARG("OpenSubMenu", iItem);
+
+    if (pSubMenu == m_pDataSub) // The sub-menu of a row?
+        BindDataSub(iItem);
+
+    // Get the item rect in screen coordinates
+    RECT rcItem;
+    GetItemRect(iItem, &rcItem);
+    POINT pt = { rcItem.right, rcItem.top };
+    ::ClientToScreen(m_hwnd, &pt);
+    MapWindowRect(m_hwnd, NULL, &rcItem);
+
+    // Open the sub-menu
+    FAKEMENU_LATENCY_MARK(pSubMenu, FAKEMENU_EVENT_SUBMENU); // Painted by the sub-menu
+    pSubMenu->TrackPopup(pt, fKeyboard, &rcItem);
+}
+
+void FakeMenu::OnMouseLeave(HWND hwnd)
+{
+    m_fMouseTracking = FALSE;
+    m_ptLastMouse.x = m_ptLastMouse.y = MAXLONG;
+    ::KillTimer(hwnd, FAKEMENU_HOVER_TIMER);
+
+    if (m_fKeyboardUsing || IsClosing())
+        return;
+
+    if (m_iSelected >= 0 && m_iSelected == m_iOpenSubMenu)
+        return; // Keep the item of the open sub-menu selected
+
+    SetCurSel(hwnd, -1);
+}
+
+void FakeMenu::OnButtonDown(HWND hwnd, INT x, INT y, BOOL fDoubleClick)
+{
+    if (fDoubleClick)
+        return;
+
+    if (NavButtonDown(HitTest(x, y)))
+        ::KillTimer(hwnd, FAKEMENU_HOVER_TIMER);
+}
+
+void FakeMenu::OnLButtonDown(HWND hwnd, BOOL fDoubleClick, int x, int y, UINT keyFlags)
+{
+    OnButtonDown(hwnd, x, y, fDoubleClick);
+}
+
+void FakeMenu::OnRButtonDown(HWND hwnd, BOOL fDoubleClick, int x, int y, UINT keyFlags)
+{
+    OnButtonDown(hwnd, x, y, fDoubleClick);
+}
+
+// Is menu animation disabled?
+static BOOL IsMenuAnimationDisabled(VOID)
+{
+    DWORD dwValue = FALSE;
+    HKEY hKey;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER,
+                      L"Software\\Microsoft\\Windows\\CurrentVersion\\Policies\\Explorer",
+                      0,
+                      KEY_READ,
+                      &hKey) == ERROR_SUCCESS)
+    {
+        DWORD cbValue = sizeof(dwValue);
+        RegQueryValueExW(hKey, L"NoChangeAnimation", NULL, NULL,
+                         (LPBYTE)&dwValue, &cbValue);
+        RegCloseKey(hKey);
+    }
+    return dwValue;
+}
+
+// Should we animate the menus?
+static BOOL IsMenuAnimationEnabled(VOID)
+{
+    BOOL bAnimation = TRUE;
+    ::SystemParametersInfoW(SPI_GETMENUANIMATION, 0, &bAnimation, 0);
+    return bAnimation && !IsMenuAnimationDisabled();
+}
+
+void FakeMenu::OnButtonUp(HWND hwnd, INT x, INT y)
+{
+    NavButtonUp(HitTest(x, y));
+}
+
+void FakeMenu::OnLButtonUp(HWND hwnd, INT x, INT y, UINT keyFlags)
+{
+    OnButtonUp(hwnd, x, y);
+}
+
+void FakeMenu::OnRButtonUp(HWND hwnd, int x, int y, UINT flags)
+{
+    OnButtonUp(hwnd, x, y);
+}
+
+INT FakeMenu::NavGetCount()
+{
+    return GetCount();
+}
+
+unsigned FakeMenu::NavGetItemFlags(int iItem)
+{
+    auto pItem = GetItem(iItem);
+    if (!pItem)
+        return FAKEMENU_NAV_SEPARATOR;
+
+    unsigned fFlags = 0;
+    if (pItem->IsSep())
+        fFlags |= FAKEMENU_NAV_SEPARATOR;
+    if (pItem->IsGrayed())
+        fFlags |= FAKEMENU_NAV_GRAYED;
+    if (pItem->m_pSubMenu)
+        fFlags |= FAKEMENU_NAV_SUBMENU;
+    return fFlags;
+}
+
+int FakeMenu::NavGetNextSelectable(int iItem, bool bNext)
+{
+    if (m_pfnData) // No links for the rows
+        return FakeMenuNav::NavGetNextSelectable(iItem, bNext);
+    return GetNextSelectable(iItem, bNext);
+}
+
+int FakeMenu::NavGetPageItem(int iItem, bool bNext)
+{
+    return GetPageItem(iItem, bNext);
+}
+
+bool FakeMenu::NavIsSubMenuOpen()
+{
+    return GetOpenSubMenu() != NULL;
+}
+
+FakeMenuNav* FakeMenu::NavGetParent()
+{
+    return m_pParent;
+}
+
+void FakeMenu::NavSetCurSel(int iItem, bool bEnsureVisible)
+{
+    SetCurSel(m_hwnd, iItem);
+    if (bEnsureVisible)
+        EnsureVisible(iItem);
+}
+
+void FakeMenu::NavOpenSubMenu(int iItem, bool fKeyboard)
+{
+    OpenSubMenu(iItem, fKeyboard);
+}
+
+void FakeMenu::NavClose()
+{
+    if (IsSearchResults())
+    {
+        GetRoot()->EndSearch();
+        return;
+    }
+
+    HideWindow(FALSE);
+    if (s_session.pActiveMenu)
+        SetActiveMenu(s_session.pActiveMenu->m_pParent);
+}
+
+void FakeMenu::NavChoose(int iItem, FakeMenuNav* pRoot)
+{
+    FAKEMENU_LATENCY_MARK(this, FAKEMENU_EVENT_SELECT);
+    static_cast<FakeMenu*>(pRoot)->HideTree(IdFromIndex(iItem), this);
+}
+
+static int __cdecl CompareAccess(const void* p1, const void* p2)
+{
+    auto pAccess1 = (const FAKEMENU_ACCESS*)p1;
+    auto pAccess2 = (const FAKEMENU_ACCESS*)p2;
+    if (pAccess1->chAccess != pAccess2->chAccess)
+        return (pAccess1->chAccess < pAccess2->chAccess) ? -1 : 1;
+    return pAccess1->iItem - pAccess2->iItem;
+}
+
+VOID FakeMenu::BuildAccessTable()
+{
+    free(m_pAccess);
+    m_pAccess = NULL;
+    m_cAccess = 0;
+    m_fAccessDirty = FALSE;
+
+    if (m_cItems <= 0)
+        return;
+
+    m_pAccess = (FAKEMENU_ACCESS*)AllocMemory(m_cItems * sizeof(FAKEMENU_ACCESS));
+    if (!m_pAccess)
+        return;
+
+    auto pItem = m_pItems;
+    for (INT iItem = 0; iItem < m_cItems; ++iItem, pItem = pItem->m_pNext)
+    {
+        if (pItem->m_chAccess)
+        {
+            m_pAccess[m_cAccess].chAccess = pItem->m_chAccess;
+            m_pAccess[m_cAccess].iItem = iItem;
+            ++m_cAccess;
+        }
+    }
+
+    qsort(m_pAccess, m_cAccess, sizeof(FAKEMENU_ACCESS), CompareAccess);
+}
+
+// Find the next item after the selection that has the access key.
+// *pcMatches receives the number of the items that share the key
+INT FakeMenu::FindItemByAccessChar(TCHAR ch, INT* pcMatches)
+{
+    *pcMatches = 0;
+
+    if (m_fAccessDirty)
+        BuildAccessTable();
+
+    WCHAR chAccess = FoldAccessChar(ch);
+
+    // Binary search of the first entry of the key
+    INT iLow = 0, iHigh = m_cAccess;
+    while (iLow < iHigh)
+    {
+        INT iMid = (iLow + iHigh) / 2;
+        if (m_pAccess[iMid].chAccess < chAccess)
+            iLow = iMid + 1;
+        else
+            iHigh = iMid;
+    }
+
+    INT iFirst = iLow, iNext = -1;
+    for (INT i = iFirst; i < m_cAccess && m_pAccess[i].chAccess == chAccess; ++i)
+    {
+        if (iNext < 0 && m_pAccess[i].iItem > m_iSelected)
+            iNext = m_pAccess[i].iItem;
+        ++(*pcMatches);
+    }
+
+    if (*pcMatches == 0)
+        return -1; // Not found
+
+    if (iNext < 0) // Cycle
+        iNext = m_pAccess[iFirst].iItem;
+
+    return iNext;
+}
+
+// The case folding of the type-ahead. Not only ASCII, and the same length
+static inline VOID FoldPrefix(LPWSTR psz, INT cch)
+{
+    ::LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_LOWERCASE, psz, cch, psz, cch, NULL, NULL, 0);
+}
+
+// The texts are folded already, so the sort and the search compare them ordinally
+static int __cdecl ComparePrefix(const void* p1, const void* p2)
+{
+    auto pPrefix1 = (const FAKEMENU_PREFIX*)p1;
+    auto pPrefix2 = (const FAKEMENU_PREFIX*)p2;
+    INT nCompare = wcscmp(pPrefix1->pszText, pPrefix2->pszText);
+    if (nCompare)
+        return nCompare;
+    return pPrefix1->iItem - pPrefix2->iItem;
+}
+
+VOID FakeMenu::BuildPrefixIndex()
+{
+    free(m_pPrefix);
+    free(m_piPrefixRank);
+    m_pPrefix = NULL;
+    m_piPrefixRank = NULL;
+    m_cPrefix = 0;
+    m_fPrefixDirty = FALSE;
+
+    if (m_cItems <= 0)
+        return;
+
+    // The folded texts follow the entries in one block
+    SIZE_T cchTexts = 0;
+    auto pItem = m_pItems;
+    for (INT iItem = 0; iItem < m_cItems; ++iItem, pItem = pItem->m_pNext)
+    {
+        if (pItem->m_pszDisplay && pItem->m_pszDisplay[0])
+            cchTexts += lstrlenW(pItem->m_pszDisplay) + 1;
+    }
+
+    m_pPrefix = (FAKEMENU_PREFIX*)AllocMemory(m_cItems * sizeof(FAKEMENU_PREFIX) +
+                                              cchTexts * sizeof(WCHAR));
+    m_piPrefixRank = (INT*)AllocMemory(m_cItems * sizeof(INT));
+    if (!m_pPrefix || !m_piPrefixRank)
+    {
+        free(m_pPrefix);
+        free(m_piPrefixRank);
+        m_pPrefix = NULL;
+        m_piPrefixRank = NULL;
+        return;
+    }
+
+    auto pszText = (LPWSTR)&m_pPrefix[m_cItems];
+    pItem = m_pItems;
+    for (INT iItem = 0; iItem < m_cItems; ++iItem, pItem = pItem->m_pNext)
+    {
+        m_piPrefixRank[iItem] = -1;
+        if (pItem->m_pszDisplay && pItem->m_pszDisplay[0])
+        {
+            INT cch = lstrlenW(pItem->m_pszDisplay);
+            CopyMemory(pszText, pItem->m_pszDisplay, (cch + 1) * sizeof(WCHAR));
+            FoldPrefix(pszText, cch);
+
+            m_pPrefix[m_cPrefix].pszText = pszText;
+            m_pPrefix[m_cPrefix].iItem = iItem;
+            ++m_cPrefix;
+            pszText += cch + 1;
+        }
+    }
+
+    qsort(m_pPrefix, m_cPrefix, sizeof(FAKEMENU_PREFIX), ComparePrefix);
+
+    for (INT i = 0; i < m_cPrefix; ++i)
+        m_piPrefixRank[m_pPrefix[i].iItem] = i;
+}
+
+// Find an item whose text starts with the prefix. If bNext is TRUE, the one after the
+// selection is returned (cyclic). Otherwise the selection is kept if it matches
+INT FakeMenu::FindItemByPrefix(LPCWSTR pszPrefix, INT cchPrefix, BOOL bNext)
+{
+    if (m_fPrefixDirty)
+        BuildPrefixIndex();
+
+    // Folded like the texts
+    WCHAR szPrefix[FAKEMENU_TYPEAHEAD_MAX];
+    cchPrefix = min(cchPrefix, FAKEMENU_TYPEAHEAD_MAX);
+    CopyMemory(szPrefix, pszPrefix, cchPrefix * sizeof(WCHAR));
+    FoldPrefix(szPrefix, cchPrefix);
+
+    // Binary search of the range of the matches
+    INT iLow = 0, iHigh = m_cPrefix;
+    while (iLow < iHigh)
+    {
+        INT iMid = (iLow + iHigh) / 2;
+        if (wcsncmp(m_pPrefix[iMid].pszText, szPrefix, cchPrefix) < 0)
+            iLow = iMid + 1;
+        else
+            iHigh = iMid;
+    }
+    INT iFirst = iLow;
+
+    iHigh = m_cPrefix;
+    while (iLow < iHigh)
+    {
+        INT iMid = (iLow + iHigh) / 2;
+        if (wcsncmp(m_pPrefix[iMid].pszText, szPrefix, cchPrefix) <= 0)
+            iLow = iMid + 1;
+        else
+            iHigh = iMid;
+    }
+    INT iLast = iLow;
+
+    if (iFirst >= iLast)
+        return -1; // Not found
+
+    INT iRank = -1;
+    if (0 <= m_iSelected && m_iSelected < m_cItems)
+        iRank = m_piPrefixRank[m_iSelected];
+
+    if (iFirst <= iRank && iRank < iLast) // The selection matches?
+    {
+        if (!bNext)
+            return m_iSelected;
+        if (iRank + 1 < iLast)
+            return m_pPrefix[iRank + 1].iItem;
+    }
+
+    return m_pPrefix[iFirst].iItem;
+}
+
+// Add the character to the type-ahead buffer and find the item
+INT FakeMenu::TypeAhead(TCHAR ch)
+{
+    DWORD dwTime = ::GetMessageTime();
+    if (dwTime - m_dwTypeAheadTime > FAKEMENU_TYPEAHEAD_TIMEOUT)
+        m_cchTypeAhead = 0; // Timeout
+    m_dwTypeAheadTime = dwTime;
+
+    if (m_cchTypeAhead < FAKEMENU_TYPEAHEAD_MAX)
+        m_szTypeAhead[m_cchTypeAhead++] = ch;
+
+    // Typing the same character repeatedly cycles the items of the character
+    BOOL bRepeated = TRUE;
+    for (INT ich = 1; ich < m_cchTypeAhead; ++ich)
+    {
+        if (m_szTypeAhead[ich] != m_szTypeAhead[0])
+        {
+            bRepeated = FALSE;
+            break;
+        }
+    }
+
+    if (m_cchTypeAhead == 1)
+        return FindItemByPrefix(m_szTypeAhead, 1, TRUE);
+
+    INT iItem = FindItemByPrefix(m_szTypeAhead, m_cchTypeAhead, FALSE);
+    if (iItem < 0 && bRepeated)
+        iItem = FindItemByPrefix(m_szTypeAhead, 1, TRUE);
+
+    return iItem;
+}
+
+void FakeMenu::OnSysChar(HWND hwnd, TCHAR ch, int cRepeat)
+{
+    OnChar(hwnd, ch, cRepeat);
+}
+
+void FakeMenu::OnChar(HWND hwnd, TCHAR ch, int cRepeat)
+{
+    // Typing into the root filters the tree in search mode
+    auto pRoot = GetRoot();
+    if (pRoot->m_fSearchEnabled && (this == pRoot || IsSearchResults()))
+    {
+        pRoot->OnSearchChar(ch);
+        return;
+    }
+
+    INT cMatches;
+    INT iItem = FindItemByAccessChar(ch, &cMatches);
+    if (iItem < 0)
+    {
+        // Not an access key. Search the text
+        if ((UINT)ch < L' ')
+            return;
+
+        iItem = TypeAhead(ch);
+        if (iItem >= 0)
+        {
+            SetCurSel(hwnd, iItem);
+            EnsureVisible(iItem);
+        }
+        return;
+    }
+
+    m_cchTypeAhead = 0;
+    SetCurSel(hwnd, iItem);
+    EnsureVisible(iItem);
+
+    if (cMatches == 1) // Unique?
+        NavReturn();
+}
+
+void FakeMenu::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT flags)
+{
+    if (!fDown)
+        return;
+
+    m_fKeyboardUsing = TRUE;
+
+    INT nInput;
+    switch (vk)
+    {
+        case VK_ESCAPE: nInput = FAKEMENU_NAV_ESCAPE; break;
+        case VK_RETURN: nInput = FAKEMENU_NAV_RETURN; break;
+        case VK_LEFT:   nInput = FAKEMENU_NAV_LEFT; break;
+        case VK_RIGHT:  nInput = FAKEMENU_NAV_RIGHT; break;
+        case VK_UP:     nInput = FAKEMENU_NAV_UP; break;
+        case VK_DOWN:   nInput = FAKEMENU_NAV_DOWN; break;
+        case VK_PRIOR:  nInput = FAKEMENU_NAV_PAGE_UP; break;
+        case VK_NEXT:   nInput = FAKEMENU_NAV_PAGE_DOWN; break;
+        case VK_HOME:   nInput = FAKEMENU_NAV_HOME; break;
+        case VK_END:    nInput = FAKEMENU_NAV_END; break;
+        default:
+            return;
+    }
+
+    if (vk == VK_UP || vk == VK_DOWN || vk == VK_PRIOR || vk == VK_NEXT)
+    {
+        // Coalesce the queued repeats into one repaint. Only while the next message of the
+        // thread is the same key, so that no other input is overtaken
+        MSG msg;
+        while (::PeekMessageW(&msg, NULL, 0, 0, PM_NOREMOVE) &&
+               msg.hwnd == hwnd && msg.message == WM_KEYDOWN && msg.wParam == vk)
+        {
+            ::PeekMessageW(&msg, hwnd, WM_KEYDOWN, WM_KEYDOWN, PM_REMOVE);
+            cRepeat += LOWORD(msg.lParam);
+            if (s_session.pRecording)
+                RecordInput(msg.message, msg.wParam, msg.lParam, msg.time);
+        }
+    }
+
+    INT iOldSelected = m_iSelected;
+    NavKey(nInput, cRepeat);
+
+    if (m_iSelected != iOldSelected)
+        FAKEMENU_LATENCY_MARK(this, FAKEMENU_EVENT_KEY);
+}
+
+// The input to be recorded
+static inline BOOL IsRecordedMessage(UINT uMsg)
+{
+    switch (uMsg)
+    {
+        case WM_MOUSEMOVE:
+        case WM_LBUTTONDOWN:
+        case WM_LBUTTONUP:
+        case WM_RBUTTONDOWN:
+        case WM_RBUTTONUP:
+        case WM_MOUSEWHEEL:
+        case WM_MOUSELEAVE:
+        case WM_KEYDOWN:
+        case WM_SYSKEYDOWN:
+        case WM_CHAR:
+        case WM_SYSCHAR:
+        case WM_CLOSE:
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// The hover timer opens the sub-menus, so the later events find them
+static inline BOOL IsRecordedTimer(UINT uMsg, WPARAM wParam)
+{
+    return uMsg == WM_TIMER && wParam == FAKEMENU_HOVER_TIMER;
+}
+
+LRESULT CALLBACK FakeMenu::WindowProcDx(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    if (s_session.pRecording && (IsRecordedMessage(uMsg) || IsRecordedTimer(uMsg, wParam)))
+        RecordInput(uMsg, wParam, lParam, ::GetMessageTime());
+
+    if (IsClosing() && WM_MOUSEFIRST <= uMsg && uMsg <= WM_MOUSELAST)
+        return 0; // Fading out. Ignore the mouse
+
+    switch (uMsg)
+    {
+        HANDLE_MSG(hwnd, WM_CREATE, OnCreate);
+        HANDLE_MSG(hwnd, WM_SHOWWINDOW, OnShowWindow);
+        HANDLE_MSG(hwnd, WM_DESTROY, OnDestroy);
+        HANDLE_MSG(hwnd, WM_MOUSEMOVE, OnMouseMove);
+        HANDLE_MSG(hwnd, WM_LBUTTONDOWN, OnLButtonDown);
+        HANDLE_MSG(hwnd, WM_LBUTTONUP, OnLButtonUp);
+        HANDLE_MSG(hwnd, WM_RBUTTONDOWN, OnRButtonDown);
+        HANDLE_MSG(hwnd, WM_RBUTTONUP, OnRButtonUp);
+        HANDLE_MSG(hwnd, WM_SYSKEYDOWN, OnKey);
+        HANDLE_MSG(hwnd, WM_KEYDOWN, OnKey);
+        HANDLE_MSG(hwnd, WM_CHAR, OnChar);
+        HANDLE_MSG(hwnd, WM_SYSCHAR, OnSysChar);
+        HANDLE_MSG(hwnd, WM_PAINT, OnPaint);
+        HANDLE_MSG(hwnd, WM_TIMER, OnTimer);
+        HANDLE_MSG(hwnd, WM_MOUSEWHEEL, OnMouseWheel);
+
+        case WM_MOUSEACTIVATE:
+            return MA_NOACTIVATE; // Don't activate the window!
+
+        case WM_MOUSELEAVE:
+            OnMouseLeave(hwnd);
+            break;
+
+        case WM_FAKEMENU_REPAINT:
+            FlushDirty(hwnd);
+            break;
+
+        case WM_FAKEMENU_RESULT:
+            ReportAsync();
+            break;
+
+        case WM_THEMECHANGED:
+        case WM_SETTINGCHANGE:
+            UpdateVisuals(hwnd);
+            break;
+
+        default:
+            return ::DefWindowProc(hwnd, uMsg, wParam, lParam);
+    }
+    return 0;
+}
+
+/*static*/ LRESULT CALLBACK
+FakeMenu::WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    auto pThis = (FakeMenu*)GetWindowLongPtr(hwnd, GWLP_USERDATA);
+    if (uMsg == WM_CREATE)
+    {
+        auto pCS = (CREATESTRUCT*)lParam;
+        pThis = (FakeMenu*)pCS->lpCreateParams;
+        SetWindowLongPtr(hwnd, GWLP_USERDATA, (LONG_PTR)pThis);
+        pThis->m_hwnd = hwnd;
+    }
+    else
+    {
+        if (pThis == NULL)
+            return ::DefWindowProc(hwnd, uMsg, wParam, lParam);
+    }
+    LRESULT ret = pThis->WindowProcDx(hwnd, uMsg, wParam, lParam);
+    if (uMsg == WM_NCDESTROY)
+    {
+        pThis->m_hwnd = NULL;
+    }
+    return ret;
+}
+
+void FakeMenu::ChooseLocation(POINT& pt, INT cx, INT cy, LPCRECT prcExclude)
+{
+    HMONITOR hMon = MonitorFromPoint(pt, MONITOR_DEFAULTTONEAREST);
+    MONITORINFO mi = { sizeof(mi) };
+    GetMonitorInfo(hMon, &mi);
+    INT x = pt.x, y = pt.y;
+
+    if (prcExclude)
+    {
+        if (mi.rcMonitor.right < prcExclude->right + cx)
+            x = prcExclude->left - cx;
+        else
+            x = prcExclude->right;
+
+        if (mi.rcMonitor.bottom < prcExclude->top + cy)
+            y = prcExclude->bottom - cy;
+        else
+            y = prcExclude->top;
+
+        if (x < mi.rcMonitor.left)
+            x = mi.rcMonitor.left;
+
+        if (y < mi.rcMonitor.top)
+            y = mi.rcMonitor.top;
+    }
+    else
+    {
+        if (mi.rcWork.right < x + cx)
+            x -= cx;
+
+        if (mi.rcWork.bottom < y + cy)
+            y -= cy;
+
+        if (x < mi.rcWork.left)
+            x = mi.rcWork.left;
+
+        if (y < mi.rcWork.top)
+            y = mi.rcWork.top;
+    }
+
+    pt.x = x;
+    pt.y = y;
+}
+
+BOOL FakeMenu::AddString(UINT nID, LPCWSTR text, UINT fState/* = MFS_ENABLED*/)
+{
+    MENUITEMINFO mii = { sizeof(mii), MIIM_ID | MIIM_STATE | MIIM_TYPE | MIIM_DATA };
+    if (text && text[0])
+    {
+        mii.fType = MFT_STRING;
+        mii.dwTypeData = const_cast<LPWSTR>(text);
+    }
+    else
+    {
+        mii.fType = MFT_SEPARATOR;
+    }
+    mii.fState = fState;
+    mii.wID = nID;
+    return AppendItem(&mii);
+}
+
+void FakeMenu::DeleteItems()
+{
+    FlushDirty(NULL);
+
+    if (m_pItems && m_cItems)
+    {
+        auto pItem = m_pItems;
+        for (INT iItem = 0; iItem < m_cItems; ++iItem)
+        {
+            auto pNext = pItem->m_pNext;
+            delete pItem->m_pSubMenu;
+            delete pItem;
+            pItem = pNext;
+        }
+    }
+
+    m_pItems = NULL;
+    m_cItems = 0;
+    m_fAccessDirty = m_fPrefixDirty = m_fSelectableDirty = m_fLayoutDirty = TRUE;
+}
+
+void FakeMenu::MeasureItems(SIZE& size)
+{
+    if (!m_fLayoutDirty) // The items, the font and the theme are unchanged?
+    {
+        size = m_sizeLayout;
+        return;
+    }
+
+    if (m_pfnData) // Owner data?
+    {
+        MeasureRows(size);
+        m_sizeLayout = size;
+        m_fLayoutDirty = FALSE;
+        return;
+    }
+
+    FAKEMENU_TRACE_SCOPE_ARG("MeasureItems", m_cItems);
+    FAKEMENU_STAT_TICKS(qwStart);
+    size.cx = size.cy = 0;
+
+    auto pItem = m_pItems;
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    {
+        // Measure the item
+        MEASUREITEMSTRUCT MeasureItem = { ODT_MENU };
+        MeasureItem.itemID = iItem;
+        MeasureItem.itemData = (DWORD_PTR)pItem;
+        MeasureItem.itemWidth = size.cx;
+        MeasureItem.itemHeight = GetSystemMetrics(SM_CYMENU);
+        DoMeasureItem(iItem, pItem, &MeasureItem);
+
+        // Update the width
+        if (size.cx < (LONG)MeasureItem.itemWidth)
+            size.cx = (LONG)MeasureItem.itemWidth;
+
+        // Set the rectangle
+        pItem->m_rcItem.left = 0;
+        pItem->m_rcItem.right = size.cx;
+        pItem->m_rcItem.top = size.cy;
+        pItem->m_rcItem.bottom = size.cy + MeasureItem.itemHeight;
+        pItem->m_cxyItem = MeasureItem.itemHeight;
+
+        // Update height of the contents
+        size.cy += MeasureItem.itemHeight;
+
+        pItem = pItem->m_pNext;
+    }
+
+    // Update the right of the item rectangles
+    pItem = m_pItems;
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    {
+        pItem->m_rcItem.right = size.cx;
+
+        pItem = pItem->m_pNext;
+    }
+
+    m_sizeLayout = size;
+    m_fLayoutDirty = FALSE;
+
+    FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_ITEMS_MEASURED, m_cItems);
+    FAKEMENU_STAT_ADD_TIME(this, FAKEMENU_STAT_MEASURE_TIME, qwStart);
+}
+
+VOID FakeMenu::HideTree(INT idResult, FakeMenu* pFlash/* = NULL*/)
+{
+    FAKEMENU_TRACE_SCOPE("HideTree");
+    m_idResult = idResult; // Set the result ID
+
+    // Hide the self
+    HideWindow(this == pFlash);
+
+    // Hide the sub-menu
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    {
+        auto pSubMenu = GetSubMenu(iItem);
+        if (pSubMenu)
+        {
+            pSubMenu->HideTree(idResult, pFlash);
+        }
+    }
+
+    // Hide the search results and the sub-menu of the rows
+    if (m_pSearch)
+        m_pSearch->HideTree(idResult, pFlash);
+    if (m_pDataSub)
+        m_pDataSub->HideTree(idResult, pFlash);
+
+    // Update s_session.pActiveMenu if necessary
+    if (s_session.pActiveMenu == this)
+    {
+        SetActiveMenu(m_pParent);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Search mode
+//
+// Typing into the root builds a query. The leaf items of the whole tree are ranked by
+// the subsequence match of their paths, and the best ones are shown in m_pSearch.
+
+// The characters in the lowercase text
+static ULONGLONG GetSearchMask(LPCWSTR pszFolded)
+{
+    ULONGLONG mask = 0;
+    for (; *pszFolded; ++pszFolded)
+    {
+        WCHAR ch = *pszFolded;
+        if (L'a' <= ch && ch <= L'z')
+            mask |= 1ULL << (ch - L'a');
+        else if (L'0' <= ch && ch <= L'9')
+            mask |= 1ULL << (26 + ch - L'0');
+        else if (ch != L' ')
+            mask |= 1ULL << (36 + ch % 28);
+    }
+    return mask;
+}
+
+static inline BOOL IsWordStart(LPCWSTR pszText, INT ich)
+{
+    if (ich == 0)
+        return TRUE;
+    WCHAR ch = pszText[ich - 1];
+    return ch == L' ' || ch == L'>' || ch == L'-' || ch == L'_' || ch == L'.' || ch == L'/';
+}
+
+// Returns the score of the subsequence match, or -1 if not matched
+static INT ScoreSubsequence(LPCWSTR pszFolded, LPCWSTR pszQuery, INT cchQuery)
+{
+    INT nScore = 0, iQuery = 0, ichLast = -1;
+    for (INT ich = 0; pszFolded[ich] && iQuery < cchQuery; ++ich)
+    {
+        if (pszFolded[ich] != pszQuery[iQuery])
+            continue;
+
+        nScore += 1;
+        if (IsWordStart(pszFolded, ich))
+            nScore += 8;
+        if (ichLast >= 0 && ichLast + 1 == ich)
+            nScore += 4; // Consecutive
+        else if (ichLast >= 0)
+            nScore -= min(ich - ichLast - 1, 3); // Gap
+
+        ichLast = ich;
+        ++iQuery;
+    }
+
+    if (iQuery < cchQuery)
+        return -1;
+
+    return nScore;
+}
+
+BOOL FakeMenu::IsSearchResults() const
+{
+    return m_pParent && m_pParent->m_pSearch == this;
+}
+
+VOID FakeMenu::EnableSearch(BOOL bEnable)
+{
+    if (!bEnable)
+        EndSearch();
+    m_fSearchEnabled = bEnable;
+}
+
+VOID FakeMenu::AddSearchEntries(FakeMenu* pMenu, LPCWSTR pszPath)
+{
+    INT cchPath = lstrlenW(pszPath);
+
+    auto pItem = pMenu->m_pItems;
+    for (INT iItem = 0; iItem < pMenu->m_cItems; ++iItem, pItem = pItem->m_pNext)
+    {
+        if (pItem->IsSep() || !pItem->m_pszDisplay)
+            continue;
+
+        // "Parent > Item"
+        INT cchItem = cchPath + lstrlenW(FAKEMENU_SEARCH_PATH_SEP) + lstrlenW(pItem->m_pszDisplay);
+        auto pszItem = (LPWSTR)AllocMemory((cchItem + 1) * sizeof(WCHAR));
+        if (!pszItem)
+            return;
+        pszItem[0] = 0;
+        if (cchPath)
+        {
+            lstrcpyW(pszItem, pszPath);
+            lstrcatW(pszItem, FAKEMENU_SEARCH_PATH_SEP);
+        }
+        lstrcatW(pszItem, pItem->m_pszDisplay);
+
+        if (pItem->m_pSubMenu)
+        {
+            AddSearchEntries(pItem->m_pSubMenu, pszItem);
+            free(pszItem);
+            continue;
+        }
+
+        if (m_cSearchIndex >= m_cSearchIndexMax)
+        {
+            INT cMax = (m_cSearchIndexMax ? m_cSearchIndexMax * 2 : 64);
+            auto pNew = (FAKEMENU_SEARCH_ENTRY*)ReallocMemory(m_pSearchIndex, cMax * sizeof(FAKEMENU_SEARCH_ENTRY));
+            if (!pNew)
+            {
+                free(pszItem);
+                return;
+            }
+            m_pSearchIndex = pNew;
+            m_cSearchIndexMax = cMax;
+        }
+
+        auto pszFolded = DupString(pszItem);
+        if (!pszFolded)
+        {
+            free(pszItem);
+            return;
+        }
+        ::CharLowerW(pszFolded);
+
+        auto pEntry = &m_pSearchIndex[m_cSearchIndex++];
+        pEntry->pItem = pItem;
+        pEntry->nID = pItem->m_nID;
+        pEntry->pszPath = pszItem;
+        pEntry->pszFolded = pszFolded;
+        pEntry->maskChars = GetSearchMask(pszFolded);
+    }
+}
+
+VOID FakeMenu::BuildSearchIndex()
+{
+    FreeSearchIndex();
+    AddSearchEntries(this, L"");
+}
+
+VOID FakeMenu::FreeSearchIndex()
+{
+    for (INT i = 0; i < m_cSearchIndex; ++i)
+    {
+        free(m_pSearchIndex[i].pszPath);
+        free(m_pSearchIndex[i].pszFolded);
+    }
+    free(m_pSearchIndex);
+    m_pSearchIndex = NULL;
+    m_cSearchIndex = m_cSearchIndexMax = 0;
+
+    free(m_piSearchMatches);
+    m_piSearchMatches = NULL;
+    m_cSearchMatches = m_cchMatched = 0;
+}
+
+// Add the text as an item. '&' is not a prefix here
+static VOID AddSearchString(FakeMenu* pMenu, UINT nID, LPCWSTR pszText, UINT fState)
+{
+    WCHAR szText[MAX_PATH];
+    INT ich = 0;
+    for (; *pszText && ich < (INT)_countof(szText) - 2; ++pszText)
+    {
+        if (*pszText == L'&')
+            szText[ich++] = L'&';
+        szText[ich++] = *pszText;
+    }
+    szText[ich] = 0;
+
+    pMenu->AddString(nID, szText, fState);
+}
+
+VOID FakeMenu::Search()
+{
+    WCHAR szQuery[FAKEMENU_SEARCH_MAX];
+    lstrcpynW(szQuery, m_szQuery, m_cchQuery + 1);
+    ::CharLowerW(szQuery);
+    ULONGLONG maskQuery = GetSearchMask(szQuery);
+
+    // A longer query matches a subset of the entries of the shorter one. So the entries
+    // matched by the last query are scanned instead of the whole index while typing
+    if (!m_piSearchMatches && m_cSearchIndex > 0)
+        m_piSearchMatches = (INT*)AllocMemory(m_cSearchIndex * sizeof(INT));
+    BOOL bNarrow = (0 < m_cchMatched && m_cchMatched <= m_cchQuery);
+    INT cCandidates = (bNarrow ? m_cSearchMatches : m_cSearchIndex);
+    INT cMatches = 0;
+
+    // Keep the best ones sorted by the score
+    INT aiResults[FAKEMENU_SEARCH_RESULTS], anScores[FAKEMENU_SEARCH_RESULTS];
+    INT cResults = 0;
+    for (INT iCandidate = 0; iCandidate < cCandidates; ++iCandidate)
+    {
+        INT i = (bNarrow ? m_piSearchMatches[iCandidate] : iCandidate);
+        auto pEntry = &m_pSearchIndex[i];
+        if (maskQuery & ~pEntry->maskChars)
+            continue; // Some characters are missing
+
+        INT nScore = ScoreSubsequence(pEntry->pszFolded, szQuery, m_cchQuery);
+        if (nScore < 0)
+            continue;
+
+        // The grayed ones are kept as the matches, for they may be enabled while typing
+        if (m_piSearchMatches) // In place, for iCandidate >= cMatches
+            m_piSearchMatches[cMatches++] = i;
+        if (pEntry->pItem->IsGrayed())
+            continue;
+        if (cResults == FAKEMENU_SEARCH_RESULTS && nScore <= anScores[cResults - 1])
+            continue;
+
+        INT iInsert = (cResults < FAKEMENU_SEARCH_RESULTS ? cResults++ : cResults - 1);
+        while (iInsert > 0 && anScores[iInsert - 1] < nScore)
+        {
+            aiResults[iInsert] = aiResults[iInsert - 1];
+            anScores[iInsert] = anScores[iInsert - 1];
+            --iInsert;
+        }
+        aiResults[iInsert] = i;
+        anScores[iInsert] = nScore;
+    }
+
+    m_cSearchMatches = cMatches;
+    m_cchMatched = (m_piSearchMatches ? m_cchQuery : 0);
+
+    if (!m_pSearch)
+    {
+        m_pSearch = new FakeMenu();
+        m_pSearch->m_pParent = this;
+    }
+
+    // The query and the results
+    m_pSearch->DeleteItems();
+    AddSearchString(m_pSearch, 0, m_szQuery, MFS_GRAYED);
+    m_pSearch->AddString(0, NULL);
+    for (INT i = 0; i < cResults; ++i)
+    {
+        auto pEntry = &m_pSearchIndex[aiResults[i]];
+        AddSearchString(m_pSearch, pEntry->nID, pEntry->pszPath, MFS_ENABLED);
+    }
+
+    // Show it beside the root
+    RECT rc;
+    ::GetWindowRect(m_hwnd, &rc);
+    POINT pt = { rc.right, rc.top };
+    m_pSearch->ShowPopup(pt, TRUE, &rc);
+
+    if (cResults)
+        m_pSearch->SetCurSel(m_pSearch->m_hwnd, 2); // The best one
+}
+
+VOID FakeMenu::OnSearchChar(TCHAR ch)
+{
+    if (ch == L'\b')
+    {
+        if (m_cchQuery == 0)
+            return;
+        --m_cchQuery;
+        m_cchMatched = 0; // The shorter query matches more
+    }
+    else
+    {
+        if ((UINT)ch < L' ' || m_cchQuery >= FAKEMENU_SEARCH_MAX - 1)
+            return;
+        if (m_cchQuery == 0)
+            BuildSearchIndex();
+        m_szQuery[m_cchQuery++] = ch;
+    }
+    m_szQuery[m_cchQuery] = 0;
+
+    if (m_cchQuery == 0)
+        EndSearch();
+    else
+        Search();
+}
+
+VOID FakeMenu::EndSearch()
+{
+    m_cchQuery = 0;
+    m_szQuery[0] = 0;
+    FreeSearchIndex();
+
+    if (m_pSearch && m_pSearch->m_hwnd && ::IsWindowVisible(m_pSearch->m_hwnd))
+        m_pSearch->HideTree(0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Animation
+//
+// All the animating menus of a thread are linked into s_session.pAnimating and
+// driven by one thread timer.
+// The tracking ends without waiting for the animations.
+
+VOID FakeMenu::SetAlpha(BYTE bAlpha)
+{
+    m_bAlpha = bAlpha;
+    ::SetLayeredWindowAttributes(m_hwnd, 0, bAlpha, LWA_ALPHA);
+}
+
+BOOL FakeMenu::IsClosing() const
+{
+    return m_nAnimation == FAKEMENU_ANIMATION_FLASH || m_nAnimation == FAKEMENU_ANIMATION_CLOSE;
+}
+
+VOID FakeMenu::StartAnimation(INT nAnimation)
+{
+    if (m_nAnimation == FAKEMENU_ANIMATION_NONE) // Not linked yet?
+    {
+        m_pNextAnimating = s_session.pAnimating;
+        s_session.pAnimating = this;
+    }
+
+    m_nAnimation = nAnimation;
+    m_dwAnimationStart = ::GetTickCount();
+    m_bAlphaFrom = m_bAlpha;
+    if (nAnimation == FAKEMENU_ANIMATION_FLASH)
+        m_iFlashItem = m_iSelected;
+
+    if (!s_session.idFrameTimer) // Start the frame clock
+        s_session.idFrameTimer = ::SetTimer(NULL, 0, FAKEMENU_ANIMATION_INTERVAL, OnFrameTimer);
+
+    StepAnimation(m_dwAnimationStart); // The first frame
+}
+
+VOID FakeMenu::StopAnimation()
+{
+    if (m_nAnimation == FAKEMENU_ANIMATION_NONE)
+        return;
+
+    // Unlink from s_session.pAnimating
+    for (FakeMenu** ppMenu = &s_session.pAnimating; *ppMenu; ppMenu = &(*ppMenu)->m_pNextAnimating)
+    {
+        if (*ppMenu == this)
+        {
+            *ppMenu = m_pNextAnimating;
+            break;
+        }
+    }
+
+    m_pNextAnimating = NULL;
+    m_nAnimation = FAKEMENU_ANIMATION_NONE;
+
+    if (!s_session.pAnimating && s_session.idFrameTimer) // Stop the frame clock
+    {
+        ::KillTimer(NULL, s_session.idFrameTimer);
+        s_session.idFrameTimer = 0;
+    }
+}
+
+// Returns FALSE if the animation has finished
+BOOL FakeMenu::StepAnimation(DWORD dwNow)
+{
+    DWORD dwElapsed = dwNow - m_dwAnimationStart;
+    INT nProgress; // 0...255
+
+    switch (m_nAnimation)
+    {
+        case FAKEMENU_ANIMATION_OPEN:
+            if (dwElapsed >= FAKEMENU_ANIMATION_OPEN_TIME)
+            {
+                SetAlpha(255);
+                ::SetWindowPos(m_hwnd, NULL, m_ptAnimation.x, m_ptAnimation.y, 0, 0,
+                               SWP_NOACTIVATE | SWP_NOSIZE | SWP_NOZORDER);
+                return FALSE;
+            }
+            nProgress = (INT)(dwElapsed * 255 / FAKEMENU_ANIMATION_OPEN_TIME);
+            SetAlpha((BYTE)(m_bAlphaFrom + (255 - m_bAlphaFrom) * nProgress / 255));
+            ::SetWindowPos(m_hwnd, NULL, m_ptAnimation.x,
+                           m_ptAnimation.y - FAKEMENU_ANIMATION_SLIDE * (255 - nProgress) / 255,
+                           0, 0, SWP_NOACTIVATE | SWP_NOSIZE | SWP_NOZORDER);
+            return TRUE;
+
+        case FAKEMENU_ANIMATION_FLASH:
+            if (dwElapsed >= FAKEMENU_ANIMATION_FLASH_TIME)
+            {
+                SetCurSel(m_hwnd, m_iFlashItem);
+
+                // Then fade out
+                m_nAnimation = FAKEMENU_ANIMATION_CLOSE;
+                m_dwAnimationStart = dwNow;
+                return TRUE;
+            }
+            // Blink the chosen item
+            if ((dwElapsed / FAKEMENU_ANIMATION_BLINK_TIME) % 2)
+                SetCurSel(m_hwnd, m_iFlashItem);
+            else
+                SetCurSel(m_hwnd, -1);
+            return TRUE;
+
+        case FAKEMENU_ANIMATION_CLOSE:
+            if (dwElapsed >= FAKEMENU_ANIMATION_CLOSE_TIME)
+            {
+                ::ShowWindow(m_hwnd, SW_HIDE);
+                SetAlpha(0);
+                return FALSE;
+            }
+            nProgress = (INT)(dwElapsed * 255 / FAKEMENU_ANIMATION_CLOSE_TIME);
+            SetAlpha((BYTE)(m_bAlphaFrom * (255 - nProgress) / 255));
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*static*/ VOID CALLBACK FakeMenu::OnFrameTimer(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+    DWORD dwNow = ::GetTickCount();
+
+    FakeMenu* pNext;
+    for (FakeMenu* pMenu = s_session.pAnimating; pMenu; pMenu = pNext)
+    {
+        pNext = pMenu->m_pNextAnimating;
+        if (pMenu->StepAnimation(dwNow))
+            continue;
+
+        pMenu->StopAnimation();
+
+        // Destroy the tree if FakeMenu_Destroy has been deferred
+        auto pRoot = pMenu->GetRoot();
+        if (pRoot->m_fDestroyLater && !pRoot->IsTreeAnimating())
+        {
+            pRoot->DestroyTree(0);
+            delete pRoot;
+        }
+    }
+}
+
+BOOL FakeMenu::IsTreeAnimating()
+{
+    if (m_nAnimation != FAKEMENU_ANIMATION_NONE)
+        return TRUE;
+
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    {
+        auto pSubMenu = GetSubMenu(iItem);
+        if (pSubMenu && pSubMenu->IsTreeAnimating())
+            return TRUE;
+    }
+
+    if (m_pSearch && m_pSearch->IsTreeAnimating())
+        return TRUE;
+    if (m_pDataSub && m_pDataSub->IsTreeAnimating())
+        return TRUE;
+
+    return FALSE;
+}
+
+// Hide the window with fading out
+VOID FakeMenu::HideWindow(BOOL bFlash)
+{
+    if (!::IsWindowVisible(m_hwnd) || IsClosing())
+        return;
+
+    auto pRoot = GetRoot();
+    if (!pRoot->m_fAnimate || pRoot->m_fDestroying)
+    {
+        StopAnimation();
+        ::ShowWindow(m_hwnd, SW_HIDE);
+        return;
+    }
+
+    StartAnimation(bFlash ? FAKEMENU_ANIMATION_FLASH : FAKEMENU_ANIMATION_CLOSE);
+}
+
+// Defer the destruction of the tree until the animation ends
+BOOL FakeMenu::DestroyLater()
+{
+    if (!IsTreeAnimating())
+        return FALSE;
+
+    m_fDestroyLater = TRUE;
+    return TRUE;
+}
+
+// Close a menu of another process within the time left of FAKEMENU_CLOSE_TIMEOUT.
+// Posted when the time is up, so that the hung ones cost nothing more
+static VOID CloseForeignMenu(HWND hwnd, DWORD dwStart)
+{
+    DWORD dwElapsed = ::GetTickCount() - dwStart;
+    if (dwElapsed < FAKEMENU_CLOSE_TIMEOUT)
+    {
+        ::SendMessageTimeoutW(hwnd, WM_CLOSE, 0, 0, SMTO_ABORTIFHUNG,
+                              FAKEMENU_CLOSE_TIMEOUT - dwElapsed, NULL);
+    }
+    else
+    {
+        ::PostMessageW(hwnd, WM_CLOSE, 0, 0);
+    }
+}
+
+// Close the menus except our family
+VOID FakeMenu::CloseOtherMenus()
+{
+    HWND ahwnd[FAKEMENU_MAX_CLOSE];
+    INT chwnd = 0;
+
+    // The other FakeMenus of this thread. The other threads have their own menus
+    DWORD dwThreadId = ::GetCurrentThreadId();
+    ::EnterCriticalSection(&s_csLiveRoots);
+    for (auto pRoot = s_pLiveRoots; pRoot && chwnd < FAKEMENU_MAX_CLOSE; pRoot = pRoot->m_pNextLive)
+    {
+        if (pRoot != this && pRoot->m_dwThreadId == dwThreadId && !pRoot->m_fDestroying)
+            ahwnd[chwnd++] = pRoot->m_hwnd;
+    }
+    ::LeaveCriticalSection(&s_csLiveRoots);
+
+    // Close them synchronously
+    for (INT i = 0; i < chwnd; ++i)
+        ::SendMessageW(ahwnd[i], WM_CLOSE, 0, 0);
+
+    // The FakeMenus of the other processes. They share one time limit with the standard menus
+    DWORD dwStart = ::GetTickCount();
+    if (s_pSharedRegistry)
+    {
+        DWORD dwPID;
+        WCHAR szClass[64];
+        for (INT iSlot = 0; iSlot < FAKEMENU_SHARED_SLOTS; ++iSlot)
+        {
+            LONG lHwnd = s_pSharedRegistry->ahwnd[iSlot];
+            if (!lHwnd)
+                continue;
+
+            // Left by a dead process? The handle may have been reused by another window
+            HWND hwnd = (HWND)::LongToHandle(lHwnd);
+            if (!::GetClassNameW(hwnd, szClass, _countof(szClass)) ||
+                ::lstrcmpW(szClass, FAKEMENU_CLASSNAMEW) != 0)
+            {
+                ::InterlockedCompareExchange(&s_pSharedRegistry->ahwnd[iSlot], 0, lHwnd);
+                continue;
+            }
+
+            // Don't wait for a hung process
+            ::GetWindowThreadProcessId(hwnd, &dwPID);
+            if (dwPID != ::GetCurrentProcessId())
+                CloseForeignMenu(hwnd, dwStart);
+        }
+    }
+
+    // Close the standard menus
+    ::EndMenu();
+    for (HWND hwnd = NULL; (hwnd = ::FindWindowExW(NULL, hwnd, L"#32768", NULL)) != NULL;)
+    {
+        if (::IsWindowVisible(hwnd))
+            CloseForeignMenu(hwnd, dwStart);
+    }
+}
+
+// A standard menu is shown? For the start of the tracking; OnWinEvent watches it later
+static BOOL IsStdMenuShown()
+{
+    for (HWND hwnd = NULL; (hwnd = ::FindWindowExW(NULL, hwnd, L"#32768", NULL)) != NULL;)
+    {
+        if (::IsWindowVisible(hwnd))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Keep tracking or not?
+BOOL FakeMenu::IsAlive()
+{
+    FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_IS_ALIVE, 1);
+
+    if (m_fDone || m_fCancelled || !s_session.pActiveMenu)
+        return FALSE;
+
+    if (::GetActiveWindow() != s_session.hwndOldActive)
+        return FALSE;
+
+    // The flags are set by OnWinEvent and BeginTracking
+    if (m_fForegroundChanged || m_fStdMenuShown)
+        return FALSE;
+
+    auto pRoot = GetRoot();
+    if (!pRoot)
+        return FALSE;
+
+    // Mouse action?
+    if (::GetKeyState(VK_LBUTTON) < 0 ||
+        ::GetKeyState(VK_MBUTTON) < 0 ||
+        ::GetKeyState(VK_RBUTTON) < 0)
+    {
+        DWORD dwPos = ::GetMessagePos();
+        POINT pt = { LOWORD(dwPos), HIWORD(dwPos) };
+        HWND hwndPt = ::WindowFromPoint(pt);
+        if (!IsFamilyHWND(hwndPt))
+            return FALSE; // Not our family
+    }
+
+    if (::IsWindowVisible(pRoot->m_hwnd) && !pRoot->IsClosing())
+        return TRUE;
+
+    return FALSE;
+}
+
+/*static*/ VOID CALLBACK
+FakeMenu::OnWinEvent(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hwnd,
+                     LONG idObject, LONG idChild, DWORD idEventThread, DWORD dwmsEventTime)
+{
+    auto pRoot = s_session.pTrackingRoot;
+    if (!pRoot)
+        return;
+
+    switch (event)
+    {
+        case EVENT_SYSTEM_FOREGROUND:
+            if (hwnd && hwnd != s_session.hwndOldForeground)
+                pRoot->m_fForegroundChanged = TRUE; // Focus loss
+            break;
+
+        case EVENT_SYSTEM_MENUPOPUPSTART:
+            pRoot->m_fStdMenuShown = TRUE; // A standard menu has appeared
+            break;
+    }
+
+    pRoot->ScheduleCheck();
+}
+
+// Any key-up to be eaten?
+static BOOL AnyKeysEaten()
+{
+    for (auto bEaten : s_session.abKeysEaten)
+    {
+        if (bEaten)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*static*/ VOID FakeMenu::ReleaseKeyUpHook()
+{
+    if (s_session.idKeyUpTimer)
+    {
+        ::KillTimer(NULL, s_session.idKeyUpTimer);
+        s_session.idKeyUpTimer = 0;
+    }
+    if (s_session.hKeyUpHook)
+    {
+        ::UnhookWindowsHookEx(s_session.hKeyUpHook);
+        s_session.hKeyUpHook = NULL;
+    }
+    ZeroMemory(s_session.abKeysEaten, sizeof(s_session.abKeysEaten));
+}
+
+// The eaten key-ups have arrived, or FAKEMENU_KEYUP_TIMEOUT has passed
+/*static*/ VOID CALLBACK FakeMenu::OnKeyUpTimer(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+    ReleaseKeyUpHook();
+}
+
+// Capture the keys of the menu even if another window has the focus.
+// The hook runs on the tracking thread while the messages are being retrieved.
+/*static*/ LRESULT CALLBACK FakeMenu::OnKeyboardLL(INT nCode, WPARAM wParam, LPARAM lParam)
+{
+    auto pKB = (KBDLLHOOKSTRUCT*)lParam;
+    if (nCode != HC_ACTION)
+        return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+
+    // The key-ups first, for the key-downs eaten by this thread may end the tracking
+    BYTE& bEaten = s_session.abKeysEaten[(pKB->vkCode & 0xFF) / 8];
+    BYTE bKey = (BYTE)(1 << (pKB->vkCode % 8));
+    if (pKB->flags & LLKHF_UP)
+    {
+        if (pKB->vkCode == s_session.vkLastDown)
+            s_session.vkLastDown = 0;
+
+        // Eat the key-up of an eaten key-down, or the window below gets it alone
+        if (bEaten & bKey)
+        {
+            bEaten &= ~bKey;
+            if (s_session.hKeyUpHook && !AnyKeysEaten()) // The last one after the tracking?
+                s_session.idKeyUpTimer = ::SetTimer(NULL, s_session.idKeyUpTimer, 0, OnKeyUpTimer);
+            return 1;
+        }
+        return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    if (s_dwKeyboardThread != ::GetCurrentThreadId()) // Another thread gets the keyboard?
+        return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+
+    if (!s_session.pActiveMenu || !s_session.pActiveMenu->m_hwnd)
+        return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+
+    switch (pKB->vkCode)
+    {
+        case VK_LEFT:
+        case VK_RIGHT:
+        case VK_UP:
+        case VK_DOWN:
+        case VK_RETURN:
+        case VK_ESCAPE:
+            break;
+
+        default:
+            return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    // The keys with modifiers are not ours
+    if (::GetAsyncKeyState(VK_CONTROL) < 0 || ::GetAsyncKeyState(VK_MENU) < 0 ||
+        ::GetAsyncKeyState(VK_SHIFT) < 0 || ::GetAsyncKeyState(VK_LWIN) < 0 ||
+        ::GetAsyncKeyState(VK_RWIN) < 0)
+    {
+        return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    UINT flags = (pKB->scanCode & 0xFF);
+    if (pKB->flags & LLKHF_EXTENDED)
+        flags |= KF_EXTENDED;
+    if (pKB->vkCode == s_session.vkLastDown)
+        flags |= KF_REPEAT;
+    s_session.vkLastDown = pKB->vkCode;
+
+    ::PostMessageW(s_session.pActiveMenu->m_hwnd, WM_KEYDOWN, pKB->vkCode, MAKELPARAM(1, flags));
+    bEaten |= bKey;
+    return 1; // Eat it
+}
+
+VOID FakeMenu::BeginTracking()
+{
+    m_dwThreadId = ::GetCurrentThreadId();
+    SetIdle(FALSE);
+
+    // Register to the live-menu registry
+    ::EnterCriticalSection(&s_csLiveRoots);
+    m_pNextLive = s_pLiveRoots;
+    s_pLiveRoots = this;
+    s_dwKeyboardThread = m_dwThreadId;
+    ::LeaveCriticalSection(&s_csLiveRoots);
+
+    if (s_pSharedRegistry)
+    {
+        m_lSharedHwnd = ::HandleToLong(m_hwnd);
+        for (INT iSlot = 0; iSlot < FAKEMENU_SHARED_SLOTS; ++iSlot)
+        {
+            if (!::InterlockedCompareExchange(&s_pSharedRegistry->ahwnd[iSlot], m_lSharedHwnd, 0))
+                break;
+        }
+    }
+
+    s_session.pTrackingRoot = this;
+    m_fCancelled = FALSE;
+    m_fForegroundChanged = m_fStdMenuShown = FALSE;
+    if (m_hCancelEvent)
+        ::ResetEvent(m_hCancelEvent);
+    else
+        m_hCancelEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    // Detect focus loss and standard menus. The hooks miss a standard menu shown already
+    m_fStdMenuShown = IsStdMenuShown();
+    m_hForegroundHook = ::SetWinEventHook(EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND,
+                                          NULL, OnWinEvent, 0, 0, WINEVENT_OUTOFCONTEXT);
+    m_hMenuPopupHook = ::SetWinEventHook(EVENT_SYSTEM_MENUPOPUPSTART, EVENT_SYSTEM_MENUPOPUPSTART,
+                                         NULL, OnWinEvent, 0, 0, WINEVENT_OUTOFCONTEXT);
+
+    // Capture the keyboard once for the whole tracking. The hook still waiting for the
+    // key-ups of the last tracking is taken over with them
+    s_session.vkLastDown = 0;
+    if (s_session.hKeyUpHook)
+    {
+        if (s_session.idKeyUpTimer)
+        {
+            ::KillTimer(NULL, s_session.idKeyUpTimer);
+            s_session.idKeyUpTimer = 0;
+        }
+        m_hKeyboardHook = s_session.hKeyUpHook;
+        s_session.hKeyUpHook = NULL;
+    }
+    else
+    {
+        ZeroMemory(s_session.abKeysEaten, sizeof(s_session.abKeysEaten));
+        m_hKeyboardHook = ::SetWindowsHookExW(WH_KEYBOARD_LL, OnKeyboardLL,
+                                              ::GetModuleHandleW(NULL), 0);
+    }
+
+    if (m_pszRecordFile) // Recording?
+    {
+        AssignTreeIndexes(0);
+        m_cRecord = 0;
+        m_dwRecordStart = ::GetTickCount();
+        s_session.pRecording = this;
+    }
+}
+
+VOID FakeMenu::EndTracking()
+{
+    FAKEMENU_LATENCY_END();
+
+    if (s_session.pRecording == this)
+    {
+        s_session.pRecording = NULL;
+        SaveRecording();
+    }
+
+    if (m_hGetMessageHook)
+    {
+        ::UnhookWindowsHookEx(m_hGetMessageHook);
+        m_hGetMessageHook = NULL;
+    }
+
+    // Return or Escape ends the tracking before its key-up arrives. Keep the hook to eat
+    // the key-ups, or the host gets them alone
+    if (m_hKeyboardHook && AnyKeysEaten() && !s_session.hKeyUpHook)
+    {
+        s_session.hKeyUpHook = m_hKeyboardHook;
+        s_session.idKeyUpTimer = ::SetTimer(NULL, 0, FAKEMENU_KEYUP_TIMEOUT, OnKeyUpTimer);
+        m_hKeyboardHook = NULL;
+    }
+    if (m_hKeyboardHook)
+    {
+        ::UnhookWindowsHookEx(m_hKeyboardHook);
+        m_hKeyboardHook = NULL;
+    }
+
+    if (m_hForegroundHook)
+    {
+        ::UnhookWinEvent(m_hForegroundHook);
+        m_hForegroundHook = NULL;
+    }
+    if (m_hMenuPopupHook)
+    {
+        ::UnhookWinEvent(m_hMenuPopupHook);
+        m_hMenuPopupHook = NULL;
+    }
+
+    if (s_session.pTrackingRoot == this)
+        s_session.pTrackingRoot = NULL;
+
+    // Unregister from the live-menu registry
+    ::EnterCriticalSection(&s_csLiveRoots);
+    for (FakeMenu** ppRoot = &s_pLiveRoots; *ppRoot; ppRoot = &(*ppRoot)->m_pNextLive)
+    {
+        if (*ppRoot == this)
+        {
+            *ppRoot = m_pNextLive;
+            break;
+        }
+    }
+    m_pNextLive = NULL;
+    s_dwKeyboardThread = (s_pLiveRoots ? s_pLiveRoots->m_dwThreadId : 0);
+    ::LeaveCriticalSection(&s_csLiveRoots);
+
+    if (s_pSharedRegistry && m_lSharedHwnd)
+    {
+        for (INT iSlot = 0; iSlot < FAKEMENU_SHARED_SLOTS; ++iSlot)
+            ::InterlockedCompareExchange(&s_pSharedRegistry->ahwnd[iSlot], 0, m_lSharedHwnd);
+    }
+    m_lSharedHwnd = 0;
+
+    m_dwLastUsed = ::GetTickCount();
+    if (s_dwAutoTrimIdle)
+        SetIdle(TRUE);
+}
+
+// This can be called from any thread
+VOID FakeMenu::Cancel()
+{
+    m_fCancelled = TRUE;
+    if (m_hCancelEvent)
+        ::SetEvent(m_hCancelEvent);
+    if (m_fAsync)
+        ::PostThreadMessageW(m_dwThreadId, s_uCheckMessage, 0, 0);
+}
+
+// Check IsAlive after the current message of the asynchronous tracking
+VOID FakeMenu::ScheduleCheck()
+{
+    if (!m_fAsync || m_fCheckPending)
+        return;
+
+    m_fCheckPending = TRUE;
+    ::PostThreadMessageW(m_dwThreadId, s_uCheckMessage, 0, 0);
+}
+
+// The message hook of the asynchronous tracking on the host's message loop
+/*static*/ LRESULT CALLBACK FakeMenu::OnGetMessage(INT nCode, WPARAM wParam, LPARAM lParam)
+{
+    auto pRoot = s_session.pTrackingRoot;
+    auto pMsg = (MSG*)lParam;
+    if (nCode == HC_ACTION && wParam == PM_REMOVE && pRoot && pRoot->m_fAsync)
+    {
+        if (!pMsg->hwnd && pMsg->message == s_uCheckMessage)
+        {
+            pMsg->message = WM_NULL;
+            pRoot->m_fCheckPending = FALSE;
+            if (!pRoot->IsAlive())
+                pRoot->FinishAsync(TRUE); // Not in the hook
+        }
+        else
+        {
+            if (!pRoot->PreTranslate(*pMsg))
+                pMsg->message = WM_NULL; // Drop it
+
+            pRoot->ScheduleCheck();
+        }
+    }
+
+    return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+}
+
+// Returns FALSE if the message should be dropped
+BOOL FakeMenu::PreTranslate(MSG& msg)
+{
+    switch (msg.message)
+    {
+    case WM_LBUTTONDBLCLK:
+    case WM_LBUTTONDOWN:
+    case WM_LBUTTONUP:
+    case WM_MBUTTONDBLCLK:
+    case WM_MBUTTONDOWN:
+    case WM_MBUTTONUP:
+    case WM_RBUTTONDBLCLK:
+    case WM_RBUTTONDOWN:
+    case WM_RBUTTONUP:
+    case WM_NCLBUTTONDBLCLK:
+    case WM_NCLBUTTONDOWN:
+    case WM_NCLBUTTONUP:
+    case WM_NCMBUTTONDBLCLK:
+    case WM_NCMBUTTONDOWN:
+    case WM_NCMBUTTONUP:
+    case WM_NCRBUTTONDBLCLK:
+    case WM_NCRBUTTONDOWN:
+    case WM_NCRBUTTONUP:
+        // Mouse action!
+        if (!IsFamilyHWND(msg.hwnd))
+        {
+            ::SendMessageW(m_hwnd, WM_CLOSE, 0, 0);
+            return (s_session.hwndOldActive == msg.hwnd); // Only the old active window gets it
+        }
+        break;
+
+    case WM_KEYDOWN:
+    case WM_KEYUP:
+    case WM_CHAR:
+    case WM_DEADCHAR:
+    case WM_SYSKEYDOWN:
+    case WM_SYSKEYUP:
+    case WM_SYSCHAR:
+    case WM_SYSDEADCHAR:
+        // Keyboard action!
+        if (s_session.pActiveMenu)
+            msg.hwnd = s_session.pActiveMenu->m_hwnd;
+        else
+            msg.hwnd = m_hwnd;
+        break;
+    }
+
+    return TRUE;
+}
+
+void FakeMenu::DoMessageLoop(MSG& msg)
+{
+    msg.message = WM_NULL;
+#ifdef FAKEMENU_ENABLE_STATS
+    BOOL bIdle = FALSE; // Woke up without messages?
+#endif
+
+    for (;;)
+    {
+        // Process the queued messages
+        while (::PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+        {
+            FAKEMENU_TRACE_SCOPE_ARG("DoMessageLoop", (INT)msg.message);
+            FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_LOOP_ITERATIONS, 1);
+#ifdef FAKEMENU_ENABLE_STATS
+            bIdle = FALSE;
+#endif
+
+            if (msg.message == WM_QUIT)
+                return;
+
+            if (PreTranslate(msg))
+            {
+                ::TranslateMessage(&msg);
+                ::DispatchMessage(&msg);
+            }
+
+            if (!IsAlive())
+                return;
+        }
+
+        // The hooks may have been called within PeekMessage
+        if (!IsAlive())
+            return;
+
+#ifdef FAKEMENU_ENABLE_STATS
+        if (bIdle)
+            FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_IDLE_WAKEUPS, 1);
+#endif
+
+        // Sleep until an input, a sent message, a timer or the cancellation comes
+        DWORD dwWait = ::MsgWaitForMultipleObjectsEx(1, &m_hCancelEvent, INFINITE, QS_ALLINPUT,
+                                                     MWMO_INPUTAVAILABLE);
+        if (dwWait == WAIT_OBJECT_0 || dwWait == WAIT_FAILED) // Cancelled or failed?
+            return;
+
+        FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_WAKEUPS, 1);
+#ifdef FAKEMENU_ENABLE_STATS
+        bIdle = TRUE;
+#endif
+    }
+}
+
+VOID FakeMenu::ShowPopup(POINT pt, BOOL fKeyboard, LPCRECT prcExclude)
+{
+    // Close the other menus if necessary
+    if (!m_pParent)
+        CloseOtherMenus();
+
+    // The search ends when the menu opens or a sub-menu is opened
+    if (!m_pParent)
+        EndSearch();
+    else if (m_pParent->m_pSearch && m_pParent->m_pSearch != this)
+        m_pParent->EndSearch();
+
+    // Save the active window and the foreground window To detect mouse actions
+    s_session.hwndOldActive = ::GetActiveWindow();
+    s_session.hwndOldForeground = ::GetForegroundWindow();
+
+    InitStatus();
+    FlushDirty(NULL); // The whole window will be painted
+
+#ifdef FAKEMENU_ENABLE_STATS
+    if (!m_pParent) // Root?
+    {
+        FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_TRACKS, 1);
+        m_qwTrackStart = GetStatTicks();
+    }
+#endif
+
+    if (!m_pParent) // Root?
+        m_fAnimate = IsMenuAnimationEnabled();
+
+    m_fKeyboardUsing = fKeyboard;
+
+    DWORD style = WS_POPUP | WS_BORDER; // Popup with border
+    DWORD exstyle =
+        WS_EX_TOPMOST |         // Always show on top
+        WS_EX_NOACTIVATE |      // Always don't activate
+        WS_EX_TOOLWINDOW |      // Don't show the taskbar pane
+        WS_EX_DLGMODALFRAME |   // With dialog frame
+        WS_EX_WINDOWEDGE |      // With window edge
+        WS_EX_LAYERED;          // For fading
+
+    /* Measure items */
+    SIZE size;
+    MeasureItems(size);
+    m_cyContent = size.cy;
+
+    // Scroll if taller than the work area
+    HMONITOR hMon = ::MonitorFromPoint(pt, MONITOR_DEFAULTTONEAREST);
+    MONITORINFO mi = { sizeof(mi) };
+    ::GetMonitorInfo(hMon, &mi);
+    RECT rcFrame = { 0, 0, 0, 0 };
+    ::AdjustWindowRectEx(&rcFrame, style, FALSE, exstyle);
+    INT cyMax = (mi.rcWork.bottom - mi.rcWork.top) - (rcFrame.bottom - rcFrame.top);
+    if (size.cy > cyMax)
+        size.cy = cyMax;
+    m_cyView = size.cy;
+
+    RECT rc = { 0, 0, size.cx, size.cy };
+    ::AdjustWindowRectEx(&rc, style, FALSE, exstyle);
+
+    size.cx = rc.right - rc.left;
+    size.cy = rc.bottom - rc.top;
+    ChooseLocation(pt, size.cx, size.cy, prcExclude);
+
+    // Create or move?
+    if (!m_hwnd)
+    {
+        HWND hwnd = ::CreateWindowExW(exstyle, FAKEMENU_CLASSNAME, FAKEMENU_CLASSNAME, style,
+                                      pt.x, pt.y, size.cx, size.cy,
+                                      NULL, NULL, GetModuleHandle(NULL), this);
+        assert(m_hwnd == hwnd);
+        FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_WINDOWS_CREATED, 1);
+    }
+    else
+    {
+        ::SetWindowPos(m_hwnd, HWND_TOPMOST, pt.x, pt.y, size.cx, size.cy,
+                       SWP_NOACTIVATE | SWP_NOOWNERZORDER);
+    }
+
+    // Fade in and slide if the window is not shown yet
+    m_ptAnimation = pt;
+    if (!::IsWindowVisible(m_hwnd))
+        m_bAlpha = 0;
+    if (GetRoot()->m_fAnimate && (m_bAlpha == 0 || IsClosing()))
+    {
+        StartAnimation(FAKEMENU_ANIMATION_OPEN);
+    }
+    else
+    {
+        StopAnimation();
+        SetAlpha(255);
+    }
+
+    SetActiveMenu(this);
+
+    if (m_pParent) // Sub-menu?
+    {
+        auto iOpenSubMenu = m_pParent->m_iOpenSubMenu;
+        if (iOpenSubMenu != -1)
+        {
+            auto pSubMenu = m_pParent->GetSubMenu(iOpenSubMenu);
+            if (pSubMenu && pSubMenu != this)
+                pSubMenu->HideTree(0); // Another sub-menu to be hidden
+        }
+        m_pParent->m_iOpenSubMenu = m_iParentItem; // Update parent's m_iOpenSubMenu
+    }
+
+    // Show the window but don't activate it!
+    ::ShowWindow(m_hwnd, SW_SHOWNOACTIVATE);
+
+    if (m_fKeyboardUsing)
+        SetCurSel(m_hwnd, GetNextSelectable(-1, TRUE));
 }
 
-void FakeMenu::OnReturn()
+INT FakeMenu::TrackPopup(POINT pt, BOOL fKeyboard, LPCRECT prcExclude)
 {
-    if (m_iSelected < 0)
-        return; // Not selected
+    if (m_fAsync) // Being tracked asynchronously?
+        return 0;
 
-    auto pItem = GetItem(m_iSelected);
-    if (!pItem || pItem->IsSep() || pItem->IsGrayed())
-        return; // The action is disabled
-
-    auto pSubMenu = pItem->m_pSubMenu;
-    if (pSubMenu) // Open sub-menu?
+    MSG msg;
+    msg.message = WM_NULL;
     {
-        RECT rcItem = pItem->m_rcItem;
-        POINT pt = { rcItem.right, rcItem.top };
-        ::ClientToScreen(m_hwnd, &pt);
-        ::MapWindowRect(m_hwnd, NULL, &rcItem);
+        FAKEMENU_TRACE_SCOPE("TrackPopup");
+        ShowPopup(pt, fKeyboard, prcExclude);
+
+        if (!m_pParent) // Root?
+        {
+            BeginTracking();
+            DoMessageLoop(msg);
+            EndTracking();
 
-        // Open the sub-menu
-        pSubMenu->TrackPopup(pt, TRUE, &rcItem);
+            HideTree(m_idResult); // Done. Hide the tree
+        }
     }
-    else
+
+    if (!m_pParent) // Root?
     {
-        // Choose the menu item
-        INT idResult = IdFromIndex(m_iSelected);
-        auto pRoot = GetRoot();
-        if (pRoot)
+        FakeMenuTrace_Flush(); // Deliver the events of the session
+
+        if (msg.message == WM_QUIT)
         {
-            pRoot->HideTree(idResult);
+            ::PostQuitMessage((INT)msg.wParam);
         }
     }
+
+    return m_idResult;
+}
+
+BOOL FakeMenu::TrackPopupAsync(POINT pt, FAKEMENUPROC pfnCallback, LPVOID pContext)
+{
+    if (m_pParent || m_fAsync) // Not root or being tracked?
+        return FALSE;
+
+    ReportAsync(); // The last tracking, if not reported yet
+
+    ShowPopup(pt, FALSE, NULL);
+
+    m_pfnCallback = pfnCallback;
+    m_pCallbackContext = pContext;
+    m_fCheckPending = FALSE;
+
+    BeginTracking();
+
+    // Watch the messages of the host's loop
+    m_hGetMessageHook = ::SetWindowsHookExW(WH_GETMESSAGE, OnGetMessage, NULL, m_dwThreadId);
+
+    // After m_dwThreadId is set, for Cancel of the other threads
+    ::InterlockedExchange(&m_fAsync, TRUE);
+
+    ScheduleCheck();
+    return TRUE;
 }
 
-void FakeMenu::OnEscape()
+// Finish the asynchronous tracking and report the result. If bDefer, the result is reported
+// from the window procedure, so the callback doesn't run in the message hook
+VOID FakeMenu::FinishAsync(BOOL bDefer)
 {
-    ::ShowWindow(m_hwnd, SW_HIDE);
-    if (s_pActiveMenu)
+    if (::InterlockedExchange(&m_fAsync, FALSE))
     {
-        SetActiveMenu(s_pActiveMenu->m_pParent);
+        EndTracking();
+        HideTree(m_idResult); // Done. Hide the tree
+        FakeMenuTrace_Flush(); // Deliver the events of the session
+
+        if (bDefer && m_pfnCallback && ::PostMessageW(m_hwnd, WM_FAKEMENU_RESULT, 0, 0))
+            return;
     }
+
+    ReportAsync();
 }
 
-void FakeMenu::OnLeft()
+// Call the callback of the finished asynchronous tracking once
+VOID FakeMenu::ReportAsync()
 {
-    ::ShowWindow(m_hwnd, SW_HIDE);
-    if (s_pActiveMenu)
-        SetActiveMenu(s_pActiveMenu->m_pParent);
+    if (m_fAsync)
+        return;
+
+    auto pfnCallback = m_pfnCallback;
+    m_pfnCallback = NULL;
+    if (pfnCallback)
+        pfnCallback(reinterpret_cast<HFAKEMENU>(this), m_idResult, m_pCallbackContext);
 }
 
-void FakeMenu::OnRight()
+INT FakeMenu::GetNextIndex(INT iItem, BOOL bNext)
 {
-    if (m_iSelected < 0) // Not selected
-        return;
+    if (bNext)
+    {
+        ++iItem;
+        if (iItem >= m_cItems)
+            iItem = 0;
+    }
+    else
+    {
+        --iItem;
+        if (iItem < 0)
+            iItem = m_cItems - 1;
+    }
+    return iItem;
+}
 
-    auto pItem = GetItem(m_iSelected);
-    if (!pItem || pItem->IsSep() || pItem->IsGrayed())
-        return; // The action is disabled
+// Link each position to the next and the previous selectable ones
+VOID FakeMenu::BuildSelectable()
+{
+    m_fSelectableDirty = FALSE;
 
-    auto pSubMenu = pItem->m_pSubMenu;
-    if (!pSubMenu) // No sub-menu?
-        return;
+    INT iLast = -1;
+    for (INT iTry = 0; iTry < 2 * m_cItems; ++iTry)
+    {
+        INT iItem = iTry % m_cItems;
+        m_pPositions[iItem].iPrevSelectable = iLast;
+        if (!m_pPositions[iItem].pItem->IsSep())
+            iLast = iItem;
+    }
 
-    // Get the item rectangle in screen coordinates
-    RECT rcItem = pItem->m_rcItem;
-    POINT pt = { rcItem.right, rcItem.top };
-    ::ClientToScreen(m_hwnd, &pt);
-    ::MapWindowRect(m_hwnd, NULL, &rcItem);
+    iLast = -1;
+    for (INT iTry = 2 * m_cItems - 1; iTry >= 0; --iTry)
+    {
+        INT iItem = iTry % m_cItems;
+        m_pPositions[iItem].iNextSelectable = iLast;
+        if (!m_pPositions[iItem].pItem->IsSep())
+            iLast = iItem;
+    }
+}
 
-    // Open the sub-menu
-    pSubMenu->TrackPopup(pt, TRUE, &rcItem);
+INT FakeMenu::GetNextSelectable(INT iItem, BOOL bNext)
+{
+    if (m_cItems <= 0)
+        return -1;
+
+    if (m_fSelectableDirty)
+        BuildSelectable();
+
+    if (iItem < 0 || m_cItems <= iItem) // From the edge
+        iItem = (bNext ? m_cItems - 1 : 0);
+
+    if (bNext)
+        return m_pPositions[iItem].iNextSelectable;
+    else
+        return m_pPositions[iItem].iPrevSelectable;
 }
 
-INT FakeMenu::FindItemByAccessChar(TCHAR ch)
+// The selectable item about one page away
+INT FakeMenu::GetPageItem(INT iItem, BOOL bNext)
 {
-    WCHAR szUpper[3] = { '&', ch, 0 };
-    WCHAR szLower[3] = { '&', ch, 0 };
-    ::CharUpperW(szUpper);
-    ::CharLowerW(szLower);
+    INT cItems = GetCount();
+    if (cItems <= 0)
+        return -1;
 
-    // Search the menu item by the access key
-    auto pItem = m_pItems;
-    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    auto pItem = GetItem(iItem);
+    INT y;
+    if (!pItem)
+        y = m_yScroll;
+    else if (bNext)
+        y = pItem->m_rcItem.top + max(m_cyView, 1);
+    else
+        y = pItem->m_rcItem.top - max(m_cyView, 1);
+
+    INT iPage;
+    if (y < 0)
+        iPage = 0;
+    else if (y >= m_cyContent)
+        iPage = cItems - 1;
+    else
+        iPage = max(ItemFromY(y), 0);
+
+    // Skip the separators without wrapping around
+    for (INT i = iPage; 0 <= i && i < cItems; i += (bNext ? 1 : -1))
     {
-        if (pItem->m_pszText)
-        {
-            if (wcsstr(pItem->m_pszText, szUpper) != NULL ||
-                wcsstr(pItem->m_pszText, szLower) != NULL)
-            {
-                return iItem; // Found
-            }
-        }
-        pItem = pItem->m_pNext;
+        pItem = GetItem(i);
+        if (pItem && !pItem->IsSep())
+            return i;
+    }
+    for (INT i = iPage; 0 <= i && i < cItems; i += (bNext ? -1 : 1))
+    {
+        pItem = GetItem(i);
+        if (pItem && !pItem->IsSep())
+            return i;
     }
 
     return -1;
 }
 
-void FakeMenu::OnSysChar(HWND hwnd, TCHAR ch, int cRepeat)
+BOOL FakeMenu::IsFamilyHWND(HWND hwnd)
 {
-    INT iItem = FindItemByAccessChar(ch);
-    SetCurSel(hwnd, iItem);
-    OnReturn();
+    auto pMenu = FakeMenu::FromHWND(hwnd);
+    if (!pMenu)
+        return FALSE;
+    return GetRoot() == pMenu->GetRoot(); // The root is same?
 }
 
-void FakeMenu::OnChar(HWND hwnd, TCHAR ch, int cRepeat)
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Performance counters
+
+#ifdef FAKEMENU_ENABLE_STATS
+
+static volatile LONG64 s_aStats[FAKEMENU_STAT_MAX]; // Process-wide
+
+// The tree counters are updated by the UI thread only
+static VOID AddStat(FakeMenu* pMenu, INT iStat, LONG64 n)
 {
-    INT iItem = FindItemByAccessChar(ch);
-    SetCurSel(hwnd, iItem);
-    OnReturn();
+    ::InterlockedExchangeAdd64(&s_aStats[iStat], n);
+    if (pMenu)
+        pMenu->GetRoot()->m_aStats[iStat] += n;
 }
 
-void FakeMenu::OnKey(HWND hwnd, UINT vk, BOOL fDown, INT cRepeat, UINT flags)
+static VOID StatsToStruct(const volatile LONG64* aStats, FAKEMENU_STATS* pStats)
 {
-    if (!fDown)
+    LARGE_INTEGER liFreq;
+    ::QueryPerformanceFrequency(&liFreq);
+
+    FAKEMENU_STATS stats = { sizeof(stats) };
+#define TO_MICROSECONDS(qwTicks) (ULONGLONG)((qwTicks) * 1000000 / liFreq.QuadPart)
+    stats.cItemsMeasured = aStats[FAKEMENU_STAT_ITEMS_MEASURED];
+    stats.usMeasureTime = TO_MICROSECONDS(aStats[FAKEMENU_STAT_MEASURE_TIME]);
+    stats.cPaints = aStats[FAKEMENU_STAT_PAINTS];
+    stats.usPaintTime = TO_MICROSECONDS(aStats[FAKEMENU_STAT_PAINT_TIME]);
+    stats.cHitTests = aStats[FAKEMENU_STAT_HIT_TESTS];
+    stats.cIsAlive = aStats[FAKEMENU_STAT_IS_ALIVE];
+    stats.cLoopIterations = aStats[FAKEMENU_STAT_LOOP_ITERATIONS];
+    stats.cWakeups = aStats[FAKEMENU_STAT_WAKEUPS];
+    stats.cIdleWakeups = aStats[FAKEMENU_STAT_IDLE_WAKEUPS];
+    stats.cWindowsCreated = aStats[FAKEMENU_STAT_WINDOWS_CREATED];
+    stats.cGdiObjectsCreated = aStats[FAKEMENU_STAT_GDI_OBJECTS];
+    stats.cTracks = aStats[FAKEMENU_STAT_TRACKS];
+    stats.usFirstPaintTime = TO_MICROSECONDS(aStats[FAKEMENU_STAT_FIRST_PAINT_TIME]);
+    stats.cAllocations = aStats[FAKEMENU_STAT_ALLOCATIONS];
+#undef TO_MICROSECONDS
+
+    // Copy as much as the caller knows
+    DWORD cbSize = min(pStats->cbSize, (DWORD)sizeof(stats));
+    CopyMemory(pStats, &stats, cbSize);
+    pStats->cbSize = cbSize;
+}
+
+BOOL FakeMenu::GetStats(FAKEMENU_STATS* pStats)
+{
+    StatsToStruct(GetRoot()->m_aStats, pStats);
+    return TRUE;
+}
+
+VOID FakeMenu::ResetStats()
+{
+    ZeroMemory(GetRoot()->m_aStats, sizeof(m_aStats));
+}
+
+// The latency histograms (process-wide)
+static volatile LONG64 s_aLatency[FAKEMENU_EVENT_MAX][FAKEMENU_LATENCY_BUCKETS];
+static volatile LONG s_amsLatencyMax[FAKEMENU_EVENT_MAX];
+
+static INT LatencyToBucket(DWORD ms)
+{
+    if (ms > FAKEMENU_LATENCY_MAX)
+        ms = FAKEMENU_LATENCY_MAX;
+    if (ms < FAKEMENU_LATENCY_SUB_BUCKETS)
+        return (INT)ms;
+
+    INT iBit = 0; // The highest bit
+    for (DWORD dw = ms; dw > 1; dw >>= 1)
+        ++iBit;
+
+    return (iBit - 3) * FAKEMENU_LATENCY_SUB_BUCKETS + ((ms >> (iBit - 4)) & 15);
+}
+
+// The highest value of the bucket
+static DWORD BucketToLatency(INT iBucket)
+{
+    if (iBucket < FAKEMENU_LATENCY_SUB_BUCKETS)
+        return iBucket;
+
+    INT iBit = iBucket / FAKEMENU_LATENCY_SUB_BUCKETS + 3;
+    DWORD dwLow = (DWORD)(FAKEMENU_LATENCY_SUB_BUCKETS + iBucket % FAKEMENU_LATENCY_SUB_BUCKETS) << (iBit - 4);
+    return dwLow + (1 << (iBit - 4)) - 1;
+}
+
+// Remember the first input that the next paint will reflect
+static VOID MarkLatency(FakeMenu* pMenu, INT nEvent)
+{
+    if (s_session.iPendingEvent)
         return;
 
-    m_fKeyboardUsing = TRUE;
+    s_session.iPendingEvent = nEvent + 1;
+    s_session.dwPendingTime = ::GetMessageTime();
+    s_session.pPendingMenu = pMenu;
+}
 
-    INT iItem;
-    switch (vk)
-    {
-        case VK_ESCAPE:
-            OnEscape();
-            break;
+// The marked menu paints the input, or the tracking ends (the selection is delivered).
+// The paints of the other menus of the thread don't count
+static VOID RecordLatency(FakeMenu* pMenu, BOOL bEnd)
+{
+    INT nEvent = s_session.iPendingEvent - 1;
+    if (nEvent < 0 || (!bEnd && pMenu != s_session.pPendingMenu))
+        return;
 
-        case VK_RETURN:
-            OnReturn();
-            break;
+    s_session.iPendingEvent = 0;
+    s_session.pPendingMenu = NULL;
+    if (bEnd && nEvent != FAKEMENU_EVENT_SELECT)
+        return; // Never painted
 
-        case VK_LEFT:
-            OnLeft();
-            break;
+    DWORD ms = (DWORD)::GetTickCount() - s_session.dwPendingTime;
+    if (ms > FAKEMENU_LATENCY_MAX)
+        ms = FAKEMENU_LATENCY_MAX;
 
-        case VK_RIGHT:
-            OnRight();
-            break;
+    ::InterlockedIncrement64(&s_aLatency[nEvent][LatencyToBucket(ms)]);
 
-        case VK_UP:
-            iItem = GetNextSelectable(m_iSelected, FALSE);
-            SetCurSel(hwnd, iItem);
+    LONG msMax;
+    do
+    {
+        msMax = s_amsLatencyMax[nEvent];
+        if ((LONG)ms <= msMax)
             break;
+    } while (::InterlockedCompareExchange(&s_amsLatencyMax[nEvent], (LONG)ms, msMax) != msMax);
+}
 
-        case VK_DOWN:
-            iItem = GetNextSelectable(m_iSelected, TRUE);
-            SetCurSel(hwnd, iItem);
-            break;
+static BOOL GetLatency(INT nEvent, FAKEMENU_LATENCY* pLatency)
+{
+    if (nEvent < 0 || FAKEMENU_EVENT_MAX <= nEvent)
+        return FALSE;
+
+    LONG64 aCounts[FAKEMENU_LATENCY_BUCKETS];
+    LONG64 cSamples = 0;
+    for (INT iBucket = 0; iBucket < FAKEMENU_LATENCY_BUCKETS; ++iBucket)
+    {
+        aCounts[iBucket] = s_aLatency[nEvent][iBucket];
+        cSamples += aCounts[iBucket];
+    }
+
+    FAKEMENU_LATENCY latency = { sizeof(latency) };
+    latency.cSamples = cSamples;
+    latency.msMax = s_amsLatencyMax[nEvent];
+
+    // The percentiles
+    const INT anPermille[] = { 500, 900, 990 };
+    DWORD* apdw[] = { &latency.msP50, &latency.msP90, &latency.msP99 };
+    for (INT i = 0; i < (INT)_countof(anPermille) && cSamples; ++i)
+    {
+        LONG64 cTarget = (cSamples * anPermille[i] + 999) / 1000;
+        LONG64 cSum = 0;
+        for (INT iBucket = 0; iBucket < FAKEMENU_LATENCY_BUCKETS; ++iBucket)
+        {
+            cSum += aCounts[iBucket];
+            if (cSum >= cTarget)
+            {
+                *apdw[i] = min(BucketToLatency(iBucket), latency.msMax);
+                break;
+            }
+        }
     }
+
+    DWORD cbSize = min(pLatency->cbSize, (DWORD)sizeof(latency));
+    CopyMemory(pLatency, &latency, cbSize);
+    pLatency->cbSize = cbSize;
+    return TRUE;
 }
 
-LRESULT CALLBACK FakeMenu::WindowProcDx(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+#endif  // def FAKEMENU_ENABLE_STATS
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Memory
+//
+// The trees that are not shown can release the windows and the indexes built on demand.
+// ShowPopup creates the windows again and the indexes are rebuilt when they are dirty.
+
+VOID FakeMenu::AddMemoryUsage(FAKEMENU_MEMORY* pMemory)
 {
-    switch (uMsg)
+    SIZE_T cb = sizeof(*this);
+    cb += m_cPositionsMax * sizeof(FAKEMENU_POSITION);
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
     {
-        HANDLE_MSG(hwnd, WM_CREATE, OnCreate);
-        HANDLE_MSG(hwnd, WM_SHOWWINDOW, OnShowWindow);
-        HANDLE_MSG(hwnd, WM_DESTROY, OnDestroy);
-        HANDLE_MSG(hwnd, WM_MOUSEMOVE, OnMouseMove);
-        HANDLE_MSG(hwnd, WM_LBUTTONDOWN, OnLButtonDown);
-        HANDLE_MSG(hwnd, WM_LBUTTONUP, OnLButtonUp);
-        HANDLE_MSG(hwnd, WM_RBUTTONDOWN, OnRButtonDown);
-        HANDLE_MSG(hwnd, WM_RBUTTONUP, OnRButtonUp);
-        HANDLE_MSG(hwnd, WM_SYSKEYDOWN, OnKey);
-        HANDLE_MSG(hwnd, WM_KEYDOWN, OnKey);
-        HANDLE_MSG(hwnd, WM_CHAR, OnChar);
-        HANDLE_MSG(hwnd, WM_SYSCHAR, OnSysChar);
-        HANDLE_MSG(hwnd, WM_PAINT, OnPaint);
-        HANDLE_MSG(hwnd, WM_TIMER, OnTimer);
-        HANDLE_MSG(hwnd, WM_HOTKEY, OnHotKey);
+        auto pItem = m_pPositions[iItem].pItem;
+        cb += sizeof(*pItem);
+        if (pItem->m_pszText)
+            cb += (lstrlenW(pItem->m_pszText) + 1) * sizeof(WCHAR);
+        if (pItem->m_pszDisplay)
+            cb += (lstrlenW(pItem->m_pszDisplay) + 1) * sizeof(WCHAR);
 
-        case WM_MOUSEACTIVATE:
-            return MA_NOACTIVATE; // Don't activate the window!
+        if (pItem->m_pSubMenu)
+            pItem->m_pSubMenu->AddMemoryUsage(pMemory);
+    }
 
-        case WM_THEMECHANGED:
-        case WM_SETTINGCHANGE:
-            UpdateVisuals(hwnd);
-            break;
+    // The indexes have m_cItems entries
+    if (m_pAccess)
+        cb += m_cItems * sizeof(FAKEMENU_ACCESS);
+    if (m_pPrefix)
+    {
+        cb += m_cItems * sizeof(FAKEMENU_PREFIX);
+        for (INT i = 0; i < m_cPrefix; ++i)
+            cb += (lstrlenW(m_pPrefix[i].pszText) + 1) * sizeof(WCHAR);
+    }
+    if (m_piPrefixRank)
+        cb += m_cItems * sizeof(INT);
 
-        default:
-            return ::DefWindowProc(hwnd, uMsg, wParam, lParam);
+    cb += m_cSearchIndexMax * sizeof(FAKEMENU_SEARCH_ENTRY);
+    if (m_piSearchMatches)
+        cb += m_cSearchIndex * sizeof(INT);
+    for (INT i = 0; i < m_cSearchIndex; ++i)
+    {
+        cb += (lstrlenW(m_pSearchIndex[i].pszPath) + 1) * sizeof(WCHAR);
+        cb += (lstrlenW(m_pSearchIndex[i].pszFolded) + 1) * sizeof(WCHAR);
     }
-    return 0;
+
+    cb += m_cRecordMax * sizeof(FAKEMENU_RECORD_EVENT);
+    if (m_pszRecordFile)
+        cb += (lstrlenW(m_pszRecordFile) + 1) * sizeof(WCHAR);
+
+    ++pMemory->cMenus;
+    if (m_fOwnFont)
+        ++pMemory->cGdiObjects;
+    if (m_hwnd)
+        ++pMemory->cUserObjects;
+#ifndef __REACTOS__
+    if (m_hTheme)
+        ++pMemory->cThemes;
+#endif
+
+    if (m_pRows)
+    {
+        cb += FAKEMENU_OWNERDATA_CACHE * sizeof(FAKEMENU_OWNERDATA_ROW);
+        for (INT i = 0; i < FAKEMENU_OWNERDATA_CACHE; ++i)
+        {
+            if (m_pRows[i].pItem)
+                cb += sizeof(FakeMenuItem);
+            cb += 2 * m_pRows[i].cchMax * sizeof(WCHAR);
+        }
+    }
+    pMemory->cbHeap += cb;
+
+    if (m_pSearch)
+        m_pSearch->AddMemoryUsage(pMemory);
+    if (m_pDataSub)
+        m_pDataSub->AddMemoryUsage(pMemory);
 }
 
-/*static*/ LRESULT CALLBACK
-FakeMenu::WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+BOOL FakeMenu::GetMemoryUsage(FAKEMENU_MEMORY* pMemory)
 {
-    auto pThis = (FakeMenu*)GetWindowLongPtr(hwnd, GWLP_USERDATA);
-    if (uMsg == WM_CREATE)
+    if (!pMemory || pMemory->cbSize < sizeof(FAKEMENU_MEMORY))
+        return FALSE;
+
+    DWORD cbSize = pMemory->cbSize;
+    ZeroMemory(pMemory, sizeof(FAKEMENU_MEMORY));
+    pMemory->cbSize = cbSize;
+
+    AddMemoryUsage(pMemory);
+    return TRUE;
+}
+
+VOID FakeMenu::TrimTree(INT nLevel)
+{
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
     {
-        auto pCS = (CREATESTRUCT*)lParam;
-        pThis = (FakeMenu*)pCS->lpCreateParams;
-        SetWindowLongPtr(hwnd, GWLP_USERDATA, (LONG_PTR)pThis);
-        pThis->m_hwnd = hwnd;
+        auto pSubMenu = GetSubMenu(iItem);
+        if (pSubMenu)
+            pSubMenu->TrimTree(nLevel);
     }
-    else
+    if (m_pDataSub)
+        m_pDataSub->TrimTree(nLevel);
+
+    // The indexes built on demand
+    free(m_pAccess);
+    m_pAccess = NULL;
+    m_cAccess = 0;
+    free(m_pPrefix);
+    free(m_piPrefixRank);
+    m_pPrefix = NULL;
+    m_piPrefixRank = NULL;
+    m_cPrefix = 0;
+    m_fAccessDirty = m_fPrefixDirty = TRUE;
+    FreeSearchIndex();
+    m_cchQuery = 0;
+    m_szQuery[0] = 0;
+    FreeRows();
+
+    if (s_session.pRecording != this)
+    {
+        free(m_pRecord);
+        m_pRecord = NULL;
+        m_cRecord = m_cRecordMax = 0;
+    }
+
+    // Shrink the position index
+    if (m_cPositionsMax > m_cItems && m_cItems > 0)
+    {
+        auto pNew = (FAKEMENU_POSITION*)ReallocMemory(m_pPositions, m_cItems * sizeof(FAKEMENU_POSITION));
+        if (pNew)
+        {
+            m_pPositions = pNew;
+            m_cPositionsMax = m_cItems;
+        }
+    }
+
+    if (nLevel < FAKEMENU_TRIM_WINDOWS)
+        return;
+
+    // The search results are built again on the next search
+    if (m_pSearch)
     {
-        if (pThis == NULL)
-            return ::DefWindowProc(hwnd, uMsg, wParam, lParam);
+        m_pSearch->TrimTree(nLevel);
+        delete m_pSearch;
+        m_pSearch = NULL;
     }
-    LRESULT ret = pThis->WindowProcDx(hwnd, uMsg, wParam, lParam);
-    if (uMsg == WM_NCDESTROY)
+
+    // The sub-menu of the rows is made again by the next fetch
+    delete m_pDataSub;
+    m_pDataSub = NULL;
+
+    // OnDestroy closes the theme
+    if (m_hwnd)
     {
-        pThis->m_hwnd = NULL;
+        m_fTrimming = TRUE;
+        ::DestroyWindow(m_hwnd);
+        m_fTrimming = FALSE;
     }
-    return ret;
 }
 
-void FakeMenu::ChooseLocation(POINT& pt, INT cx, INT cy, LPCRECT prcExclude)
+BOOL FakeMenu::Trim(INT nLevel)
 {
-    HMONITOR hMon = MonitorFromPoint(pt, MONITOR_DEFAULTTONEAREST);
-    MONITORINFO mi = { sizeof(mi) };
-    GetMonitorInfo(hMon, &mi);
-    INT x = pt.x, y = pt.y;
+    if (m_pParent) // Not root?
+        return FALSE;
 
-    if (prcExclude)
-    {
-        if (mi.rcMonitor.right < prcExclude->right + cx)
-            x = prcExclude->left - cx;
-        else
-            x = prcExclude->right;
+    if (nLevel < FAKEMENU_TRIM_CACHES || nLevel > FAKEMENU_TRIM_WINDOWS)
+        return FALSE;
 
-        if (mi.rcMonitor.bottom < prcExclude->top + cy)
-            y = prcExclude->bottom - cy;
-        else
-            y = prcExclude->top;
+    // Shown?
+    if (m_fAsync || m_fDestroying || s_session.pTrackingRoot == this || IsTreeAnimating())
+        return FALSE;
+    if (m_hwnd && ::IsWindowVisible(m_hwnd))
+        return FALSE;
 
-        if (x < mi.rcMonitor.left)
-            x = mi.rcMonitor.left;
+    TrimTree(nLevel);
 
-        if (y < mi.rcMonitor.top)
-            y = mi.rcMonitor.top;
-    }
-    else
-    {
-        if (mi.rcWork.right < x + cx)
-            x -= cx;
+    // The mask of the thread is created again when a check mark is drawn
+    if (nLevel >= FAKEMENU_TRIM_WINDOWS && !s_session.pTrackingRoot)
+        FreeMaskDC();
 
-        if (mi.rcWork.bottom < y + cy)
-            y -= cy;
+    return TRUE;
+}
 
-        if (x < mi.rcWork.left)
-            x = mi.rcWork.left;
+// This can be called from any thread with FALSE. The timer of the owner thread stops by itself
+VOID FakeMenu::SetIdle(BOOL bIdle)
+{
+    if (!bIdle && !m_fIdle) // Not in the list? (e.g. sub-menus)
+        return;
 
-        if (y < mi.rcWork.top)
-            y = mi.rcWork.top;
+    ::EnterCriticalSection(&s_csLiveRoots);
+    while (m_fIdleTrimming) // Another thread is trimming it? Wait for it out of the lock
+    {
+        ::LeaveCriticalSection(&s_csLiveRoots);
+        ::Sleep(1);
+        ::EnterCriticalSection(&s_csLiveRoots);
     }
 
-    pt.x = x;
-    pt.y = y;
-}
-
-BOOL FakeMenu::AddString(UINT nID, LPCWSTR text, UINT fState/* = MFS_ENABLED*/)
-{
-    MENUITEMINFO mii = { sizeof(mii), MIIM_ID | MIIM_STATE | MIIM_TYPE | MIIM_DATA };
-    if (text && text[0])
+    for (FakeMenu** ppRoot = &s_pIdleRoots; *ppRoot; ppRoot = &(*ppRoot)->m_pNextIdle)
     {
-        mii.fType = MFT_STRING;
-        mii.dwTypeData = const_cast<LPWSTR>(text);
+        if (*ppRoot == this)
+        {
+            *ppRoot = m_pNextIdle;
+            break;
+        }
     }
-    else
+    m_pNextIdle = NULL;
+
+    if (bIdle)
     {
-        mii.fType = MFT_SEPARATOR;
+        m_pNextIdle = s_pIdleRoots;
+        s_pIdleRoots = this;
     }
-    mii.fState = fState;
-    mii.wID = nID;
-    return AppendItem(&mii);
+    m_fIdle = bIdle;
+    ::LeaveCriticalSection(&s_csLiveRoots);
+
+    if (bIdle && !s_session.idTrimTimer)
+        s_session.idTrimTimer = ::SetTimer(NULL, 0, FAKEMENU_TRIM_INTERVAL, OnTrimTimer);
 }
 
-void FakeMenu::DeleteItems()
+// Trim the idle roots of the thread. bAll ignores the idle time
+/*static*/ VOID FakeMenu::TrimIdleRoots(BOOL bAll)
 {
-    if (m_pItems && m_cItems)
+    DWORD dwNow = ::GetTickCount(), dwThreadId = ::GetCurrentThreadId();
+    BOOL bMore = FALSE;
+
+    // Detach the roots of the thread to be trimmed. They are trimmed out of the lock, for
+    // DestroyWindow sends messages. SetIdle(FALSE) of another thread waits for them
+    FakeMenu* pTrimming = NULL;
+    ::EnterCriticalSection(&s_csLiveRoots);
+    FakeMenu** ppRoot = &s_pIdleRoots;
+    while (*ppRoot)
     {
-        auto pItem = m_pItems;
-        for (INT iItem = 0; iItem < m_cItems; ++iItem)
+        auto pRoot = *ppRoot;
+        if (pRoot->m_dwThreadId != dwThreadId) // Not ours?
         {
-            auto pNext = pItem->m_pNext;
-            delete pItem->m_pSubMenu;
-            delete pItem;
-            pItem = pNext;
+            ppRoot = &pRoot->m_pNextIdle;
+            continue;
         }
+
+        if (bAll || dwNow - pRoot->m_dwLastUsed >= s_dwAutoTrimIdle)
+        {
+            *ppRoot = pRoot->m_pNextIdle;
+            pRoot->m_pNextIdle = pTrimming;
+            pRoot->m_fIdleTrimming = TRUE;
+            pTrimming = pRoot;
+            continue;
+        }
+        ppRoot = &pRoot->m_pNextIdle;
+        bMore = TRUE;
     }
+    ::LeaveCriticalSection(&s_csLiveRoots);
 
-    m_pItems = NULL;
-    m_cItems = 0;
+    while (pTrimming)
+    {
+        auto pRoot = pTrimming;
+        pTrimming = pRoot->m_pNextIdle;
+        BOOL bTrimmed = pRoot->Trim(s_nAutoTrimLevel);
+
+        ::EnterCriticalSection(&s_csLiveRoots);
+        if (bTrimmed)
+        {
+            pRoot->m_pNextIdle = NULL;
+            pRoot->m_fIdle = FALSE;
+        }
+        else // Still idle. Try again later
+        {
+            pRoot->m_pNextIdle = s_pIdleRoots;
+            s_pIdleRoots = pRoot;
+            bMore = TRUE;
+        }
+        pRoot->m_fIdleTrimming = FALSE;
+        ::LeaveCriticalSection(&s_csLiveRoots);
+    }
+
+    if ((!bMore || !s_dwAutoTrimIdle) && s_session.idTrimTimer)
+    {
+        ::KillTimer(NULL, s_session.idTrimTimer);
+        s_session.idTrimTimer = 0;
+    }
 }
 
-void FakeMenu::MeasureItems(SIZE& size)
+/*static*/ VOID CALLBACK FakeMenu::OnTrimTimer(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
 {
-    size.cx = size.cy = 0;
+    BOOL bLowMemory = FALSE;
+    if (s_hLowMemory)
+        ::QueryMemoryResourceNotification(s_hLowMemory, &bLowMemory);
 
-    auto pItem = m_pItems;
-    for (INT iItem = 0; iItem < m_cItems; ++iItem)
-    {
-        // Measure the item
-        MEASUREITEMSTRUCT MeasureItem = { ODT_MENU };
-        MeasureItem.itemID = iItem;
-        MeasureItem.itemData = (DWORD_PTR)pItem;
-        MeasureItem.itemWidth = size.cx;
-        MeasureItem.itemHeight = GetSystemMetrics(SM_CYMENU);
-        DoMeasureItem(iItem, pItem, &MeasureItem);
+    TrimIdleRoots(bLowMemory);
+}
 
-        // Update the width
-        if (size.cx < (LONG)MeasureItem.itemWidth)
-            size.cx = (LONG)MeasureItem.itemWidth;
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Owner data
+//
+// The host gives the # of rows and the callback. The rows are fetched when they are drawn,
+// hit or navigated, and only FAKEMENU_OWNERDATA_CACHE of them are kept. The rows have one
+// height, so the layout is computed without them. The sub-menus of the rows share m_pDataSub.
+
+// Fetch the rows from the callback instead of the items. NULL to go back to the items
+BOOL FakeMenu::SetOwnerData(INT cItems, FAKEMENUDATAPROC pfnData, LPARAM lParam, LPVOID pContext)
+{
+    if (cItems < 0 || FAKEMENU_OWNERDATA_MAX < cItems || (!pfnData && cItems))
+        return FALSE;
 
-        // Set the rectangle
-        pItem->m_rcItem.left = 0;
-        pItem->m_rcItem.right = size.cx;
-        pItem->m_rcItem.top = size.cy;
-        pItem->m_rcItem.bottom = size.cy + MeasureItem.itemHeight;
-        pItem->m_cxyItem = MeasureItem.itemHeight;
+    BOOL bShown = (m_hwnd && ::IsWindowVisible(m_hwnd));
+    if (m_pDataSub) // The row of it may be gone
+        m_pDataSub->HideTree(0);
 
-        // Update height of the contents
-        size.cy += MeasureItem.itemHeight;
+    if (pfnData && !m_pParent)
+        Record(NULL); // The rows are not recorded
 
-        pItem = pItem->m_pNext;
-    }
+    DeleteItems();
+    if (pfnData)
+        ClearRows();
+    else
+        FreeRows();
 
-    // Update the right of the item rectangles
-    pItem = m_pItems;
-    for (INT iItem = 0; iItem < m_cItems; ++iItem)
-    {
-        pItem->m_rcItem.right = size.cx;
+    m_cOwnerData = cItems;
+    m_pfnData = pfnData;
+    m_pDataContext = pContext;
+    m_lParamData = lParam;
+    m_fLayoutDirty = TRUE;
 
-        pItem = pItem->m_pNext;
+    if (bShown) // Update the rows in the window of the current size
+    {
+        SIZE size;
+        MeasureItems(size);
+        m_cyContent = size.cy;
+        if (m_iSelected >= GetCount())
+            SetCurSel(m_hwnd, -1);
+        ScrollTo(m_yScroll);
+        ::InvalidateRect(m_hwnd, NULL, TRUE);
     }
+
+    return TRUE;
 }
 
-VOID FakeMenu::HideTree(INT idResult)
+// Fetch the rows again when they are needed
+VOID FakeMenu::InvalidateOwnerData(INT iFirst, INT iLast)
 {
-    m_idResult = idResult; // Set the result ID
+    if (!m_pfnData)
+        return;
 
-    // Hide the self
-    ::ShowWindow(m_hwnd, SW_HIDE);
+    if (iFirst < 0)
+        iFirst = 0;
+    if (iLast < 0 || m_cOwnerData <= iLast)
+        iLast = m_cOwnerData - 1;
+    if (iFirst > iLast)
+        return;
 
-    // Hide the sub-menu
-    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    if (m_pRows)
     {
-        auto pSubMenu = GetSubMenu(iItem);
-        if (pSubMenu)
+        for (INT i = 0; i < FAKEMENU_OWNERDATA_CACHE; ++i)
         {
-            pSubMenu->HideTree(idResult);
+            if (iFirst <= m_pRows[i].iItem && m_pRows[i].iItem <= iLast)
+                m_pRows[i].iItem = -1;
         }
     }
 
-    // Update s_pActiveMenu if necessary
-    if (s_pActiveMenu == this)
+    if (m_hwnd)
     {
-        SetActiveMenu(m_pParent);
+        RECT rc = { 0, iFirst * m_cyRow, m_sizeLayout.cx, (iLast + 1) * m_cyRow };
+        ::OffsetRect(&rc, 0, -m_yScroll); // To the client coordinates
+        ::InvalidateRect(m_hwnd, &rc, TRUE);
     }
 }
 
-VOID FakeMenu::HideTreeDelay(INT idResult, HWND hwndDelay)
+// The row at the position, from the cache or the callback
+FakeMenuItem* FakeMenu::FetchRow(INT iItem)
 {
-    m_idResult = idResult;
-    m_fDelayed = TRUE;
+    if (iItem < 0 || m_cOwnerData <= iItem)
+        return NULL;
 
-    // Hide the sub-menus with delay
-    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    if (!m_pRows)
     {
-        auto pSubMenu = GetSubMenu(iItem);
-        if (pSubMenu)
-        {
-            pSubMenu->HideTreeDelay(idResult, hwndDelay);
-        }
+        m_pRows = (FAKEMENU_OWNERDATA_ROW*)AllocMemory(FAKEMENU_OWNERDATA_CACHE * sizeof(FAKEMENU_OWNERDATA_ROW));
+        if (!m_pRows)
+            return NULL;
+        ZeroMemory(m_pRows, FAKEMENU_OWNERDATA_CACHE * sizeof(FAKEMENU_OWNERDATA_ROW));
+        ClearRows();
     }
 
-    if (m_hwnd == hwndDelay) // The self is to be animated?
-    {
-        ::KillTimer(m_hwnd, FAKEMENU_REFRESH_TIMER);
-        ::SetTimer(m_hwnd, FAKEMENU_ANIMATION_TIMER, FAKEMENU_ANIMATION_DELAY, NULL);
-    }
-    else
+    auto pRow = &m_pRows[iItem % FAKEMENU_OWNERDATA_CACHE];
+    if (pRow->iItem == iItem) // Cached?
+        return pRow->pItem;
+
+    WCHAR szText[FAKEMENU_OWNERDATA_TEXT];
+    szText[0] = 0;
+
+    FAKEMENU_OWNERDATA_ITEM data;
+    ZeroMemory(&data, sizeof(data));
+    data.iItem = iItem;
+    data.lParamMenu = m_lParamData;
+    data.fType = MFT_STRING;
+    data.fState = MFS_ENABLED;
+    data.pszText = szText;
+    data.cchTextMax = _countof(szText);
+    if (!m_pfnData(reinterpret_cast<HFAKEMENU>(this), &data, m_pDataContext))
     {
-        ::ShowWindow(m_hwnd, SW_HIDE); // Hide immediately
+        // An empty grayed row
+        data.nID = 0;
+        data.fType = MFT_STRING;
+        data.fState = MFS_GRAYED;
+        data.cSubItems = 0;
+        szText[0] = 0;
     }
-}
+    szText[_countof(szText) - 1] = 0;
 
-// Helper structure for FakeMenu::EnumCloseProc
-struct PRE_POPUP
-{
-    FakeMenu* pThis;
-    BOOL bFound;
-};
+    MENUITEMINFO mii = { sizeof(mii), MIIM_TYPE | MIIM_ID | MIIM_STATE };
+    mii.fType = data.fType;
+    mii.fState = data.fState;
+    mii.wID = data.nID;
+    mii.dwTypeData = szText;
 
-/*static*/ BOOL CALLBACK FakeMenu::EnumCloseProc(HWND hwnd, LPARAM lParam)
-{
-    auto pPrePopup = (PRE_POPUP*)lParam;
+    // The slot keeps the item and the texts. They grow only for a longer text
+    INT cchText = lstrlenW(szText) + 1;
+    if (pRow->cchMax < cchText)
+    {
+        pRow->iItem = -1; // The item may point to the old texts until refilled
+        INT cchMax = (cchText + 31) & ~31;
+        auto pszText = (LPWSTR)ReallocMemory(pRow->pszText, cchMax * sizeof(WCHAR));
+        if (pszText)
+            pRow->pszText = pszText;
+        auto pszDisplay = (LPWSTR)ReallocMemory(pRow->pszDisplay, cchMax * sizeof(WCHAR));
+        if (pszDisplay)
+            pRow->pszDisplay = pszDisplay;
+        if (!pszText || !pszDisplay)
+            return NULL;
+        pRow->cchMax = cchMax;
+    }
+    if (!pRow->pItem)
+    {
+        MENUITEMINFO miiSep = { sizeof(miiSep), MIIM_TYPE };
+        miiSep.fType = MFT_SEPARATOR;
+        pRow->pItem = new FakeMenuItem(&miiSep);
+    }
 
-    // Get the class name of hwnd
-    WCHAR szClass[64];
-    if (!::GetClassNameW(hwnd, szClass, _countof(szClass)))
-        return TRUE;
+    auto pItem = pRow->pItem;
+    pItem->SetRow(&mii, pRow->pszText, pRow->pszDisplay);
+    pRow->iItem = iItem;
+    pRow->cSubItems = (pItem->IsSep() ? 0 : max(data.cSubItems, 0));
+    pRow->lParam = data.lParam;
 
-    if (lstrcmpiW(szClass, L"#32768") == 0 && ::IsWindowVisible(hwnd)) // standard visible menu
+    if (pRow->cSubItems > 0) // Has a sub-menu?
     {
-        ::SendMessageW(hwnd, WM_CLOSE, 0, 0);
-        pPrePopup->bFound = TRUE;
-        return TRUE;
+        if (!m_pDataSub)
+        {
+            m_pDataSub = new FakeMenu();
+            m_pDataSub->m_pParent = this;
+            m_pDataSub->ShareFont(m_hFont);
+        }
+        pItem->m_pSubMenu = m_pDataSub;
     }
 
-    if (lstrcmpiW(szClass, FAKEMENU_CLASSNAME) == 0)
-    {
-        if (pPrePopup->pThis->IsFamilyHWND(hwnd))
-            return TRUE; // Our family
+    // The layout is uniform
+    pItem->m_cxyItem = m_cyRow;
+    ::SetRect(&pItem->m_rcItem, 0, iItem * m_cyRow, m_sizeLayout.cx, (iItem + 1) * m_cyRow);
 
-        ::SendMessageW(hwnd, WM_CLOSE, 0, 0); // Close it
-        pPrePopup->bFound = TRUE;
+    if (pItem->m_iUnderline >= 0) // Get the underline position
+    {
+        MEASUREITEMSTRUCT MeasureItem = { ODT_MENU };
+        DoMeasureItem(iItem, pItem, &MeasureItem);
     }
 
-    return TRUE;
+    return pItem;
 }
 
-/*static*/ BOOL CALLBACK FakeMenu::EnumFindStdMenuProc(HWND hwnd, LPARAM lParam)
+// Forget the cached rows. The items and the texts are refilled by the next fetches
+VOID FakeMenu::ClearRows()
 {
-    auto pbFound = (BOOL*)lParam;
+    if (!m_pRows)
+        return;
 
-    // Get the class name of hwnd
-    WCHAR szClass[64];
-    if (!::GetClassNameW(hwnd, szClass, _countof(szClass)))
-        return TRUE;
+    for (INT i = 0; i < FAKEMENU_OWNERDATA_CACHE; ++i)
+        m_pRows[i].iItem = -1;
+}
+
+VOID FakeMenu::FreeRows()
+{
+    if (!m_pRows)
+        return;
 
-    if (lstrcmpiW(szClass, L"#32768") == 0) // standard menu
+    for (INT i = 0; i < FAKEMENU_OWNERDATA_CACHE; ++i)
     {
-        if (::IsWindowVisible(hwnd))
+        auto pRow = &m_pRows[i];
+        if (pRow->pItem) // The texts are of the slot
         {
-            *pbFound = TRUE; // We found a standard visible menu
-            return FALSE;
+            pRow->pItem->m_pszText = pRow->pItem->m_pszDisplay = NULL;
+            delete pRow->pItem;
         }
+        free(pRow->pszText);
+        free(pRow->pszDisplay);
     }
-
-    return TRUE;
+    free(m_pRows);
+    m_pRows = NULL;
 }
 
-// Keep tracking or not?
-BOOL FakeMenu::IsAlive()
+// The height of a text item. The width of the rows that fill the cache; the later rows
+// are clipped if wider
+VOID FakeMenu::MeasureRows(SIZE& size)
 {
-    if (m_fDone || !s_pActiveMenu)
-        return FALSE;
-
-    if (::GetActiveWindow() != s_hwndOldActive)
-        return FALSE;
-
-    BOOL bFound = FALSE;
-    ::EnumWindows(EnumFindStdMenuProc, (LPARAM)&bFound);
-    if (bFound)
-        return FALSE;
+    FAKEMENU_TRACE_SCOPE_ARG("MeasureRows", m_cOwnerData);
+    FAKEMENU_STAT_TICKS(qwStart);
+
+    MENUITEMINFO mii = { sizeof(mii), MIIM_TYPE };
+    mii.fType = MFT_STRING;
+    mii.dwTypeData = const_cast<LPWSTR>(L"");
+    FakeMenuItem itemEmpty(&mii);
+
+    MEASUREITEMSTRUCT MeasureItem = { ODT_MENU };
+    MeasureItem.itemHeight = GetSystemMetrics(SM_CYMENU);
+    DoMeasureItem(-1, &itemEmpty, &MeasureItem);
+    m_cyRow = MeasureItem.itemHeight;
+
+    size.cx = (LONG)MeasureItem.itemWidth;
+    size.cy = m_cOwnerData * m_cyRow; // FAKEMENU_OWNERDATA_MAX keeps it in INT
+
+    // The rows are fetched with the new height
+    ClearRows();
+    INT cMeasured = min(m_cOwnerData, FAKEMENU_OWNERDATA_CACHE);
+    for (INT iItem = 0; iItem < cMeasured; ++iItem)
+    {
+        auto pItem = FetchRow(iItem);
+        if (!pItem)
+            break;
 
-    auto pRoot = GetRoot();
-    if (!pRoot)
-        return FALSE;
+        MeasureItem.itemWidth = 0;
+        MeasureItem.itemHeight = m_cyRow;
+        DoMeasureItem(iItem, pItem, &MeasureItem);
+        if (size.cx < (LONG)MeasureItem.itemWidth)
+            size.cx = (LONG)MeasureItem.itemWidth;
+    }
 
-    // Mouse action?
-    if (::GetKeyState(VK_LBUTTON) < 0 ||
-        ::GetKeyState(VK_MBUTTON) < 0 ||
-        ::GetKeyState(VK_RBUTTON) < 0)
+    // Update the right of the cached rows
+    for (INT i = 0; m_pRows && i < FAKEMENU_OWNERDATA_CACHE; ++i)
     {
-        DWORD dwPos = ::GetMessagePos();
-        POINT pt = { LOWORD(dwPos), HIWORD(dwPos) };
-        HWND hwndPt = ::WindowFromPoint(pt);
-        if (!IsFamilyHWND(hwndPt))
-            return FALSE; // Not our family
+        if (m_pRows[i].iItem >= 0)
+            m_pRows[i].pItem->m_rcItem.right = size.cx;
     }
 
-    if (pRoot->m_fDelayed || ::IsWindowVisible(pRoot->m_hwnd))
-        return TRUE;
+    FAKEMENU_STAT_ADD(this, FAKEMENU_STAT_ITEMS_MEASURED, cMeasured);
+    FAKEMENU_STAT_ADD_TIME(this, FAKEMENU_STAT_MEASURE_TIME, qwStart);
+}
 
-    return FALSE;
+// Fill the shared sub-menu with the rows under the row. They stay cached for the same row
+VOID FakeMenu::BindDataSub(INT iItem)
+{
+    auto pRow = &m_pRows[iItem % FAKEMENU_OWNERDATA_CACHE];
+    assert(pRow->iItem == iItem); // Fetched by GetSubMenu
+
+    m_pDataSub->m_iParentItem = iItem;
+    if (m_pDataSub->m_pfnData != m_pfnData || m_pDataSub->m_lParamData != pRow->lParam ||
+        m_pDataSub->m_cOwnerData != pRow->cSubItems)
+    {
+        m_pDataSub->SetOwnerData(pRow->cSubItems, m_pfnData, pRow->lParam, m_pDataContext);
+    }
 }
 
-void FakeMenu::DoMessageLoop(MSG& msg)
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Recording and replay
+//
+// The file is a sequence of DWORDs (and WCHARs of the texts):
+//   FAKEMENU_RECORD_MAGIC, FAKEMENU_RECORD_VERSION, x and y of the root, the tree,
+//   the # of events, then dwTime, iMenu, uMsg, wParam and lParam of each event.
+// The tree is the # of items, then nID, fType, fState, bSubMenu, cchText and the text of
+// each item, followed by the sub-menu if bSubMenu.
+// The mouse positions are in the client coordinates, so the same layout replays the same.
+// WM_MOUSEWHEEL is converted from and to the screen coordinates.
+// The hover timer is recorded as WM_TIMER of FAKEMENU_HOVER_TIMER, so that the sub-menus
+// opened by the hover are shown in the replay without the recorded timing.
+
+static VOID WriteBytes(FAKEMENU_BUFFER* pBuffer, LPCVOID pv, SIZE_T cb)
 {
-    for (;;)
+    if (pBuffer->bError)
+        return;
+
+    if (pBuffer->cb + cb > pBuffer->cbMax)
     {
-        while (!::PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE))
+        SIZE_T cbMax = max(pBuffer->cbMax * 2, pBuffer->cb + cb + 256);
+        auto pb = (LPBYTE)ReallocMemory(pBuffer->pb, cbMax);
+        if (!pb)
         {
-            if (!IsAlive())
-                return;
-            ::Sleep(80);
+            pBuffer->bError = TRUE;
+            return;
         }
+        pBuffer->pb = pb;
+        pBuffer->cbMax = cbMax;
+    }
 
-        if (!::GetMessage(&msg, NULL, 0, 0))
-            return;
+    CopyMemory(pBuffer->pb + pBuffer->cb, pv, cb);
+    pBuffer->cb += cb;
+}
 
-        switch (msg.message)
-        {
-        case WM_LBUTTONDBLCLK:
-        case WM_LBUTTONDOWN:
-        case WM_LBUTTONUP:
-        case WM_MBUTTONDBLCLK:
-        case WM_MBUTTONDOWN:
-        case WM_MBUTTONUP:
-        case WM_RBUTTONDBLCLK:
-        case WM_RBUTTONDOWN:
-        case WM_RBUTTONUP:
-        case WM_NCLBUTTONDBLCLK:
-        case WM_NCLBUTTONDOWN:
-        case WM_NCLBUTTONUP:
-        case WM_NCMBUTTONDBLCLK:
-        case WM_NCMBUTTONDOWN:
-        case WM_NCMBUTTONUP:
-        case WM_NCRBUTTONDBLCLK:
-        case WM_NCRBUTTONDOWN:
-        case WM_NCRBUTTONUP:
-            // Mouse action!
-            if (!IsFamilyHWND(msg.hwnd))
-            {
-                ::SendMessageW(m_hwnd, WM_CLOSE, 0, 0);
-                if (s_hwndOldActive == msg.hwnd)
-                {
-                    ::DispatchMessage(&msg);
-                }
-                continue;
-            }
-            break;
+static inline VOID WriteDword(FAKEMENU_BUFFER* pBuffer, DWORD dw)
+{
+    WriteBytes(pBuffer, &dw, sizeof(dw));
+}
 
-        case WM_KEYDOWN:
-        case WM_KEYUP:
-        case WM_CHAR:
-        case WM_DEADCHAR:
-        case WM_SYSKEYDOWN:
-        case WM_SYSKEYUP:
-        case WM_SYSCHAR:
-        case WM_SYSDEADCHAR:
-            // Keyboard action!
-            if (s_pActiveMenu)
-                msg.hwnd = s_pActiveMenu->m_hwnd;
-            else
-                msg.hwnd = m_hwnd;
-            break;
-        }
+static BOOL ReadBytes(FAKEMENU_READER* pReader, LPVOID pv, SIZE_T cb)
+{
+    if (pReader->bError || pReader->cb - pReader->ib < cb)
+    {
+        pReader->bError = TRUE;
+        return FALSE;
+    }
 
-        ::TranslateMessage(&msg);
-        ::DispatchMessage(&msg);
+    CopyMemory(pv, pReader->pb + pReader->ib, cb);
+    pReader->ib += cb;
+    return TRUE;
+}
 
-        if (!IsAlive())
-            return;
+static inline DWORD ReadDword(FAKEMENU_READER* pReader)
+{
+    DWORD dw = 0;
+    ReadBytes(pReader, &dw, sizeof(dw));
+    return dw;
+}
+
+// Number the menus in pre-order. Returns the next index
+INT FakeMenu::AssignTreeIndexes(INT iNext)
+{
+    m_iTreeIndex = iNext++;
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    {
+        auto pSubMenu = m_pPositions[iItem].pItem->m_pSubMenu;
+        if (pSubMenu)
+            iNext = pSubMenu->AssignTreeIndexes(iNext);
     }
+    return iNext;
 }
 
-INT FakeMenu::TrackPopup(POINT pt, BOOL fKeyboard, LPCRECT prcExclude)
+// Store the menus in pre-order. Returns the next index
+INT FakeMenu::CollectTree(FakeMenu** ppMenus, INT iNext)
 {
-    // Close the other menus if necessary
-    PRE_POPUP PrePopup = { this, FALSE };
-    ::EnumWindows(EnumCloseProc, (LPARAM)&PrePopup);
-    if (PrePopup.bFound)
-        ::Sleep(50);
+    ppMenus[iNext++] = this;
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    {
+        auto pSubMenu = m_pPositions[iItem].pItem->m_pSubMenu;
+        if (pSubMenu)
+            iNext = pSubMenu->CollectTree(ppMenus, iNext);
+    }
+    return iNext;
+}
 
-    // Save the active window and the foreground window To detect mouse actions
-    s_hwndOldActive = ::GetActiveWindow();
-    s_hwndOldForeground = ::GetForegroundWindow();
+VOID FakeMenu::RecordInput(UINT uMsg, WPARAM wParam, LPARAM lParam, DWORD dwTime)
+{
+    auto pRoot = s_session.pRecording;
+    if (GetRoot() != pRoot)
+        return;
 
-    InitStatus();
+    if (pRoot->m_cRecord >= pRoot->m_cRecordMax)
+    {
+        INT cMax = (pRoot->m_cRecordMax ? pRoot->m_cRecordMax * 2 : 256);
+        auto pNew = (FAKEMENU_RECORD_EVENT*)ReallocMemory(pRoot->m_pRecord, cMax * sizeof(FAKEMENU_RECORD_EVENT));
+        if (!pNew)
+            return;
+        pRoot->m_pRecord = pNew;
+        pRoot->m_cRecordMax = cMax;
+    }
 
-    m_fKeyboardUsing = fKeyboard;
+    auto pEvent = &pRoot->m_pRecord[pRoot->m_cRecord++];
+    pEvent->dwTime = dwTime - pRoot->m_dwRecordStart;
+    pEvent->iMenu = (IsSearchResults() ? FAKEMENU_RECORD_SEARCH : m_iTreeIndex);
+    pEvent->uMsg = uMsg;
+    pEvent->wParam = (DWORD)wParam;
+    pEvent->lParam = (DWORD)lParam;
 
-    DWORD style = WS_POPUP | WS_BORDER; // Popup with border
-    DWORD exstyle =
-        WS_EX_TOPMOST |         // Always show on top
-        WS_EX_NOACTIVATE |      // Always don't activate
-        WS_EX_TOOLWINDOW |      // Don't show the taskbar pane
-        WS_EX_DLGMODALFRAME |   // With dialog frame
-        WS_EX_WINDOWEDGE;       // With window edge
+    if (uMsg == WM_MOUSEWHEEL) // In the screen coordinates?
+    {
+        POINT pt = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+        ::ScreenToClient(m_hwnd, &pt);
+        pEvent->lParam = (DWORD)MAKELPARAM(pt.x, pt.y);
+    }
+}
 
-    /* Measure items */
-    SIZE size;
-    MeasureItems(size);
+VOID FakeMenu::WriteRecordedMenu(FAKEMENU_BUFFER* pBuffer)
+{
+    WriteDword(pBuffer, m_cItems);
+    for (INT iItem = 0; iItem < m_cItems; ++iItem)
+    {
+        auto pItem = m_pPositions[iItem].pItem;
+        INT cchText = (pItem->m_pszText ? lstrlenW(pItem->m_pszText) : 0);
+        WriteDword(pBuffer, pItem->m_nID);
+        WriteDword(pBuffer, pItem->m_fType);
+        WriteDword(pBuffer, pItem->m_fState);
+        WriteDword(pBuffer, (pItem->m_pSubMenu != NULL));
+        WriteDword(pBuffer, cchText);
+        WriteBytes(pBuffer, pItem->m_pszText, cchText * sizeof(WCHAR));
+
+        if (pItem->m_pSubMenu)
+            pItem->m_pSubMenu->WriteRecordedMenu(pBuffer);
+    }
+}
 
-    RECT rc = { 0, 0, size.cx, size.cy };
-    ::AdjustWindowRectEx(&rc, style, FALSE, exstyle);
+/*static*/ FakeMenu*
+FakeMenu::ReadRecordedMenu(FAKEMENU_READER* pReader, FakeMenu* pParent, INT iDepth)
+{
+    if (iDepth > FAKEMENU_RECORD_MAX_DEPTH)
+        return NULL;
 
-    size.cx = rc.right - rc.left;
-    size.cy = rc.bottom - rc.top;
-    ChooseLocation(pt, size.cx, size.cy, prcExclude);
+    // Each item takes 5 DWORDs at least
+    DWORD cItems = ReadDword(pReader);
+    if (pReader->bError || cItems > (pReader->cb - pReader->ib) / (5 * sizeof(DWORD)))
+        return NULL;
 
-    // Create or move?
-    if (!m_hwnd)
+    auto pMenu = new FakeMenu();
+    pMenu->m_pParent = pParent;
+    for (INT iItem = 0; iItem < (INT)cItems; ++iItem)
     {
-        HWND hwnd = ::CreateWindowExW(exstyle, FAKEMENU_CLASSNAME, FAKEMENU_CLASSNAME, style,
-                                      pt.x, pt.y, size.cx, size.cy,
-                                      NULL, NULL, GetModuleHandle(NULL), this);
-        assert(m_hwnd == hwnd);
+        MENUITEMINFOW mii = { sizeof(mii), MIIM_FTYPE | MIIM_ID | MIIM_STATE | MIIM_STRING };
+        mii.wID = ReadDword(pReader);
+        mii.fType = ReadDword(pReader);
+        mii.fState = ReadDword(pReader);
+        BOOL bSubMenu = ReadDword(pReader);
+        DWORD cchText = ReadDword(pReader);
+        if (pReader->bError || cchText > (pReader->cb - pReader->ib) / sizeof(WCHAR))
+            break;
+
+        auto pszText = (LPWSTR)AllocMemory((cchText + 1) * sizeof(WCHAR));
+        if (!pszText)
+            break;
+        ReadBytes(pReader, pszText, cchText * sizeof(WCHAR));
+        pszText[cchText] = 0;
+        mii.dwTypeData = pszText;
+        BOOL bAdded = pMenu->AppendItem(&mii);
+        free(pszText);
+        if (!bAdded)
+            break;
+
+        if (bSubMenu)
+        {
+            auto pSubMenu = ReadRecordedMenu(pReader, pMenu, iDepth + 1);
+            if (!pSubMenu)
+                break;
+            pSubMenu->m_iParentItem = iItem;
+            pMenu->m_pPositions[iItem].pItem->m_pSubMenu = pSubMenu;
+        }
     }
-    else
+
+    if (pMenu->m_cItems != (INT)cItems) // Failed?
     {
-        ::SetWindowPos(m_hwnd, HWND_TOPMOST, pt.x, pt.y, size.cx, size.cy,
-                       SWP_SHOWWINDOW | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
+        pReader->bError = TRUE;
+        delete pMenu;
+        return NULL;
     }
 
-    SetActiveMenu(this);
+    return pMenu;
+}
 
-    if (m_pParent) // Sub-menu?
+BOOL FakeMenu::SaveRecording()
+{
+    FAKEMENU_BUFFER buffer = { NULL };
+    WriteDword(&buffer, FAKEMENU_RECORD_MAGIC);
+    WriteDword(&buffer, FAKEMENU_RECORD_VERSION);
+    WriteDword(&buffer, m_ptAnimation.x);
+    WriteDword(&buffer, m_ptAnimation.y);
+    WriteRecordedMenu(&buffer);
+    WriteDword(&buffer, m_cRecord);
+    WriteBytes(&buffer, m_pRecord, m_cRecord * sizeof(FAKEMENU_RECORD_EVENT));
+
+    BOOL bOK = FALSE;
+    if (!buffer.bError)
     {
-        auto iOpenSubMenu = m_pParent->m_iOpenSubMenu;
-        if (iOpenSubMenu != -1)
+        HANDLE hFile = ::CreateFileW(m_pszRecordFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                                     FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE)
         {
-            auto pSubMenu = m_pParent->GetSubMenu(iOpenSubMenu);
-            if (pSubMenu && pSubMenu != this)
-                pSubMenu->HideTree(0); // Another sub-menu to be hidden
+            DWORD cbWritten;
+            bOK = ::WriteFile(hFile, buffer.pb, (DWORD)buffer.cb, &cbWritten, NULL) &&
+                  cbWritten == buffer.cb;
+            ::CloseHandle(hFile);
         }
-        m_pParent->m_iOpenSubMenu = m_iParentItem; // Update parent's m_iOpenSubMenu
     }
 
-    // Show the window but don't activate it!
-    ::ShowWindow(m_hwnd, SW_SHOWNOACTIVATE);
+    free(buffer.pb);
+    return bOK;
+}
 
-    if (m_fKeyboardUsing)
-        SetCurSel(m_hwnd, 0);
+BOOL FakeMenu::Record(LPCWSTR pszFileName)
+{
+    if (m_pParent) // Not root?
+        return FALSE;
+    if (m_pfnData && pszFileName) // The rows are not in the recorded tree
+        return FALSE;
 
-    if (!m_pParent) // Root?
+    LPWSTR pszCopy = NULL;
+    if (pszFileName)
     {
-        MSG msg;
-        DoMessageLoop(msg);
+        pszCopy = DupString(pszFileName);
+        if (!pszCopy)
+            return FALSE;
+    }
 
-        HideTree(m_idResult); // Done. Hide the tree
+    free(m_pszRecordFile);
+    m_pszRecordFile = pszCopy;
+    return TRUE;
+}
 
+// The posted input is dispatched without TranslateMessage, for WM_CHAR is recorded
+static VOID PumpReplay(VOID)
+{
+    MSG msg;
+    while (::PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE))
+    {
         if (msg.message == WM_QUIT)
         {
             ::PostQuitMessage((INT)msg.wParam);
+            break;
         }
+        ::DispatchMessageW(&msg);
     }
+}
 
-    return m_idResult;
+static VOID CALLBACK OnReplayDone(HFAKEMENU hFakeMenu, INT idResult, LPVOID pContext)
+{
+    auto pReplay = (FAKEMENU_REPLAY*)pContext;
+    pReplay->idResult = idResult;
+    pReplay->dwFlags |= FAKEMENU_REPLAY_DONE;
 }
 
-INT FakeMenu::GetNextIndex(INT iItem, BOOL bNext)
+/*static*/ BOOL FakeMenu::Replay(LPCWSTR pszFileName, FAKEMENU_REPLAY* pReplay)
 {
-    if (bNext)
+    if (!pReplay || pReplay->cbSize < sizeof(FAKEMENU_REPLAY))
+        return FALSE;
+
+    // Load the file
+    HANDLE hFile = ::CreateFileW(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    FAKEMENU_READER reader = { NULL };
+    DWORD cbFile = ::GetFileSize(hFile, NULL);
+    LPBYTE pbFile = (cbFile != INVALID_FILE_SIZE) ? (LPBYTE)AllocMemory(cbFile) : NULL;
+    DWORD cbRead = 0;
+    if (pbFile && ::ReadFile(hFile, pbFile, cbFile, &cbRead, NULL) && cbRead == cbFile)
     {
-        ++iItem;
-        if (iItem >= m_cItems)
-            iItem = 0;
+        reader.pb = pbFile;
+        reader.cb = cbFile;
     }
-    else
+    ::CloseHandle(hFile);
+
+    POINT pt;
+    FakeMenu* pRoot = NULL;
+    if (ReadDword(&reader) == FAKEMENU_RECORD_MAGIC &&
+        ReadDword(&reader) == FAKEMENU_RECORD_VERSION)
     {
-        --iItem;
-        if (iItem < 0)
-            iItem = m_cItems - 1;
+        pt.x = (LONG)ReadDword(&reader);
+        pt.y = (LONG)ReadDword(&reader);
+        pRoot = ReadRecordedMenu(&reader, NULL, 0);
     }
-    return iItem;
-}
 
-INT FakeMenu::GetNextSelectable(INT iItem, BOOL bNext)
-{
-    iItem = GetNextIndex(iItem, bNext);
+    DWORD cEvents = pRoot ? ReadDword(&reader) : 0;
+    if (!pRoot || reader.bError ||
+        cEvents > (reader.cb - reader.ib) / sizeof(FAKEMENU_RECORD_EVENT))
+    {
+        delete pRoot;
+        free(pbFile);
+        return FALSE;
+    }
 
-    for (INT iTry = 0; iTry < m_cItems; ++iTry)
+    // The menus by the tree index
+    INT cMenus = pRoot->AssignTreeIndexes(0);
+    auto ppMenus = (FakeMenu**)AllocMemory(cMenus * sizeof(FakeMenu*));
+    if (!ppMenus)
     {
-        auto pItem = GetItem(iItem);
-        if (pItem == NULL)
-            return -1;
+        delete pRoot;
+        free(pbFile);
+        return FALSE;
+    }
+    pRoot->CollectTree(ppMenus, 0);
+
+    pReplay->dwFlags &= FAKEMENU_REPLAY_REALTIME;
+    pReplay->idResult = 0;
+    pReplay->cEvents = (INT)cEvents;
+    pReplay->cReplayed = 0;
+    pReplay->cSkipped = 0;
+    pReplay->usTotal = 0;
+    ZeroMemory(&pReplay->stats, sizeof(pReplay->stats));
+#ifdef FAKEMENU_ENABLE_STATS
+    pRoot->ResetStats();
+#endif
+
+    LARGE_INTEGER liFreq, liStart, liNow;
+    ::QueryPerformanceFrequency(&liFreq);
+    ::QueryPerformanceCounter(&liStart);
+    DWORD dwStart = ::GetTickCount();
+
+    if (pRoot->TrackPopupAsync(pt, OnReplayDone, pReplay))
+    {
+        PumpReplay();
+
+        for (DWORD iEvent = 0; iEvent < cEvents && !(pReplay->dwFlags & FAKEMENU_REPLAY_DONE); ++iEvent)
+        {
+            // The events may be unaligned in the file
+            FAKEMENU_RECORD_EVENT event;
+            ReadBytes(&reader, &event, sizeof(event));
+
+            // Wait for the time of the event, keeping the menus working
+            while (pReplay->dwFlags & FAKEMENU_REPLAY_REALTIME)
+            {
+                DWORD dwElapsed = ::GetTickCount() - dwStart;
+                if (dwElapsed >= event.dwTime)
+                    break;
+                ::MsgWaitForMultipleObjects(0, NULL, FALSE, event.dwTime - dwElapsed, QS_ALLINPUT);
+                PumpReplay();
+            }
+
+            FakeMenu* pMenu = NULL;
+            if (event.iMenu == FAKEMENU_RECORD_SEARCH)
+                pMenu = pRoot->m_pSearch;
+            else if (0 <= event.iMenu && event.iMenu < cMenus)
+                pMenu = ppMenus[event.iMenu];
+            if (!pMenu || !pMenu->m_hwnd || !::IsWindowVisible(pMenu->m_hwnd))
+            {
+                ++pReplay->cSkipped; // The menu is not shown in this replay
+                continue;
+            }
+
+            // The posted moves do the hover without the real cursor
+            if (event.uMsg == WM_MOUSEWHEEL)
+            {
+                POINT ptScreen = { GET_X_LPARAM(event.lParam), GET_Y_LPARAM(event.lParam) };
+                ::ClientToScreen(pMenu->m_hwnd, &ptScreen);
+                event.lParam = (DWORD)MAKELPARAM(ptScreen.x, ptScreen.y);
+            }
+
+            LARGE_INTEGER liPosted;
+            ::QueryPerformanceCounter(&liPosted);
+            ::PostMessageW(pMenu->m_hwnd, event.uMsg, event.wParam, event.lParam);
+            PumpReplay(); // Until handled and painted
+            ::QueryPerformanceCounter(&liNow);
+
+            if (pReplay->pusLatency && pReplay->cReplayed < pReplay->cLatencyMax)
+            {
+                pReplay->pusLatency[pReplay->cReplayed] =
+                    (DWORD)((liNow.QuadPart - liPosted.QuadPart) * 1000000 / liFreq.QuadPart);
+            }
+            ++pReplay->cReplayed;
+        }
 
-        if (!pItem->IsSep())
-            return iItem;
+        // Not chosen by the recorded input?
+        if (!(pReplay->dwFlags & FAKEMENU_REPLAY_DONE))
+            pRoot->Cancel();
 
-        iItem = GetNextIndex(iItem, bNext);
+        while (!(pReplay->dwFlags & FAKEMENU_REPLAY_DONE))
+        {
+            ::MsgWaitForMultipleObjects(0, NULL, FALSE, FAKEMENU_ANIMATION_INTERVAL, QS_ALLINPUT);
+            PumpReplay();
+        }
     }
 
-    return -1;
-}
+    ::QueryPerformanceCounter(&liNow);
+    pReplay->usTotal = (liNow.QuadPart - liStart.QuadPart) * 1000000 / liFreq.QuadPart;
+    pReplay->dwFlags &= FAKEMENU_REPLAY_REALTIME;
 
-BOOL FakeMenu::IsFamilyHWND(HWND hwnd)
-{
-    auto pMenu = FakeMenu::FromHWND(hwnd);
-    if (!pMenu)
-        return FALSE;
-    return GetRoot() == pMenu->GetRoot(); // The root is same?
+#ifdef FAKEMENU_ENABLE_STATS
+    pReplay->stats.cbSize = sizeof(pReplay->stats);
+    pRoot->GetStats(&pReplay->stats);
+#endif
+
+    free(ppMenus);
+    free(pbFile);
+
+    pRoot->FinishAsync();
+    if (!pRoot->DestroyLater())
+    {
+        pRoot->DestroyTree(0);
+        delete pRoot;
+    }
+    return pReplay->cSkipped == 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -1943,11 +5550,78 @@ extern "C"
 
 BOOL APIENTRY FakeMenu_InitInstance(VOID)
 {
+    ::InitializeCriticalSection(&s_csLiveRoots);
+    s_uCheckMessage = ::RegisterWindowMessageW(FAKEMENU_CHECK_NAME);
     return FakeMenu::DoRegisterClass();
 }
 
 VOID APIENTRY FakeMenu_ExitInstance(VOID)
 {
+    FreeAllMaskDCs();
+    FakeMenu_EnableSharedRegistry(FALSE);
+    FakeMenu_SetAutoTrim(0, FAKEMENU_TRIM_WINDOWS);
+    ::DeleteCriticalSection(&s_csLiveRoots);
+}
+
+VOID APIENTRY FakeMenu_SetHoverDelay(INT nDelay)
+{
+    s_nHoverDelay = nDelay;
+}
+
+VOID APIENTRY FakeMenu_SetAutoTrim(DWORD dwIdleTime, INT nLevel)
+{
+    s_dwAutoTrimIdle = dwIdleTime;
+    s_nAutoTrimLevel = nLevel;
+
+    if (dwIdleTime && !s_hLowMemory)
+    {
+        s_hLowMemory = ::CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    }
+    else if (!dwIdleTime && s_hLowMemory)
+    {
+        ::CloseHandle(s_hLowMemory);
+        s_hLowMemory = NULL;
+    }
+}
+
+BOOL APIENTRY FakeMenu_EnableSharedRegistry(BOOL bEnable)
+{
+    if (!bEnable)
+    {
+        if (s_pSharedRegistry)
+        {
+            ::UnmapViewOfFile(s_pSharedRegistry);
+            s_pSharedRegistry = NULL;
+        }
+        if (s_hSharedRegistry)
+        {
+            ::CloseHandle(s_hSharedRegistry);
+            s_hSharedRegistry = NULL;
+        }
+        return TRUE;
+    }
+
+    if (s_pSharedRegistry)
+        return TRUE; // Already enabled
+
+    // The mapping is zero-filled when created
+    s_hSharedRegistry = ::CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                             sizeof(FAKEMENU_SHARED_REGISTRY),
+                                             FAKEMENU_SHARED_NAME);
+    if (!s_hSharedRegistry)
+        return FALSE;
+
+    s_pSharedRegistry = (FAKEMENU_SHARED_REGISTRY*)::MapViewOfFile(s_hSharedRegistry,
+                                                                   FILE_MAP_ALL_ACCESS, 0, 0,
+                                                                   sizeof(FAKEMENU_SHARED_REGISTRY));
+    if (!s_pSharedRegistry)
+    {
+        ::CloseHandle(s_hSharedRegistry);
+        s_hSharedRegistry = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
 }
 
 HFAKEMENU APIENTRY FakeMenu_Create(VOID)
@@ -1963,6 +5637,10 @@ HFAKEMENU APIENTRY FakeMenu_FromHMENU(HMENU hMenu)
 VOID APIENTRY FakeMenu_Destroy(HFAKEMENU hFakeMenu)
 {
     auto pFakeMenu = HandleToFakeMenu(hFakeMenu);
+    pFakeMenu->FinishAsync();
+    if (pFakeMenu->DestroyLater())
+        return; // It will be destroyed after the animation
+
     pFakeMenu->DestroyTree(0);
     delete pFakeMenu;
 }
@@ -1972,6 +5650,102 @@ VOID APIENTRY FakeMenu_SetLogFont(HFAKEMENU hFakeMenu, LPLOGFONT plf OPTIONAL)
     HandleToFakeMenu(hFakeMenu)->SetLogFont(plf);
 }
 
+BOOL APIENTRY FakeMenu_GetStats(HFAKEMENU hFakeMenu OPTIONAL, FAKEMENU_STATS* pStats)
+{
+#ifdef FAKEMENU_ENABLE_STATS
+    if (!pStats || pStats->cbSize < sizeof(DWORD))
+        return FALSE;
+
+    if (hFakeMenu)
+        return HandleToFakeMenu(hFakeMenu)->GetStats(pStats);
+
+    StatsToStruct(s_aStats, pStats);
+    return TRUE;
+#else
+    return FALSE; // Not built
+#endif
+}
+
+VOID APIENTRY FakeMenu_ResetStats(HFAKEMENU hFakeMenu OPTIONAL)
+{
+#ifdef FAKEMENU_ENABLE_STATS
+    if (hFakeMenu)
+    {
+        HandleToFakeMenu(hFakeMenu)->ResetStats();
+        return;
+    }
+
+    for (INT iStat = 0; iStat < FAKEMENU_STAT_MAX; ++iStat)
+        ::InterlockedExchange64(&s_aStats[iStat], 0);
+#endif
+}
+
+BOOL APIENTRY FakeMenu_GetLatency(INT nEvent, FAKEMENU_LATENCY* pLatency)
+{
+#ifdef FAKEMENU_ENABLE_STATS
+    if (!pLatency || pLatency->cbSize < sizeof(DWORD))
+        return FALSE;
+    return GetLatency(nEvent, pLatency);
+#else
+    return FALSE; // Not built
+#endif
+}
+
+VOID APIENTRY FakeMenu_ResetLatency(VOID)
+{
+#ifdef FAKEMENU_ENABLE_STATS
+    for (INT nEvent = 0; nEvent < FAKEMENU_EVENT_MAX; ++nEvent)
+    {
+        for (INT iBucket = 0; iBucket < FAKEMENU_LATENCY_BUCKETS; ++iBucket)
+            ::InterlockedExchange64(&s_aLatency[nEvent][iBucket], 0);
+        ::InterlockedExchange(&s_amsLatencyMax[nEvent], 0);
+    }
+#endif
+}
+
+INT APIENTRY FakeMenu_DumpLatency(LPWSTR pszText, INT cchText)
+{
+    if (!pszText || cchText <= 0)
+        return 0;
+
+    pszText[0] = 0;
+#ifdef FAKEMENU_ENABLE_STATS
+    static const LPCWSTR s_apszNames[FAKEMENU_EVENT_MAX] =
+    {
+        L"hover", L"key", L"submenu", L"select"
+    };
+
+    INT ich = 0;
+    for (INT nEvent = 0; nEvent < FAKEMENU_EVENT_MAX; ++nEvent)
+    {
+        FAKEMENU_LATENCY latency = { sizeof(latency) };
+        GetLatency(nEvent, &latency);
+
+        WCHAR szLine[128];
+        INT cch = wsprintfW(szLine, L"%s: n=%u p50=%lums p90=%lums p99=%lums max=%lums\r\n",
+                            s_apszNames[nEvent], (UINT)latency.cSamples,
+                            latency.msP50, latency.msP90, latency.msP99, latency.msMax);
+        if (ich + cch >= cchText)
+            break;
+        lstrcpyW(&pszText[ich], szLine);
+        ich += cch;
+    }
+    return ich;
+#else
+    return 0; // Not built
+#endif
+}
+
+BOOL APIENTRY FakeMenu_SetCurSel(HFAKEMENU hFakeMenu, INT iItem)
+{
+    return HandleToFakeMenu(hFakeMenu)->SelectItem(iItem);
+}
+
+VOID APIENTRY FakeMenu_EnsureVisible(HFAKEMENU hFakeMenu, INT iItem)
+{
+    HandleToFakeMenu(hFakeMenu)->EnsureVisible(iItem);
+}
+
 BOOL APIENTRY FakeMenu_GetItemText(HFAKEMENU hFakeMenu, INT iItem, LPWSTR pszText, INT cchText, BOOL bByPosition)
 {
     return HandleToFakeMenu(hFakeMenu)->GetItemText(iItem, pszText, cchText, bByPosition);
@@ -1992,6 +5766,16 @@ BOOL APIENTRY FakeMenu_CheckRadioItem(HFAKEMENU hFakeMenu, INT iFirst, INT iLast
     return HandleToFakeMenu(hFakeMenu)->CheckRadioItem(iFirst, iLast, iCheck, bByPosition);
 }
 
+VOID APIENTRY FakeMenu_EnableSearch(HFAKEMENU hFakeMenu, BOOL bEnable)
+{
+    HandleToFakeMenu(hFakeMenu)->EnableSearch(bEnable);
+}
+
+INT APIENTRY FakeMenu_SetItemStates(HFAKEMENU hFakeMenu, const FAKEMENU_STATE_CHANGE* pChanges, INT cChanges)
+{
+    return HandleToFakeMenu(hFakeMenu)->SetItemStates(pChanges, cChanges);
+}
+
 BOOL APIENTRY FakeMenu_AddString(HFAKEMENU hFakeMenu, UINT nID, LPCWSTR text, UINT fState)
 {
     return HandleToFakeMenu(hFakeMenu)->AddString(nID, text, fState);
@@ -2007,11 +5791,54 @@ VOID APIENTRY FakeMenu_DeleteItems(HFAKEMENU hFakeMenu)
     return HandleToFakeMenu(hFakeMenu)->DeleteItems();
 }
 
+BOOL APIENTRY
+FakeMenu_SetOwnerData(HFAKEMENU hFakeMenu, INT cItems, FAKEMENUDATAPROC pfnData OPTIONAL,
+                      LPARAM lParam, LPVOID pContext)
+{
+    return HandleToFakeMenu(hFakeMenu)->SetOwnerData(cItems, pfnData, lParam, pContext);
+}
+
+VOID APIENTRY FakeMenu_InvalidateOwnerData(HFAKEMENU hFakeMenu, INT iFirst, INT iLast)
+{
+    HandleToFakeMenu(hFakeMenu)->InvalidateOwnerData(iFirst, iLast);
+}
+
 INT APIENTRY FakeMenu_TrackPopup(HFAKEMENU hFakeMenu, POINT pt)
 {
     return HandleToFakeMenu(hFakeMenu)->TrackPopup(pt);
 }
 
+BOOL APIENTRY
+FakeMenu_TrackPopupAsync(HFAKEMENU hFakeMenu, POINT pt, FAKEMENUPROC pfnCallback, LPVOID pContext)
+{
+    return HandleToFakeMenu(hFakeMenu)->TrackPopupAsync(pt, pfnCallback, pContext);
+}
+
+VOID APIENTRY FakeMenu_Cancel(HFAKEMENU hFakeMenu)
+{
+    HandleToFakeMenu(hFakeMenu)->Cancel();
+}
+
+BOOL APIENTRY FakeMenu_GetMemoryUsage(HFAKEMENU hFakeMenu, FAKEMENU_MEMORY* pMemory)
+{
+    return HandleToFakeMenu(hFakeMenu)->GetMemoryUsage(pMemory);
+}
+
+BOOL APIENTRY FakeMenu_Trim(HFAKEMENU hFakeMenu, INT nLevel)
+{
+    return HandleToFakeMenu(hFakeMenu)->Trim(nLevel);
+}
+
+BOOL APIENTRY FakeMenu_Record(HFAKEMENU hFakeMenu, LPCWSTR pszFileName OPTIONAL)
+{
+    return HandleToFakeMenu(hFakeMenu)->Record(pszFileName);
+}
+
+BOOL APIENTRY FakeMenu_Replay(LPCWSTR pszFileName, FAKEMENU_REPLAY* pReplay)
+{
+    return FakeMenu::Replay(pszFileName, pReplay);
+}
+
 } // extern "C"
 
 //////////////////////////////////////////////////////////////////////////////////////////////
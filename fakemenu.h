@@ -25,25 +25,207 @@
 extern "C" {
 #endif
 
+/* The callback of FakeMenu_TrackPopupAsync. idResult is zero if cancelled.
+   It is called from the message loop of the host, not from a hook. */
+typedef VOID (CALLBACK *FAKEMENUPROC)(HFAKEMENU hFakeMenu, INT idResult, LPVOID pContext);
+
+/* For FakeMenu_GetStats. The times are in microseconds */
+typedef struct FAKEMENU_STATS
+{
+    DWORD cbSize;                   /* sizeof(FAKEMENU_STATS) */
+    ULONGLONG cItemsMeasured;
+    ULONGLONG usMeasureTime;
+    ULONGLONG cPaints;
+    ULONGLONG usPaintTime;
+    ULONGLONG cHitTests;
+    ULONGLONG cIsAlive;
+    ULONGLONG cLoopIterations;      /* The messages of the tracking loop */
+    ULONGLONG cWakeups;             /* The returns from the wait of the tracking loop */
+    ULONGLONG cIdleWakeups;         /* The wakeups without messages */
+    ULONGLONG cWindowsCreated;
+    ULONGLONG cGdiObjectsCreated;
+    ULONGLONG cTracks;
+    ULONGLONG usFirstPaintTime;     /* The total time from TrackPopup to the first paint */
+    ULONGLONG cAllocations;         /* The heap allocations. Process-wide only (zero for a tree) */
+} FAKEMENU_STATS;
+
+/* The input events of FakeMenu_GetLatency */
+#define FAKEMENU_EVENT_HOVER 0      /* The mouse moved the selection */
+#define FAKEMENU_EVENT_KEY 1        /* The keyboard moved the selection */
+#define FAKEMENU_EVENT_SUBMENU 2    /* A sub-menu was opened */
+#define FAKEMENU_EVENT_SELECT 3     /* An item was chosen */
+#define FAKEMENU_EVENT_MAX 4
+
+/* For FakeMenu_GetLatency. From the input message time to the paint, in milliseconds */
+typedef struct FAKEMENU_LATENCY
+{
+    DWORD cbSize;                   /* sizeof(FAKEMENU_LATENCY) */
+    ULONGLONG cSamples;
+    DWORD msP50;
+    DWORD msP90;
+    DWORD msP99;
+    DWORD msMax;
+} FAKEMENU_LATENCY;
+
+/* For FakeMenu_Replay */
+#define FAKEMENU_REPLAY_REALTIME 0x1    /* Keep the recorded timing (the hover delays work) */
+
+typedef struct FAKEMENU_REPLAY
+{
+    DWORD cbSize;                   /* sizeof(FAKEMENU_REPLAY) */
+    DWORD dwFlags;                  /* FAKEMENU_REPLAY_... */
+    DWORD* pusLatency;              /* OPTIONAL. Receives the latency of each event in microseconds */
+    INT cLatencyMax;                /* The number of pusLatency */
+    INT idResult;                   /* The chosen ID, or zero */
+    INT cEvents;                    /* The recorded events */
+    INT cReplayed;                  /* The events delivered to the menus */
+    INT cSkipped;                   /* The events of the menus not shown. FakeMenu_Replay fails if any */
+    ULONGLONG usTotal;              /* The time of the replay */
+    FAKEMENU_STATS stats;           /* The counters of the replayed tree, if built with them */
+} FAKEMENU_REPLAY;
+
+/* For FakeMenu_GetMemoryUsage */
+typedef struct FAKEMENU_MEMORY
+{
+    DWORD cbSize;                   /* sizeof(FAKEMENU_MEMORY) */
+    SIZE_T cbHeap;                  /* The heap bytes of the tree */
+    INT cMenus;                     /* The menus of the tree, including the search results */
+    INT cGdiObjects;                /* The fonts created for the tree */
+    INT cUserObjects;               /* The windows of the tree */
+    INT cThemes;                    /* The theme handles of the windows */
+} FAKEMENU_MEMORY;
+
+/* The levels of FakeMenu_Trim */
+#define FAKEMENU_TRIM_CACHES 1      /* The indexes built on demand */
+#define FAKEMENU_TRIM_WINDOWS 2     /* The caches, the windows and the themes */
+
+/* For FakeMenu_SetOwnerData. The callback fills the row at iItem */
+typedef struct FAKEMENU_OWNERDATA_ITEM
+{
+    INT iItem;                      /* The position (in) */
+    LPARAM lParamMenu;              /* The lParam of the menu (in) */
+    UINT nID;                       /* The item ID */
+    UINT fType;                     /* MFT_STRING (default) or MFT_SEPARATOR, with MFT_RADIOCHECK */
+    UINT fState;                    /* MFS_... (default MFS_ENABLED) */
+    LPWSTR pszText;                 /* Receives the label (in) */
+    INT cchTextMax;                 /* The size of pszText (in) */
+    INT cSubItems;                  /* The rows of the sub-menu, or zero */
+    LPARAM lParam;                  /* The lParamMenu of the sub-menu */
+} FAKEMENU_OWNERDATA_ITEM;
+
+/* The callback of FakeMenu_SetOwnerData. Return FALSE for an empty grayed row */
+typedef BOOL (CALLBACK *FAKEMENUDATAPROC)(HFAKEMENU hFakeMenu, FAKEMENU_OWNERDATA_ITEM* pItem, LPVOID pContext);
+
+#define FAKEMENU_OWNERDATA_MAX 0x100000 /* The rows of an owner-data menu */
+
+/* For FakeMenu_SetItemStates */
+typedef struct FAKEMENU_STATE_CHANGE
+{
+    INT iItem;      /* The item ID (the first item of the ID, like FakeMenu_EnableItem) or the position */
+    UINT uFlags;    /* MF_BYCOMMAND or MF_BYPOSITION */
+    UINT fMask;     /* The MFS_... flags to change */
+    UINT fState;    /* The new MFS_... flags */
+} FAKEMENU_STATE_CHANGE;
+
 BOOL APIENTRY FakeMenu_InitInstance(VOID);
 VOID APIENTRY FakeMenu_ExitInstance(VOID);
+BOOL APIENTRY FakeMenu_EnableSharedRegistry(BOOL bEnable); /* Close the menus of other processes */
+VOID APIENTRY FakeMenu_SetHoverDelay(INT nDelay); /* In milliseconds. Negative for the system setting */
+
+/* The performance counters of the tree or the process (NULL). */
+/* FakeMenu_GetStats fails unless built with FAKEMENU_ENABLE_STATS. */
+BOOL APIENTRY FakeMenu_GetStats(HFAKEMENU hFakeMenu OPTIONAL, FAKEMENU_STATS* pStats);
+VOID APIENTRY FakeMenu_ResetStats(HFAKEMENU hFakeMenu OPTIONAL);
+BOOL APIENTRY FakeMenu_GetLatency(INT nEvent, FAKEMENU_LATENCY* pLatency); /* Process-wide */
+VOID APIENTRY FakeMenu_ResetLatency(VOID);
+INT APIENTRY FakeMenu_DumpLatency(LPWSTR pszText, INT cchText); /* Returns the length */
+
+/* Record the input of the next trackings of the root to the file. NULL to stop */
+BOOL APIENTRY FakeMenu_Record(HFAKEMENU hFakeMenu, LPCWSTR pszFileName OPTIONAL);
+/* Build the recorded tree and track it with the recorded input. Fails if an event is skipped */
+BOOL APIENTRY FakeMenu_Replay(LPCWSTR pszFileName, FAKEMENU_REPLAY* pReplay);
+
+/* The resources of the tree */
+BOOL APIENTRY FakeMenu_GetMemoryUsage(HFAKEMENU hFakeMenu, FAKEMENU_MEMORY* pMemory);
+/* Release the resources of the tree that is not shown. They are rebuilt when needed */
+BOOL APIENTRY FakeMenu_Trim(HFAKEMENU hFakeMenu, INT nLevel);
+/* Trim the trees idle for dwIdleTime milliseconds, or on low memory. Zero to disable */
+VOID APIENTRY FakeMenu_SetAutoTrim(DWORD dwIdleTime, INT nLevel);
 
 HFAKEMENU APIENTRY FakeMenu_Create(VOID);
 HFAKEMENU APIENTRY FakeMenu_FromHMENU(HMENU hMenu);
 INT APIENTRY FakeMenu_TrackPopup(HFAKEMENU hFakeMenu, POINT pt);
+BOOL APIENTRY FakeMenu_TrackPopupAsync(HFAKEMENU hFakeMenu, POINT pt, FAKEMENUPROC pfnCallback, LPVOID pContext);
+VOID APIENTRY FakeMenu_Cancel(HFAKEMENU hFakeMenu); /* Thread-safe */
 VOID APIENTRY FakeMenu_Destroy(HFAKEMENU hFakeMenu);
+VOID APIENTRY FakeMenu_EnableSearch(HFAKEMENU hFakeMenu, BOOL bEnable); /* Typing searches the tree */
 
 BOOL APIENTRY FakeMenu_AddString(HFAKEMENU hFakeMenu, UINT nID, LPCWSTR text, UINT fState);
 INT APIENTRY FakeMenu_AppendItem(HFAKEMENU hFakeMenu, const MENUITEMINFO* pmii);
 VOID APIENTRY FakeMenu_DeleteItems(HFAKEMENU hFakeMenu);
 
+/* Owner data: the rows are fetched from the callback when needed and a few of them are cached. */
+/* The items are deleted. The rows have one height and their sub-menus are owner data too. */
+/* The access keys, the search, the recording and the state updates don't cover the rows. */
+/* Zero and NULL to go back to the items. Call them in the thread of the menu. */
+BOOL APIENTRY FakeMenu_SetOwnerData(HFAKEMENU hFakeMenu, INT cItems, FAKEMENUDATAPROC pfnData OPTIONAL, LPARAM lParam, LPVOID pContext);
+VOID APIENTRY FakeMenu_InvalidateOwnerData(HFAKEMENU hFakeMenu, INT iFirst, INT iLast); /* -1 for the last */
+
+/* The state updates are thread-safe and repaint the changed items of the open menus. */
+/* Don't add or delete the items during them. */
 BOOL APIENTRY FakeMenu_EnableItem(HFAKEMENU hFakeMenu, INT iItem, UINT uEnable);
 BOOL APIENTRY FakeMenu_CheckItem(HFAKEMENU hFakeMenu, INT iItem, UINT uCheck);
 BOOL APIENTRY FakeMenu_CheckRadioItem(HFAKEMENU hFakeMenu, INT iFirst, INT iLast, INT iCheck, BOOL bByPosition);
+INT APIENTRY FakeMenu_SetItemStates(HFAKEMENU hFakeMenu, const FAKEMENU_STATE_CHANGE* pChanges, INT cChanges);
 
 VOID APIENTRY FakeMenu_SetLogFont(HFAKEMENU hFakeMenu, LPLOGFONT plf OPTIONAL);
 BOOL APIENTRY FakeMenu_GetItemText(HFAKEMENU hFakeMenu, INT iItem, LPWSTR pszText, INT cchText, BOOL bByPosition);
+BOOL APIENTRY FakeMenu_SetCurSel(HFAKEMENU hFakeMenu, INT iItem); /* By position. -1 for none */
+VOID APIENTRY FakeMenu_EnsureVisible(HFAKEMENU hFakeMenu, INT iItem); /* By position */
 
 #ifdef __cplusplus
 } // extern "C"
 #endif
+
+#if defined(__cplusplus) && defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+/* INT id = co_await FakeMenuAwaitable(hFakeMenu, pt); */
+class FakeMenuAwaitable
+{
+public:
+    FakeMenuAwaitable(HFAKEMENU hFakeMenu, POINT pt)
+        : m_hFakeMenu(hFakeMenu), m_pt(pt), m_idResult(0)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        return !!FakeMenu_TrackPopupAsync(m_hFakeMenu, m_pt, OnResult, this);
+    }
+
+    INT await_resume() const noexcept
+    {
+        return m_idResult;
+    }
+
+protected:
+    HFAKEMENU m_hFakeMenu;
+    POINT m_pt;
+    INT m_idResult;
+    std::coroutine_handle<> m_handle;
+
+    static VOID CALLBACK OnResult(HFAKEMENU hFakeMenu, INT idResult, LPVOID pContext)
+    {
+        auto pThis = reinterpret_cast<FakeMenuAwaitable*>(pContext);
+        pThis->m_idResult = idResult;
+        pThis->m_handle.resume();
+    }
+};
+#endif
@@ -0,0 +1,799 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     The benchmarks of FakeMenu
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fakemenu.h"
+#include "fakemenu_gen.h"
+
+// Usage: fakemenu_bench [--quick] [--repeat N] [--out FILE]
+// Writes the results as JSON. Runs unattended.
+
+#define BENCH_HOVER_DELAY 60000 // Don't open the sub-menus by hovering
+#define BENCH_MAX_REPEAT 32
+#define BENCH_LOOP_KEYS 100     // The keys injected into the tracking loop
+#define BENCH_IDLE_TIME 1000    // The idle time of the tracking loop, in milliseconds
+#define BENCH_FRAMES 120        // The frames of the host loop
+#define BENCH_FRAME_TIME 16     // The frame budget of the host loop, in milliseconds
+#define BENCH_PRODUCERS 8       // The threads updating the states
+#define BENCH_PRODUCER_ITEMS 5000
+#define BENCH_PRODUCE_TIME 1000 // In milliseconds
+#define BENCH_CASCADE_LEVELS 4
+#define BENCH_CASCADE_HOVER 100 // The hover delay of the cascade, in milliseconds
+#define BENCH_CASCADE_STEPS 8   // The mouse moves across a menu
+#define BENCH_SEARCH_QUERY L"item 9999" // Typed into the search mode
+
+static const INT s_anItems[] = { 10, 100, 1000, 10000, 100000 };
+static const INT s_anDepths[] = { 1, 2, 4, 8 };
+
+static INT s_nRepeat = 5;
+static INT s_nMaxItems = 100000;
+static FILE *s_fpOut = NULL;
+static BOOL s_bFirstResult = TRUE;
+static LARGE_INTEGER s_liFreq;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Timing
+
+static LONGLONG GetTicks(VOID)
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+static double TicksToNanoseconds(LONGLONG qwTicks)
+{
+    return (double)qwTicks * 1e9 / (double)s_liFreq.QuadPart;
+}
+
+static int CompareTicks(const void *x, const void *y)
+{
+    LONGLONG a = *(const LONGLONG *)x, b = *(const LONGLONG *)y;
+    return (a < b) ? -1 : (a > b) ? 1 : 0;
+}
+
+// Write the result of the runs as a JSON object
+static VOID Report(LPCSTR pszName, INT nItems, INT nDepth, INT cOps,
+                   LONGLONG *pqwRuns, INT cRuns, LPCSTR pszExtra = NULL)
+{
+    if (cOps <= 0 || cRuns <= 0)
+        return;
+
+    qsort(pqwRuns, cRuns, sizeof(LONGLONG), CompareTicks);
+    double nsMin = TicksToNanoseconds(pqwRuns[0]) / cOps;
+    double nsMedian = TicksToNanoseconds(pqwRuns[cRuns / 2]) / cOps;
+
+    fprintf(s_fpOut, "%s\n    {\"name\": \"%s\", \"items\": %d, \"depth\": %d, \"ops\": %d, "
+            "\"runs\": %d, \"ns_per_op_min\": %.1f, \"ns_per_op_median\": %.1f%s%s}",
+            (s_bFirstResult ? "" : ","), pszName, nItems, nDepth, cOps, cRuns,
+            nsMin, nsMedian, (pszExtra ? ", " : ""), (pszExtra ? pszExtra : ""));
+    fflush(s_fpOut);
+    s_bFirstResult = FALSE;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The microbenchmarks
+
+static VOID BenchFromHMENU(INT nItems, INT nDepth)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, nDepth);
+
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT];
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        LONGLONG qwStart = GetTicks();
+        HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+        aqwRuns[iRun] = GetTicks() - qwStart;
+        FakeMenu_Destroy(hFakeMenu);
+    }
+    Report("from_hmenu", nItems, nDepth, nItems, aqwRuns, s_nRepeat);
+
+    DestroyMenu(hMenu);
+}
+
+static VOID BenchAppend(INT nItems)
+{
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT];
+    WCHAR szText[64];
+
+    // FakeMenu_AddString
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        HFAKEMENU hFakeMenu = FakeMenu_Create();
+        LONGLONG qwStart = GetTicks();
+        for (INT iItem = 1; iItem <= nItems; ++iItem)
+        {
+            wsprintfW(szText, L"&Item %d", iItem);
+            FakeMenu_AddString(hFakeMenu, iItem, szText, MFS_ENABLED);
+        }
+        aqwRuns[iRun] = GetTicks() - qwStart;
+        FakeMenu_Destroy(hFakeMenu);
+    }
+    Report("add_string", nItems, 1, nItems, aqwRuns, s_nRepeat);
+
+    // FakeMenu_AppendItem
+    MENUITEMINFOW mii = { sizeof(mii) };
+    mii.fMask = MIIM_ID | MIIM_FTYPE | MIIM_STATE | MIIM_STRING;
+    mii.fType = MFT_STRING;
+    mii.fState = MFS_ENABLED;
+    mii.dwTypeData = szText;
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        HFAKEMENU hFakeMenu = FakeMenu_Create();
+        LONGLONG qwStart = GetTicks();
+        for (INT iItem = 1; iItem <= nItems; ++iItem)
+        {
+            wsprintfW(szText, L"&Item %d", iItem);
+            mii.wID = iItem;
+            FakeMenu_AppendItem(hFakeMenu, &mii);
+        }
+        aqwRuns[iRun] = GetTicks() - qwStart;
+        FakeMenu_Destroy(hFakeMenu);
+    }
+    Report("append_item", nItems, 1, nItems, aqwRuns, s_nRepeat);
+}
+
+static VOID BenchLookup(INT nItems, INT nDepth)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, nDepth);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    const INT cOps = 100000;
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT];
+    WCHAR szText[64];
+
+    // By ID, searching the whole tree
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        UINT nSeed = 12345;
+        LONGLONG qwStart = GetTicks();
+        for (INT iOp = 0; iOp < cOps; ++iOp)
+        {
+            nSeed = nSeed * 1103515245 + 12345;
+            FakeMenu_GetItemText(hFakeMenu, 1 + (nSeed >> 8) % nItems, szText, _countof(szText), FALSE);
+        }
+        aqwRuns[iRun] = GetTicks() - qwStart;
+    }
+    Report("index_from_id", nItems, nDepth, cOps, aqwRuns, s_nRepeat);
+
+    // By the position of the root
+    INT cRootItems = 0;
+    while (FakeMenu_GetItemText(hFakeMenu, cRootItems, szText, _countof(szText), TRUE))
+        ++cRootItems;
+
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        UINT nSeed = 12345;
+        LONGLONG qwStart = GetTicks();
+        for (INT iOp = 0; iOp < cOps; ++iOp)
+        {
+            nSeed = nSeed * 1103515245 + 12345;
+            FakeMenu_GetItemText(hFakeMenu, (nSeed >> 8) % cRootItems, szText, _countof(szText), TRUE);
+        }
+        aqwRuns[iRun] = GetTicks() - qwStart;
+    }
+    Report("get_item", nItems, nDepth, cOps, aqwRuns, s_nRepeat);
+
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The scenario benchmarks
+
+static FAKEMENU_GEN_TRACK s_track;
+
+static BOOL BeginTrack(HFAKEMENU hFakeMenu)
+{
+    POINT pt = { 0, 0 };
+    return FakeMenuGen_BeginTrack(hFakeMenu, &s_track, pt);
+}
+
+static VOID EndTrack(HFAKEMENU hFakeMenu)
+{
+    FakeMenuGen_EndTrack(hFakeMenu, &s_track);
+}
+
+// TrackPopup until the first paint, including MeasureItems
+static VOID BenchTrack(INT nItems, INT nDepth)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, nDepth);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    FakeMenu_ResetStats(hFakeMenu);
+
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT];
+    INT cRuns = 0;
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        LONGLONG qwStart = GetTicks();
+        if (!BeginTrack(hFakeMenu))
+            break;
+        FakeMenuGen_PumpMessages(); // Until painted
+        aqwRuns[cRuns++] = GetTicks() - qwStart;
+        EndTrack(hFakeMenu);
+    }
+
+    // The library's own counters, if built with them
+    CHAR szExtra[128] = "";
+    FAKEMENU_STATS stats = { sizeof(stats) };
+    if (cRuns && FakeMenu_GetStats(hFakeMenu, &stats) && stats.cTracks)
+    {
+        sprintf(szExtra, "\"us_measure\": %llu, \"us_first_paint\": %llu",
+                stats.usMeasureTime / stats.cTracks, stats.usFirstPaintTime / stats.cTracks);
+    }
+    Report("track_first_paint", nItems, nDepth, 1, aqwRuns, cRuns, (szExtra[0] ? szExtra : NULL));
+
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+// The keyboard navigation and the hit testing of a shown menu
+static VOID BenchInput(INT nItems, INT nDepth)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, nDepth);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    if (!BeginTrack(hFakeMenu))
+    {
+        FakeMenu_Destroy(hFakeMenu);
+        return;
+    }
+    FakeMenuGen_PumpMessages();
+
+    HWND hwnd = FakeMenuGen_FindMenuWindow();
+    if (!hwnd)
+    {
+        EndTrack(hFakeMenu);
+        FakeMenu_Destroy(hFakeMenu);
+        return;
+    }
+
+    const INT cKeys = 200;
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT];
+
+    // One key at a time, or OnKey coalesces them
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        LONGLONG qwStart = GetTicks();
+        for (INT iKey = 0; iKey < cKeys; ++iKey)
+        {
+            UINT vk = (iKey % 20 == 19) ? VK_NEXT : VK_DOWN;
+            PostMessageW(hwnd, WM_KEYDOWN, vk, 1);
+            PostMessageW(hwnd, WM_KEYUP, vk, 0xC0000001);
+            FakeMenuGen_PumpMessages();
+        }
+        aqwRuns[iRun] = GetTicks() - qwStart;
+    }
+    Report("keyboard_navigation", nItems, nDepth, cKeys, aqwRuns, s_nRepeat);
+
+    // Sweep the mouse over the window
+    RECT rc;
+    GetClientRect(hwnd, &rc);
+    const INT cMoves = 200;
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        LONGLONG qwStart = GetTicks();
+        for (INT iMove = 0; iMove < cMoves; ++iMove)
+        {
+            INT x = rc.right / 2 + (iMove & 1);
+            INT y = (rc.bottom > 0) ? (iMove * 7919) % rc.bottom : 0;
+            PostMessageW(hwnd, WM_MOUSEMOVE, 0, MAKELPARAM(x, y));
+            FakeMenuGen_PumpMessages();
+        }
+        aqwRuns[iRun] = GetTicks() - qwStart;
+    }
+    Report("hit_test", nItems, nDepth, cMoves, aqwRuns, s_nRepeat);
+
+    EndTrack(hFakeMenu);
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+// Type the query into the search mode of the root, one character at a time
+static VOID BenchSearch(INT nItems)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, 2);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+    FakeMenu_EnableSearch(hFakeMenu, TRUE);
+
+    const INT cch = lstrlenW(BENCH_SEARCH_QUERY);
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT], aqwFirstKey[BENCH_MAX_REPEAT];
+    INT cRuns = 0;
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        if (!BeginTrack(hFakeMenu))
+            break;
+        FakeMenuGen_PumpMessages();
+
+        HWND hwnd = FakeMenuGen_FindMenuWindow();
+        if (!hwnd)
+        {
+            EndTrack(hFakeMenu);
+            break;
+        }
+
+        // The first one builds the index and scans it. The rest narrow the matches
+        LONGLONG qwStart = GetTicks();
+        for (INT ich = 0; ich < cch; ++ich)
+        {
+            PostMessageW(hwnd, WM_CHAR, BENCH_SEARCH_QUERY[ich], 1);
+            FakeMenuGen_PumpMessages();
+            if (ich == 0)
+                aqwFirstKey[cRuns] = GetTicks() - qwStart;
+        }
+        aqwRuns[cRuns++] = GetTicks() - qwStart;
+
+        EndTrack(hFakeMenu);
+    }
+
+    CHAR szExtra[128] = "";
+    if (cRuns)
+    {
+        qsort(aqwFirstKey, cRuns, sizeof(LONGLONG), CompareTicks);
+        sprintf(szExtra, "\"us_first_key_median\": %.1f",
+                TicksToNanoseconds(aqwFirstKey[cRuns / 2]) / 1e3);
+    }
+    Report("search_keystroke", nItems, 2, cch, aqwRuns, cRuns, (szExtra[0] ? szExtra : NULL));
+
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+// Open and close the first sub-menu by the keyboard
+static VOID BenchSubMenu(INT nItems, INT nDepth)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, nDepth);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    if (!BeginTrack(hFakeMenu))
+    {
+        FakeMenu_Destroy(hFakeMenu);
+        return;
+    }
+    FakeMenuGen_PumpMessages();
+
+    HWND hwnd = FakeMenuGen_FindMenuWindow();
+    if (!hwnd)
+    {
+        EndTrack(hFakeMenu);
+        FakeMenu_Destroy(hFakeMenu);
+        return;
+    }
+    FakeMenuGen_PostKey(hwnd, VK_DOWN); // The first item has a sub-menu
+
+    const INT cOpens = 50;
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT];
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        LONGLONG qwTotal = 0;
+        for (INT iOpen = 0; iOpen < cOpens; ++iOpen)
+        {
+            LONGLONG qwStart = GetTicks();
+            FakeMenuGen_PostKey(hwnd, VK_RIGHT); // Until the sub-menu is painted
+            qwTotal += GetTicks() - qwStart;
+
+            // The keys go to the window of the active menu
+            HWND hwndSubMenu = FakeMenuGen_FindMenuWindow(0, &hwnd, 1);
+            if (!hwndSubMenu)
+                break;
+            FakeMenuGen_PostKey(hwndSubMenu, VK_LEFT);
+        }
+        aqwRuns[iRun] = qwTotal;
+    }
+    Report("submenu_open", nItems, nDepth, cOpens, aqwRuns, s_nRepeat);
+
+    EndTrack(hFakeMenu);
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+// The frame rate of the host loop with and without an asynchronous menu. A benchmark only;
+// fakemenu_soak fails if a frame of the host takes too long
+static VOID BenchFrameRate(INT nItems)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, 1);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    static LONGLONG s_aqwFrames[BENCH_FRAMES];
+    CHAR szExtra[128];
+
+    FakeMenuGen_RunFrames(NULL, s_aqwFrames, BENCH_FRAMES, BENCH_FRAME_TIME);
+    qsort(s_aqwFrames, BENCH_FRAMES, sizeof(LONGLONG), CompareTicks);
+    sprintf(szExtra, "\"ms_frame_budget\": %d, \"ms_frame_max\": %.1f", BENCH_FRAME_TIME,
+            TicksToNanoseconds(s_aqwFrames[BENCH_FRAMES - 1]) / 1e6);
+    Report("host_frame_idle", nItems, 1, 1, s_aqwFrames, BENCH_FRAMES, szExtra);
+
+    if (BeginTrack(hFakeMenu))
+    {
+        FakeMenuGen_PumpMessages();
+        HWND hwnd = FakeMenuGen_FindMenuWindow();
+        if (hwnd)
+        {
+            FakeMenuGen_RunFrames(hwnd, s_aqwFrames, BENCH_FRAMES, BENCH_FRAME_TIME);
+            qsort(s_aqwFrames, BENCH_FRAMES, sizeof(LONGLONG), CompareTicks);
+            sprintf(szExtra, "\"ms_frame_budget\": %d, \"ms_frame_max\": %.1f, \"tracking\": %s",
+                    BENCH_FRAME_TIME, TicksToNanoseconds(s_aqwFrames[BENCH_FRAMES - 1]) / 1e6,
+                    (FakeMenuGen_IsTracking(&s_track) ? "true" : "false"));
+            Report("host_frame_menu", nItems, 1, 1, s_aqwFrames, BENCH_FRAMES, szExtra);
+        }
+        EndTrack(hFakeMenu);
+    }
+
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+// A thread that enables/disables and checks/unchecks the items until stopped
+struct BENCH_PRODUCER
+{
+    HFAKEMENU hFakeMenu;
+    UINT nSeed;
+    LONGLONG cOps;
+};
+
+static volatile LONG s_fStopProducers = FALSE;
+
+static DWORD WINAPI ProducerThreadProc(LPVOID pParam)
+{
+    BENCH_PRODUCER *pProducer = (BENCH_PRODUCER *)pParam;
+    UINT nSeed = pProducer->nSeed;
+    LONGLONG cOps = 0;
+    while (!s_fStopProducers)
+    {
+        nSeed = nSeed * 1103515245 + 12345;
+        INT iItem = (nSeed >> 8) % BENCH_PRODUCER_ITEMS;
+        BOOL bOn = !!(nSeed & 0x20000);
+        if (nSeed & 0x10000)
+            FakeMenu_EnableItem(pProducer->hFakeMenu, iItem, MF_BYPOSITION | (bOn ? MF_GRAYED : MF_ENABLED));
+        else
+            FakeMenu_CheckItem(pProducer->hFakeMenu, iItem, MF_BYPOSITION | (bOn ? MF_CHECKED : MF_UNCHECKED));
+        ++cOps;
+    }
+    pProducer->cOps = cOps;
+    return 0;
+}
+
+// The state updates of BENCH_PRODUCERS threads against a shown menu
+static VOID BenchProducers(VOID)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(BENCH_PRODUCER_ITEMS, 1);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    if (!BeginTrack(hFakeMenu))
+    {
+        FakeMenu_Destroy(hFakeMenu);
+        return;
+    }
+    FakeMenuGen_PumpMessages();
+
+    FAKEMENU_STATS before = { sizeof(before) }, after = { sizeof(after) };
+    BOOL bStats = FakeMenu_GetStats(NULL, &before);
+
+    static BENCH_PRODUCER s_aProducers[BENCH_PRODUCERS];
+    HANDLE ahThreads[BENCH_PRODUCERS];
+    INT cThreads = 0;
+    s_fStopProducers = FALSE;
+
+    LONGLONG qwStart = GetTicks();
+    for (INT iThread = 0; iThread < BENCH_PRODUCERS; ++iThread)
+    {
+        s_aProducers[cThreads].hFakeMenu = hFakeMenu;
+        s_aProducers[cThreads].nSeed = 12345 + iThread;
+        s_aProducers[cThreads].cOps = 0;
+        ahThreads[cThreads] = CreateThread(NULL, 0, ProducerThreadProc, &s_aProducers[cThreads],
+                                           0, NULL);
+        if (ahThreads[cThreads])
+            ++cThreads;
+    }
+
+    // The UI thread repaints the changed rows meanwhile
+    LONGLONG qwEnd = qwStart + s_liFreq.QuadPart * BENCH_PRODUCE_TIME / 1000;
+    for (LONGLONG qwNow = qwStart; qwNow < qwEnd; qwNow = GetTicks())
+    {
+        MsgWaitForMultipleObjects(0, NULL, FALSE, 1, QS_ALLINPUT);
+        FakeMenuGen_PumpMessages();
+    }
+
+    s_fStopProducers = TRUE;
+    WaitForMultipleObjects(cThreads, ahThreads, TRUE, INFINITE);
+    LONGLONG qwElapsed = GetTicks() - qwStart;
+    FakeMenuGen_PumpMessages();
+
+    LONGLONG cOps = 0;
+    for (INT iThread = 0; iThread < cThreads; ++iThread)
+    {
+        CloseHandle(ahThreads[iThread]);
+        cOps += s_aProducers[iThread].cOps;
+    }
+
+    CHAR szExtra[128];
+    ULONGLONG cPaints = 0;
+    if (bStats && FakeMenu_GetStats(NULL, &after))
+        cPaints = after.cPaints - before.cPaints;
+    sprintf(szExtra, "\"producers\": %d, \"ops_per_sec\": %.0f, \"paints\": %llu, \"tracking\": %s",
+            cThreads, (double)cOps * s_liFreq.QuadPart / qwElapsed, cPaints,
+            (FakeMenuGen_IsTracking(&s_track) ? "true" : "false"));
+    if (cOps > 0x7FFFFFFF)
+        cOps = 0x7FFFFFFF;
+    Report("state_updates", BENCH_PRODUCER_ITEMS, 1, (INT)cOps, &qwElapsed, 1, szExtra);
+
+    EndTrack(hFakeMenu);
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+// Pump the messages until a menu window other than the chwndOpen ones is shown
+static HWND WaitForSubMenu(const HWND *phwndOpen, INT chwndOpen)
+{
+    LONGLONG qwStart = GetTicks();
+    for (;;)
+    {
+        FakeMenuGen_PumpMessages();
+        HWND hwnd = FakeMenuGen_FindMenuWindow(0, phwndOpen, chwndOpen);
+        if (hwnd || GetTicks() - qwStart > 2 * s_liFreq.QuadPart)
+            return hwnd;
+        MsgWaitForMultipleObjects(0, NULL, FALSE, 1, QS_ALLINPUT);
+    }
+}
+
+// The time to choose the first item of the deepest menu by the mouse. The mouse moves right
+// along the first row of each menu and rests there until the sub-menu opens by hovering
+static VOID BenchCascade(INT nItems)
+{
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, BENCH_CASCADE_LEVELS);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    FakeMenu_SetHoverDelay(BENCH_CASCADE_HOVER);
+
+    LONGLONG aqwRuns[BENCH_MAX_REPEAT];
+    INT cRuns = 0;
+    for (INT iRun = 0; iRun < s_nRepeat; ++iRun)
+    {
+        if (!BeginTrack(hFakeMenu))
+            break;
+        FakeMenuGen_PumpMessages();
+
+        HWND ahwndOpen[BENCH_CASCADE_LEVELS];
+        INT chwndOpen = 0;
+        HWND hwnd = FakeMenuGen_FindMenuWindow();
+
+        LONGLONG qwStart = GetTicks();
+        while (hwnd)
+        {
+            ahwndOpen[chwndOpen++] = hwnd;
+
+            // The first row starts at the top of the client area
+            RECT rc;
+            GetClientRect(hwnd, &rc);
+            const INT y = 4;
+            if (chwndOpen == BENCH_CASCADE_LEVELS) // The target?
+            {
+                PostMessageW(hwnd, WM_MOUSEMOVE, 0, MAKELPARAM(rc.right / 2, y));
+                PostMessageW(hwnd, WM_LBUTTONDOWN, MK_LBUTTON, MAKELPARAM(rc.right / 2, y));
+                PostMessageW(hwnd, WM_LBUTTONUP, 0, MAKELPARAM(rc.right / 2, y));
+                break;
+            }
+
+            for (INT iStep = 1; iStep <= BENCH_CASCADE_STEPS; ++iStep)
+            {
+                INT x = rc.right * iStep / (BENCH_CASCADE_STEPS + 1);
+                PostMessageW(hwnd, WM_MOUSEMOVE, 0, MAKELPARAM(x, y));
+                FakeMenuGen_PumpMessages();
+            }
+            hwnd = WaitForSubMenu(ahwndOpen, chwndOpen);
+        }
+
+        for (LONGLONG qwWait = GetTicks(); FakeMenuGen_IsTracking(&s_track); )
+        {
+            if (GetTicks() - qwWait > 2 * s_liFreq.QuadPart)
+                break;
+            MsgWaitForMultipleObjects(0, NULL, FALSE, 1, QS_ALLINPUT);
+            FakeMenuGen_PumpMessages();
+        }
+
+        LONGLONG qwRun = GetTicks() - qwStart;
+        // The first items of the levels have the IDs 1, 2, 3, ...
+        BOOL bChosen = (!FakeMenuGen_IsTracking(&s_track) &&
+                        s_track.idResult == BENCH_CASCADE_LEVELS);
+        EndTrack(hFakeMenu);
+        if (!bChosen) // Not reached
+            break;
+        aqwRuns[cRuns++] = qwRun;
+    }
+
+    FakeMenu_SetHoverDelay(BENCH_HOVER_DELAY);
+
+    CHAR szExtra[128];
+    sprintf(szExtra, "\"hover_delay_ms\": %d, \"reached\": %s", BENCH_CASCADE_HOVER,
+            (cRuns == s_nRepeat ? "true" : "false"));
+    Report("cascade_time_to_target", nItems, BENCH_CASCADE_LEVELS, 1, aqwRuns, cRuns, szExtra);
+
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+// The synchronous tracking loop, driven by another thread
+struct BENCH_LOOP
+{
+    HFAKEMENU hFakeMenu;
+    DWORD dwThreadId;                   // The tracking thread
+    LONGLONG aqwKeys[BENCH_LOOP_KEYS];  // From each injected key to the paint
+    INT cKeys;
+    ULONGLONG cWakeups;                 // In BENCH_IDLE_TIME
+    ULONGLONG cIdleWakeups;
+};
+
+// Wait until the library paints after cPaints paints. FALSE if timed out
+static BOOL WaitForPaint(ULONGLONG cPaints, LONGLONG qwStart)
+{
+    FAKEMENU_STATS stats = { sizeof(stats) };
+    while (FakeMenu_GetStats(NULL, &stats) && stats.cPaints == cPaints)
+    {
+        if (GetTicks() - qwStart > s_liFreq.QuadPart) // One second
+            return FALSE;
+        SwitchToThread();
+    }
+    return TRUE;
+}
+
+static DWORD WINAPI LoopThreadProc(LPVOID pParam)
+{
+    BENCH_LOOP *pLoop = (BENCH_LOOP *)pParam;
+
+    HWND hwnd = NULL;
+    for (INT iTry = 0; !hwnd && iTry < 500; ++iTry)
+    {
+        Sleep(10);
+        hwnd = FakeMenuGen_FindMenuWindow(pLoop->dwThreadId);
+    }
+
+    FAKEMENU_STATS stats = { sizeof(stats) };
+    if (hwnd)
+    {
+        Sleep(100); // The first paint
+
+        // Nothing happens. Every wakeup of the loop is a waste
+        FakeMenu_GetStats(NULL, &stats);
+        ULONGLONG cWakeups = stats.cWakeups, cIdleWakeups = stats.cIdleWakeups;
+        Sleep(BENCH_IDLE_TIME);
+        FakeMenu_GetStats(NULL, &stats);
+        pLoop->cWakeups = stats.cWakeups - cWakeups;
+        pLoop->cIdleWakeups = stats.cIdleWakeups - cIdleWakeups;
+
+        // Inject the keys like the keyboard hook, one at a time
+        for (INT iKey = 0; iKey < BENCH_LOOP_KEYS; ++iKey)
+        {
+            FakeMenu_GetStats(NULL, &stats);
+            LONGLONG qwStart = GetTicks();
+            PostMessageW(hwnd, WM_KEYDOWN, VK_DOWN, 1);
+            PostMessageW(hwnd, WM_KEYUP, VK_DOWN, 0xC0000001);
+            if (!WaitForPaint(stats.cPaints, qwStart))
+                break;
+            pLoop->aqwKeys[pLoop->cKeys++] = GetTicks() - qwStart;
+        }
+    }
+
+    FakeMenu_Cancel(pLoop->hFakeMenu);
+    return 0;
+}
+
+// The latency of FakeMenu_TrackPopup from an input to the selection change, and its idle wakeups
+static VOID BenchLoop(INT nItems)
+{
+    FAKEMENU_STATS stats = { sizeof(stats) };
+    if (!FakeMenu_GetStats(NULL, &stats))
+    {
+        fprintf(stderr, "fakemenu_bench: loop_latency needs FAKEMENU_ENABLE_STATS\n");
+        return;
+    }
+
+    HMENU hMenu = FakeMenuGen_BuildMenu(nItems, 1);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    DestroyMenu(hMenu);
+
+    static BENCH_LOOP s_loop;
+    ZeroMemory(&s_loop, sizeof(s_loop));
+    s_loop.hFakeMenu = hFakeMenu;
+    s_loop.dwThreadId = GetCurrentThreadId();
+
+    HANDLE hThread = CreateThread(NULL, 0, LoopThreadProc, &s_loop, 0, NULL);
+    if (hThread)
+    {
+        POINT pt = { 0, 0 };
+        FakeMenu_TrackPopup(hFakeMenu, pt);
+        WaitForSingleObject(hThread, INFINITE);
+        CloseHandle(hThread);
+    }
+
+    CHAR szExtra[128];
+    sprintf(szExtra, "\"idle_ms\": %d, \"idle_wakeups\": %llu, \"idle_empty_wakeups\": %llu",
+            BENCH_IDLE_TIME, s_loop.cWakeups, s_loop.cIdleWakeups);
+    Report("loop_latency", nItems, 1, 1, s_loop.aqwKeys, s_loop.cKeys, szExtra);
+
+    FakeMenu_Destroy(hFakeMenu);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+    s_fpOut = stdout;
+    for (int iarg = 1; iarg < argc; ++iarg)
+    {
+        if (strcmp(argv[iarg], "--quick") == 0)
+        {
+            s_nMaxItems = 1000;
+            s_nRepeat = 3;
+        }
+        else if (strcmp(argv[iarg], "--repeat") == 0 && iarg + 1 < argc)
+        {
+            s_nRepeat = atoi(argv[++iarg]);
+            if (s_nRepeat < 1)
+                s_nRepeat = 1;
+            if (s_nRepeat > BENCH_MAX_REPEAT)
+                s_nRepeat = BENCH_MAX_REPEAT;
+        }
+        else if (strcmp(argv[iarg], "--out") == 0 && iarg + 1 < argc)
+        {
+            s_fpOut = fopen(argv[++iarg], "w");
+            if (!s_fpOut)
+            {
+                fprintf(stderr, "fakemenu_bench: cannot open %s\n", argv[iarg]);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Usage: fakemenu_bench [--quick] [--repeat N] [--out FILE]\n");
+            return 1;
+        }
+    }
+
+    QueryPerformanceFrequency(&s_liFreq);
+    FakeMenu_InitInstance();
+    FakeMenu_SetHoverDelay(BENCH_HOVER_DELAY);
+
+    fprintf(s_fpOut, "{\"suite\": \"fakemenu_bench\", \"results\": [");
+
+    for (INT iItems = 0; iItems < (INT)_countof(s_anItems); ++iItems)
+    {
+        INT nItems = s_anItems[iItems];
+        if (nItems > s_nMaxItems)
+            break;
+
+        BenchAppend(nItems);
+        BenchLoop(nItems);
+        BenchFrameRate(nItems);
+        if (nItems >= 100) // Enough for the levels
+            BenchCascade(nItems);
+        if (nItems >= 1000) // Up to 100k labels
+            BenchSearch(nItems);
+
+        for (INT iDepth = 0; iDepth < (INT)_countof(s_anDepths); ++iDepth)
+        {
+            INT nDepth = s_anDepths[iDepth];
+            BenchFromHMENU(nItems, nDepth);
+            BenchLookup(nItems, nDepth);
+            BenchTrack(nItems, nDepth);
+            BenchInput(nItems, nDepth);
+            if (nDepth > 1)
+                BenchSubMenu(nItems, nDepth);
+        }
+    }
+
+    BenchProducers();
+
+    fprintf(s_fpOut, "\n]}\n");
+    if (s_fpOut != stdout)
+        fclose(s_fpOut);
+
+    FakeMenu_ExitInstance();
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     The generated trees and the tracking helpers of the FakeMenu tools
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#pragma once
+
+// The generated trees have the IDs 1, 2, ... in the pre-order. Every 16th ID is a separator.
+// The root takes the rest of the items.
+
+// The optional states of the generated items
+struct FAKEMENU_GEN_OPTIONS
+{
+    int nGrayEvery;     // Gray every Nth ID, or zero
+    int nCheckEvery;    // Check every Nth ID of the leaves, or zero
+};
+
+// The number of the items of each level so that nDepth levels hold nItems
+static inline int FakeMenuGen_GetFanOut(int nItems, int nDepth)
+{
+    int nFanOut = 2;
+    for (;; ++nFanOut)
+    {
+        long long cTotal = 0, cLevel = 1;
+        for (int iLevel = 0; iLevel < nDepth && cTotal < nItems; ++iLevel)
+        {
+            cLevel *= nFanOut;
+            cTotal += cLevel;
+        }
+        if (cTotal >= nItems)
+            return nFanOut;
+    }
+}
+
+// The builder has the type Menu and these:
+//   Menu NewMenu();
+//   void AddSeparator(Menu menu);
+//   void AddItem(Menu menu, int nID, bool bGrayed, bool bChecked);
+//   void AddSubMenu(Menu menu, Menu subMenu, int nID, bool bGrayed);
+template <class T_BUILDER>
+static void
+FakeMenuGen_AddLevel(T_BUILDER& builder, typename T_BUILDER::Menu menu, int iLevel, int nDepth,
+                     int nFanOut, int& cRemaining, int& nNextID, const FAKEMENU_GEN_OPTIONS& options)
+{
+    for (int i = 0; i < nFanOut && cRemaining > 0; ++i)
+    {
+        --cRemaining;
+        int nID = nNextID++;
+
+        if (nID % 16 == 0)
+        {
+            builder.AddSeparator(menu);
+            continue;
+        }
+
+        bool bGrayed = (options.nGrayEvery > 0 && nID % options.nGrayEvery == 0);
+        if (iLevel + 1 < nDepth && cRemaining > 0)
+        {
+            typename T_BUILDER::Menu subMenu = builder.NewMenu();
+            FakeMenuGen_AddLevel(builder, subMenu, iLevel + 1, nDepth, nFanOut, cRemaining,
+                                 nNextID, options);
+            builder.AddSubMenu(menu, subMenu, nID, bGrayed);
+        }
+        else
+        {
+            bool bChecked = (options.nCheckEvery > 0 && nID % options.nCheckEvery == 0);
+            builder.AddItem(menu, nID, bGrayed, bChecked);
+        }
+    }
+}
+
+// Build nItems items in nDepth levels
+template <class T_BUILDER>
+static typename T_BUILDER::Menu
+FakeMenuGen_Build(T_BUILDER& builder, int nItems, int nDepth, const FAKEMENU_GEN_OPTIONS& options)
+{
+    typename T_BUILDER::Menu menu = builder.NewMenu();
+    int cRemaining = nItems, nNextID = 1;
+    int nFanOut = FakeMenuGen_GetFanOut(nItems, nDepth);
+    while (cRemaining > 0)
+        FakeMenuGen_AddLevel(builder, menu, 0, nDepth, nFanOut, cRemaining, nNextID, options);
+    return menu;
+}
+
+#ifdef _WIN32
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The HMENU trees and the tracking (Win32)
+
+struct FAKEMENU_GEN_HMENU_BUILDER
+{
+    typedef HMENU Menu;
+
+    HMENU NewMenu()
+    {
+        return CreatePopupMenu();
+    }
+
+    void AddSeparator(HMENU hMenu)
+    {
+        AppendMenuW(hMenu, MF_SEPARATOR, 0, NULL);
+    }
+
+    void AddItem(HMENU hMenu, int nID, bool bGrayed, bool bChecked)
+    {
+        WCHAR szText[64];
+        wsprintfW(szText, L"&Item %u\tCtrl+%u", nID, nID % 10);
+        UINT uFlags = MF_STRING | (bGrayed ? MF_GRAYED : 0) | (bChecked ? MF_CHECKED : 0);
+        AppendMenuW(hMenu, uFlags, nID, szText);
+    }
+
+    void AddSubMenu(HMENU hMenu, HMENU hSubMenu, int nID, bool bGrayed)
+    {
+        WCHAR szText[64];
+        wsprintfW(szText, L"&Item %u\tCtrl+%u", nID, nID % 10);
+        AppendMenuW(hMenu, MF_POPUP | (bGrayed ? MF_GRAYED : 0), (UINT_PTR)hSubMenu, szText);
+    }
+};
+
+static inline HMENU FakeMenuGen_BuildMenu(int nItems, int nDepth, int nCheckEvery = 0)
+{
+    FAKEMENU_GEN_HMENU_BUILDER builder;
+    FAKEMENU_GEN_OPTIONS options = { 0, nCheckEvery };
+    return FakeMenuGen_Build(builder, nItems, nDepth, options);
+}
+
+static inline VOID FakeMenuGen_PumpMessages(VOID)
+{
+    MSG msg;
+    while (PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE))
+    {
+        TranslateMessage(&msg);
+        DispatchMessageW(&msg);
+    }
+}
+
+struct FAKEMENU_GEN_FIND
+{
+    const HWND *phwndExcept;
+    INT chwndExcept;
+    HWND hwnd;
+};
+
+static inline BOOL CALLBACK FakeMenuGen_FindMenuProc(HWND hwnd, LPARAM lParam)
+{
+    FAKEMENU_GEN_FIND *pFind = (FAKEMENU_GEN_FIND *)lParam;
+    WCHAR szClass[64];
+    GetClassNameW(hwnd, szClass, _countof(szClass));
+    if (lstrcmpW(szClass, FAKEMENU_CLASSNAMEW) != 0 || !IsWindowVisible(hwnd))
+        return TRUE;
+
+    for (INT i = 0; i < pFind->chwndExcept; ++i)
+    {
+        if (pFind->phwndExcept[i] == hwnd)
+            return TRUE;
+    }
+
+    pFind->hwnd = hwnd;
+    return FALSE;
+}
+
+// A menu window of the thread being shown, other than the chwndExcept windows (the root if
+// no sub-menu is open). Zero dwThreadId for the calling thread
+static inline HWND
+FakeMenuGen_FindMenuWindow(DWORD dwThreadId = 0, const HWND *phwndExcept = NULL, INT chwndExcept = 0)
+{
+    FAKEMENU_GEN_FIND find = { phwndExcept, chwndExcept, NULL };
+    if (!dwThreadId)
+        dwThreadId = GetCurrentThreadId();
+    EnumThreadWindows(dwThreadId, FakeMenuGen_FindMenuProc, (LPARAM)&find);
+    return find.hwnd;
+}
+
+// The asynchronous tracking of a tool. idResult is -1 while tracking
+struct FAKEMENU_GEN_TRACK
+{
+    volatile LONG idResult;
+};
+
+static inline VOID CALLBACK FakeMenuGen_OnTrackResult(HFAKEMENU hFakeMenu, INT idResult, LPVOID pContext)
+{
+    ((FAKEMENU_GEN_TRACK *)pContext)->idResult = idResult;
+}
+
+static inline BOOL FakeMenuGen_BeginTrack(HFAKEMENU hFakeMenu, FAKEMENU_GEN_TRACK *pTrack, POINT pt)
+{
+    pTrack->idResult = -1;
+    if (!FakeMenu_TrackPopupAsync(hFakeMenu, pt, FakeMenuGen_OnTrackResult, pTrack))
+    {
+        pTrack->idResult = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static inline BOOL FakeMenuGen_IsTracking(const FAKEMENU_GEN_TRACK *pTrack)
+{
+    return pTrack->idResult < 0;
+}
+
+// Cancel and wait for the callback
+static inline VOID FakeMenuGen_EndTrack(HFAKEMENU hFakeMenu, FAKEMENU_GEN_TRACK *pTrack)
+{
+    FakeMenu_Cancel(hFakeMenu);
+
+    MSG msg;
+    while (FakeMenuGen_IsTracking(pTrack) && GetMessageW(&msg, NULL, 0, 0))
+    {
+        TranslateMessage(&msg);
+        DispatchMessageW(&msg);
+    }
+}
+
+// Post the key to the window like the keyboard hook, and handle it
+static inline VOID FakeMenuGen_PostKey(HWND hwnd, UINT vk)
+{
+    PostMessageW(hwnd, WM_KEYDOWN, vk, 1);
+    PostMessageW(hwnd, WM_KEYUP, vk, 0xC0000001);
+    FakeMenuGen_PumpMessages();
+}
+
+// Run cFrames frames of msFrame milliseconds of a host loop and write the interval of each
+// frame in the ticks of QueryPerformanceCounter. With hwnd, a key goes to the menu every frame
+static inline VOID FakeMenuGen_RunFrames(HWND hwnd, LONGLONG *pqwFrames, INT cFrames, INT msFrame)
+{
+    LARGE_INTEGER liFreq, liNow;
+    QueryPerformanceFrequency(&liFreq);
+    LONGLONG qwBudget = liFreq.QuadPart * msFrame / 1000;
+
+    QueryPerformanceCounter(&liNow);
+    LONGLONG qwLast = liNow.QuadPart;
+    for (INT iFrame = 0; iFrame < cFrames; ++iFrame)
+    {
+        if (hwnd)
+        {
+            UINT vk = (iFrame % 2) ? VK_UP : VK_DOWN;
+            PostMessageW(hwnd, WM_KEYDOWN, vk, 1);
+            PostMessageW(hwnd, WM_KEYUP, vk, 0xC0000001);
+        }
+
+        // Handle the messages until the next frame
+        LONGLONG qwDeadline = qwLast + qwBudget;
+        for (;;)
+        {
+            FakeMenuGen_PumpMessages();
+            QueryPerformanceCounter(&liNow);
+            if (liNow.QuadPart >= qwDeadline)
+                break;
+            DWORD dwWait = (DWORD)((qwDeadline - liNow.QuadPart) * 1000 / liFreq.QuadPart);
+            MsgWaitForMultipleObjects(0, NULL, FALSE, dwWait, QS_ALLINPUT);
+        }
+
+        QueryPerformanceCounter(&liNow);
+        pqwFrames[iFrame] = liNow.QuadPart - qwLast;
+        qwLast = liNow.QuadPart;
+    }
+}
+
+#endif // def _WIN32
@@ -0,0 +1,587 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     The navigation state machine of FakeMenu (portable)
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#include "fakemenu_nav.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// The page size of NavGetPageItem without layout
+#define FAKEMENU_NAV_PAGE_ITEMS 10
+
+void FakeMenuNav::NavKey(int nInput, int cRepeat)
+{
+    int iItem;
+    switch (nInput)
+    {
+        case FAKEMENU_NAV_ESCAPE:
+        case FAKEMENU_NAV_LEFT:
+            NavClose();
+            break;
+
+        case FAKEMENU_NAV_RETURN:
+            NavReturn();
+            break;
+
+        case FAKEMENU_NAV_RIGHT:
+            NavRight();
+            break;
+
+        case FAKEMENU_NAV_UP:
+        case FAKEMENU_NAV_DOWN:
+        case FAKEMENU_NAV_PAGE_UP:
+        case FAKEMENU_NAV_PAGE_DOWN:
+        {
+            bool bNext = (nInput == FAKEMENU_NAV_DOWN || nInput == FAKEMENU_NAV_PAGE_DOWN);
+            iItem = m_iSelected;
+            for (int i = 0; i < (cRepeat > 1 ? cRepeat : 1); ++i)
+            {
+                if (nInput == FAKEMENU_NAV_UP || nInput == FAKEMENU_NAV_DOWN)
+                    iItem = NavGetNextSelectable(iItem, bNext);
+                else
+                    iItem = NavGetPageItem(iItem, bNext);
+            }
+            NavSetCurSel(iItem, true);
+            break;
+        }
+
+        case FAKEMENU_NAV_HOME:
+        case FAKEMENU_NAV_END:
+            iItem = NavGetNextSelectable(-1, nInput == FAKEMENU_NAV_HOME);
+            NavSetCurSel(iItem, true);
+            break;
+    }
+}
+
+// Returns false if the action is disabled
+bool FakeMenuNav::NavButtonDown(int iItem)
+{
+    if (iItem < 0 || NavGetCount() <= iItem)
+        return false;
+
+    unsigned fFlags = NavGetItemFlags(iItem);
+    if (fFlags & (FAKEMENU_NAV_SEPARATOR | FAKEMENU_NAV_GRAYED))
+        return false; // The action is disabled
+
+    NavSetCurSel(iItem, false); // Select it now
+
+    if (iItem == m_iOpenSubMenu && NavIsSubMenuOpen())
+        return true; // Already open by hovering
+
+    if (fFlags & FAKEMENU_NAV_SUBMENU)
+        NavOpenSubMenu(iItem, false);
+    return true;
+}
+
+void FakeMenuNav::NavButtonUp(int iItem)
+{
+    if (iItem < 0 || NavGetCount() <= iItem)
+        return;
+
+    NavSetCurSel(iItem, false); // Select it
+
+    if (NavGetItemFlags(iItem) & (FAKEMENU_NAV_SEPARATOR | FAKEMENU_NAV_SUBMENU))
+        return; // The action is disabled
+
+    NavChooseItem(iItem);
+}
+
+void FakeMenuNav::NavReturn()
+{
+    if (m_iSelected < 0 || NavGetCount() <= m_iSelected)
+        return; // Not selected
+
+    unsigned fFlags = NavGetItemFlags(m_iSelected);
+    if (fFlags & (FAKEMENU_NAV_SEPARATOR | FAKEMENU_NAV_GRAYED))
+        return; // The action is disabled
+
+    if (fFlags & FAKEMENU_NAV_SUBMENU) // Open sub-menu?
+        NavOpenSubMenu(m_iSelected, true);
+    else
+        NavChooseItem(m_iSelected);
+}
+
+void FakeMenuNav::NavRight()
+{
+    if (m_iSelected < 0 || NavGetCount() <= m_iSelected) // Not selected
+        return;
+
+    unsigned fFlags = NavGetItemFlags(m_iSelected);
+    if (fFlags & (FAKEMENU_NAV_SEPARATOR | FAKEMENU_NAV_GRAYED))
+        return; // The action is disabled
+
+    if (!(fFlags & FAKEMENU_NAV_SUBMENU)) // No sub-menu?
+        return;
+
+    NavOpenSubMenu(m_iSelected, true);
+}
+
+// Hide the tree from the root with flashing the chosen item
+void FakeMenuNav::NavChooseItem(int iItem)
+{
+    FakeMenuNav* pRoot = this;
+    while (pRoot->NavGetParent())
+        pRoot = pRoot->NavGetParent();
+
+    NavChoose(iItem, pRoot);
+}
+
+// A linear search. The derived class may cache it
+int FakeMenuNav::NavGetNextSelectable(int iItem, bool bNext)
+{
+    int cItems = NavGetCount();
+    if (cItems <= 0)
+        return -1;
+
+    if (iItem < 0 || cItems <= iItem) // From the edge
+        iItem = (bNext ? cItems - 1 : 0);
+
+    for (int i = 0; i < cItems; ++i)
+    {
+        iItem = (bNext ? iItem + 1 : iItem + cItems - 1) % cItems;
+        if (!(NavGetItemFlags(iItem) & FAKEMENU_NAV_SEPARATOR))
+            return iItem;
+    }
+
+    return -1;
+}
+
+// The selectable item about one page away. The derived class knows the layout
+int FakeMenuNav::NavGetPageItem(int iItem, bool bNext)
+{
+    int cItems = NavGetCount();
+    if (cItems <= 0)
+        return -1;
+
+    int iPage;
+    if (iItem < 0 || cItems <= iItem)
+        iPage = 0;
+    else
+        iPage = iItem + (bNext ? FAKEMENU_NAV_PAGE_ITEMS : -FAKEMENU_NAV_PAGE_ITEMS);
+    if (iPage < 0)
+        iPage = 0;
+    if (iPage >= cItems)
+        iPage = cItems - 1;
+
+    // Skip the separators without wrapping around
+    for (int i = iPage; 0 <= i && i < cItems; i += (bNext ? 1 : -1))
+    {
+        if (!(NavGetItemFlags(i) & FAKEMENU_NAV_SEPARATOR))
+            return i;
+    }
+    for (int i = iPage; 0 <= i && i < cItems; i += (bNext ? -1 : 1))
+    {
+        if (!(NavGetItemFlags(i) & FAKEMENU_NAV_SEPARATOR))
+            return i;
+    }
+
+    return -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// FakeMenuHeadless
+
+FakeMenuHeadless::FakeMenuHeadless()
+    : m_pItems(NULL)
+    , m_cItems(0)
+    , m_cItemsMax(0)
+    , m_pParent(NULL)
+    , m_piNextSelectable(NULL)
+    , m_piPrevSelectable(NULL)
+    , m_bOpen(false)
+    , m_pDriver(NULL)
+{
+}
+
+FakeMenuHeadless::~FakeMenuHeadless()
+{
+    for (int iItem = 0; iItem < m_cItems; ++iItem)
+        delete m_pItems[iItem].pSubMenu;
+
+    free(m_pItems);
+    FreeSelectable();
+}
+
+bool FakeMenuHeadless::Grow()
+{
+    if (m_cItems < m_cItemsMax)
+        return true;
+
+    int cItemsMax = (m_cItemsMax ? m_cItemsMax * 2 : 16);
+    auto pItems = (ITEM*)realloc(m_pItems, cItemsMax * sizeof(ITEM));
+    if (!pItems)
+        return false;
+
+    m_pItems = pItems;
+    m_cItemsMax = cItemsMax;
+    return true;
+}
+
+bool FakeMenuHeadless::AddItem(int nID, unsigned fFlags/* = 0*/)
+{
+    if (!Grow())
+        return false;
+
+    ITEM& item = m_pItems[m_cItems++];
+    item.nID = nID;
+    item.fFlags = (fFlags & ~FAKEMENU_NAV_SUBMENU);
+    item.pSubMenu = NULL;
+
+    FreeSelectable();
+    return true;
+}
+
+bool FakeMenuHeadless::AddSubMenu(FakeMenuHeadless* pSubMenu, unsigned fFlags/* = 0*/)
+{
+    if (!pSubMenu || pSubMenu->m_pParent || !Grow())
+        return false;
+
+    ITEM& item = m_pItems[m_cItems++];
+    item.nID = -1;
+    item.fFlags = (fFlags | FAKEMENU_NAV_SUBMENU) & ~FAKEMENU_NAV_SEPARATOR;
+    item.pSubMenu = pSubMenu;
+    pSubMenu->m_pParent = this;
+
+    FreeSelectable();
+    return true;
+}
+
+int FakeMenuHeadless::GetId(int iItem) const
+{
+    if (iItem < 0 || m_cItems <= iItem)
+        return 0;
+    return m_pItems[iItem].nID;
+}
+
+FakeMenuHeadless* FakeMenuHeadless::GetSubMenu(int iItem) const
+{
+    if (iItem < 0 || m_cItems <= iItem)
+        return NULL;
+    return m_pItems[iItem].pSubMenu;
+}
+
+void FakeMenuHeadless::FreeSelectable()
+{
+    free(m_piNextSelectable);
+    free(m_piPrevSelectable);
+    m_piNextSelectable = m_piPrevSelectable = NULL;
+}
+
+// Link each position to the next and the previous selectable ones
+void FakeMenuHeadless::BuildSelectable()
+{
+    m_piPrevSelectable = (int*)malloc(m_cItems * sizeof(int));
+    m_piNextSelectable = (int*)malloc(m_cItems * sizeof(int));
+    if (!m_piPrevSelectable || !m_piNextSelectable)
+    {
+        FreeSelectable();
+        return;
+    }
+
+    int iLast = -1;
+    for (int iTry = 0; iTry < 2 * m_cItems; ++iTry)
+    {
+        int iItem = iTry % m_cItems;
+        m_piPrevSelectable[iItem] = iLast;
+        if (!(m_pItems[iItem].fFlags & FAKEMENU_NAV_SEPARATOR))
+            iLast = iItem;
+    }
+
+    iLast = -1;
+    for (int iTry = 2 * m_cItems - 1; iTry >= 0; --iTry)
+    {
+        int iItem = iTry % m_cItems;
+        m_piNextSelectable[iItem] = iLast;
+        if (!(m_pItems[iItem].fFlags & FAKEMENU_NAV_SEPARATOR))
+            iLast = iItem;
+    }
+}
+
+void FakeMenuHeadless::Open(FakeMenuNavDriver* pDriver, bool fKeyboard)
+{
+    m_pDriver = pDriver;
+    m_bOpen = true;
+    m_iSelected = -1;
+    m_iOpenSubMenu = -1;
+    pDriver->m_pActive = this;
+
+    if (fKeyboard)
+        m_iSelected = NavGetNextSelectable(-1, true);
+}
+
+void FakeMenuHeadless::CloseTree()
+{
+    for (auto pMenu = this; pMenu && pMenu->m_bOpen; )
+    {
+        pMenu->m_bOpen = false;
+        pMenu = pMenu->GetSubMenu(pMenu->m_iOpenSubMenu);
+    }
+}
+
+int FakeMenuHeadless::NavGetCount()
+{
+    return m_cItems;
+}
+
+unsigned FakeMenuHeadless::NavGetItemFlags(int iItem)
+{
+    return m_pItems[iItem].fFlags;
+}
+
+int FakeMenuHeadless::NavGetNextSelectable(int iItem, bool bNext)
+{
+    if (m_cItems <= 0)
+        return -1;
+
+    if (!m_piNextSelectable)
+    {
+        BuildSelectable();
+        if (!m_piNextSelectable)
+            return FakeMenuNav::NavGetNextSelectable(iItem, bNext);
+    }
+
+    if (iItem < 0 || m_cItems <= iItem) // From the edge
+        iItem = (bNext ? m_cItems - 1 : 0);
+
+    return (bNext ? m_piNextSelectable[iItem] : m_piPrevSelectable[iItem]);
+}
+
+bool FakeMenuHeadless::NavIsSubMenuOpen()
+{
+    auto pSubMenu = GetSubMenu(m_iOpenSubMenu);
+    return pSubMenu && pSubMenu->m_bOpen;
+}
+
+FakeMenuNav* FakeMenuHeadless::NavGetParent()
+{
+    return m_pParent;
+}
+
+void FakeMenuHeadless::NavSetCurSel(int iItem, bool /*bEnsureVisible*/)
+{
+    m_iSelected = iItem;
+}
+
+void FakeMenuHeadless::NavOpenSubMenu(int iItem, bool fKeyboard)
+{
+    auto pSubMenu = GetSubMenu(iItem);
+    if (!pSubMenu)
+        return;
+
+    auto pOpen = GetSubMenu(m_iOpenSubMenu);
+    if (pOpen && pOpen != pSubMenu && pOpen->m_bOpen)
+        pOpen->CloseTree(); // Another sub-menu to be hidden
+
+    m_iOpenSubMenu = iItem;
+    pSubMenu->Open(m_pDriver, fKeyboard);
+}
+
+void FakeMenuHeadless::NavClose()
+{
+    CloseTree();
+
+    auto pDriver = m_pDriver;
+    if (pDriver->m_pActive)
+        pDriver->m_pActive = pDriver->m_pActive->m_pParent;
+
+    if (!m_pParent) // Root?
+    {
+        pDriver->m_idResult = 0;
+        pDriver->m_bDone = true;
+    }
+}
+
+void FakeMenuHeadless::NavChoose(int iItem, FakeMenuNav* pRoot)
+{
+    m_pDriver->m_idResult = m_pItems[iItem].nID;
+    m_pDriver->m_bDone = true;
+    static_cast<FakeMenuHeadless*>(pRoot)->CloseTree();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// FakeMenuNavDriver
+
+void FakeMenuNavDriver::Begin(FakeMenuHeadless* pRoot, bool fKeyboard/* = false*/)
+{
+    if (m_pRoot)
+        m_pRoot->CloseTree();
+
+    m_pRoot = pRoot;
+    m_idResult = 0;
+    m_bDone = false;
+    pRoot->Open(this, fKeyboard);
+}
+
+// The open menu at the depth
+FakeMenuHeadless* FakeMenuNavDriver::GetMenuAt(int iLevel) const
+{
+    if (iLevel < 0)
+        return m_pActive;
+
+    auto pMenu = m_pRoot;
+    for (int i = 0; i < iLevel && pMenu; ++i)
+    {
+        if (!pMenu->NavIsSubMenuOpen())
+            return NULL;
+        pMenu = pMenu->GetSubMenu(pMenu->m_iOpenSubMenu);
+    }
+
+    return (pMenu && pMenu->m_bOpen) ? pMenu : NULL;
+}
+
+bool FakeMenuNavDriver::Input(const FAKEMENU_NAV_EVENT& event)
+{
+    if (m_bDone)
+        return false;
+
+    switch (event.nInput)
+    {
+        case FAKEMENU_NAV_BUTTON_DOWN:
+        case FAKEMENU_NAV_BUTTON_UP:
+        {
+            auto pMenu = GetMenuAt(event.iLevel);
+            if (!pMenu)
+                break;
+
+            // The hit test skips the separators and the grayed items
+            int iItem = event.iItem;
+            if (iItem < 0 || pMenu->m_cItems <= iItem ||
+                (pMenu->m_pItems[iItem].fFlags & (FAKEMENU_NAV_SEPARATOR | FAKEMENU_NAV_GRAYED)))
+            {
+                iItem = -1;
+            }
+
+            if (event.nInput == FAKEMENU_NAV_BUTTON_DOWN)
+                pMenu->NavButtonDown(iItem);
+            else
+                pMenu->NavButtonUp(iItem);
+            break;
+        }
+
+        default:
+            if (m_pActive && 0 <= event.nInput && event.nInput < FAKEMENU_NAV_INPUT_MAX)
+                m_pActive->NavKey(event.nInput, event.cRepeat);
+            break;
+    }
+
+    return !m_bDone;
+}
+
+size_t FakeMenuNavDriver::Run(const FAKEMENU_NAV_EVENT* pEvents, size_t cEvents)
+{
+    for (size_t iEvent = 0; iEvent < cEvents; ++iEvent)
+    {
+        if (!Input(pEvents[iEvent]))
+            return iEvent + 1;
+    }
+    return cEvents;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The script
+
+static const struct
+{
+    const char* pszName;
+    int nInput;
+} s_aNavKeywords[] =
+{
+    { "up", FAKEMENU_NAV_UP },
+    { "down", FAKEMENU_NAV_DOWN },
+    { "pgup", FAKEMENU_NAV_PAGE_UP },
+    { "pgdn", FAKEMENU_NAV_PAGE_DOWN },
+    { "home", FAKEMENU_NAV_HOME },
+    { "end", FAKEMENU_NAV_END },
+    { "left", FAKEMENU_NAV_LEFT },
+    { "right", FAKEMENU_NAV_RIGHT },
+    { "return", FAKEMENU_NAV_RETURN },
+    { "enter", FAKEMENU_NAV_RETURN },
+    { "escape", FAKEMENU_NAV_ESCAPE },
+    { "esc", FAKEMENU_NAV_ESCAPE },
+    { "press", FAKEMENU_NAV_BUTTON_DOWN },
+    { "release", FAKEMENU_NAV_BUTTON_UP },
+    { "click", FAKEMENU_NAV_INPUT_MAX }, // press and release
+};
+
+static const char* ParseInt(const char* pch, int* pn)
+{
+    while (isspace((unsigned char)*pch))
+        ++pch;
+
+    char* pchEnd;
+    long n = strtol(pch, &pchEnd, 10);
+    if (pchEnd == pch)
+        return NULL;
+
+    *pn = (int)n;
+    return pchEnd;
+}
+
+// The keys may have the repeat count as "down*3"
+int FakeMenuNav_ParseScript(const char* pszScript, FAKEMENU_NAV_EVENT* pEvents, int cEventsMax)
+{
+    int cEvents = 0;
+    const char* pch = pszScript;
+    for (;;)
+    {
+        while (isspace((unsigned char)*pch))
+            ++pch;
+        if (!*pch)
+            break;
+
+        const char* pchWord = pch;
+        while (isalpha((unsigned char)*pch))
+            ++pch;
+        size_t cchWord = pch - pchWord;
+
+        int nInput = -1;
+        for (size_t i = 0; i < sizeof(s_aNavKeywords) / sizeof(s_aNavKeywords[0]); ++i)
+        {
+            if (strlen(s_aNavKeywords[i].pszName) == cchWord &&
+                memcmp(s_aNavKeywords[i].pszName, pchWord, cchWord) == 0)
+            {
+                nInput = s_aNavKeywords[i].nInput;
+                break;
+            }
+        }
+        if (nInput < 0)
+            return -1; // Unknown
+
+        FAKEMENU_NAV_EVENT event = { nInput, 1, -1, -1 };
+        if (nInput >= FAKEMENU_NAV_BUTTON_DOWN) // "press LEVEL ITEM"
+        {
+            pch = ParseInt(pch, &event.iLevel);
+            if (pch)
+                pch = ParseInt(pch, &event.iItem);
+            if (!pch)
+                return -1;
+        }
+        else if (*pch == '*') // The repeat count
+        {
+            pch = ParseInt(pch + 1, &event.cRepeat);
+            if (!pch)
+                return -1;
+        }
+
+        if (nInput == FAKEMENU_NAV_INPUT_MAX) // click
+        {
+            if (cEvents + 2 > cEventsMax)
+                return -1;
+            event.nInput = FAKEMENU_NAV_BUTTON_DOWN;
+            pEvents[cEvents++] = event;
+            event.nInput = FAKEMENU_NAV_BUTTON_UP;
+            pEvents[cEvents++] = event;
+        }
+        else
+        {
+            if (cEvents + 1 > cEventsMax)
+                return -1;
+            pEvents[cEvents++] = event;
+        }
+    }
+
+    return cEvents;
+}
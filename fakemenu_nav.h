@@ -0,0 +1,155 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     The navigation state machine of FakeMenu (portable)
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#pragma once
+
+#include <stddef.h>
+
+// The flags of FakeMenuNav::NavGetItemFlags
+#define FAKEMENU_NAV_SEPARATOR 0x1
+#define FAKEMENU_NAV_GRAYED 0x2
+#define FAKEMENU_NAV_SUBMENU 0x4
+
+// The abstract inputs
+enum FAKEMENU_NAV_INPUT
+{
+    FAKEMENU_NAV_UP,
+    FAKEMENU_NAV_DOWN,
+    FAKEMENU_NAV_PAGE_UP,
+    FAKEMENU_NAV_PAGE_DOWN,
+    FAKEMENU_NAV_HOME,
+    FAKEMENU_NAV_END,
+    FAKEMENU_NAV_LEFT,
+    FAKEMENU_NAV_RIGHT,
+    FAKEMENU_NAV_RETURN,
+    FAKEMENU_NAV_ESCAPE,
+    FAKEMENU_NAV_BUTTON_DOWN,   // On iItem of the menu at iLevel
+    FAKEMENU_NAV_BUTTON_UP,     // On iItem of the menu at iLevel
+    FAKEMENU_NAV_INPUT_MAX
+};
+
+struct FAKEMENU_NAV_EVENT
+{
+    int nInput;     // FAKEMENU_NAV_...
+    int cRepeat;    // The repeat count of the keys
+    int iLevel;     // The buttons: the depth of the menu (0 for root). -1 for the active one
+    int iItem;      // The buttons: the item position under the mouse, or -1
+};
+
+// The selection, the sub-menu and the choice of a menu, apart from the windows.
+// The derived class is the model and the view of the menu.
+class FakeMenuNav
+{
+public:
+    FakeMenuNav() : m_iSelected(-1), m_iOpenSubMenu(-1) { }
+    virtual ~FakeMenuNav() { }
+
+    void NavKey(int nInput, int cRepeat);
+    bool NavButtonDown(int iItem);
+    void NavButtonUp(int iItem);
+    void NavReturn();
+    void NavRight();
+
+protected:
+    int m_iSelected;        // The selected index
+    int m_iOpenSubMenu;     // The index to the sub menu that is open
+
+    void NavChooseItem(int iItem);
+
+    // The model
+    virtual int NavGetCount() = 0;
+    virtual unsigned NavGetItemFlags(int iItem) = 0;
+    virtual int NavGetNextSelectable(int iItem, bool bNext);
+    virtual int NavGetPageItem(int iItem, bool bNext);
+    virtual bool NavIsSubMenuOpen() = 0;    // Is the sub-menu of m_iOpenSubMenu shown?
+    virtual FakeMenuNav* NavGetParent() = 0;
+
+    // The view
+    virtual void NavSetCurSel(int iItem, bool bEnsureVisible) = 0;
+    virtual void NavOpenSubMenu(int iItem, bool fKeyboard) = 0;
+    virtual void NavClose() = 0;            // By Escape or Left
+    virtual void NavChoose(int iItem, FakeMenuNav* pRoot) = 0; // Hide the tree from pRoot
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The headless menus for the scripted input
+
+class FakeMenuNavDriver;
+
+class FakeMenuHeadless : public FakeMenuNav
+{
+public:
+    FakeMenuHeadless();
+    virtual ~FakeMenuHeadless(); // Deletes the sub-menus
+
+    bool AddItem(int nID, unsigned fFlags = 0);
+    bool AddSubMenu(FakeMenuHeadless* pSubMenu, unsigned fFlags = 0); // Takes the ownership
+    int GetCount() const { return m_cItems; }
+    int GetId(int iItem) const;
+    FakeMenuHeadless* GetSubMenu(int iItem) const;
+    bool IsOpen() const { return m_bOpen; }
+
+protected:
+    friend class FakeMenuNavDriver;
+
+    struct ITEM
+    {
+        int nID;
+        unsigned fFlags;
+        FakeMenuHeadless* pSubMenu;
+    };
+    ITEM* m_pItems;
+    int m_cItems;
+    int m_cItemsMax;
+    FakeMenuHeadless* m_pParent;
+    int* m_piNextSelectable;    // Built on demand
+    int* m_piPrevSelectable;
+    bool m_bOpen;
+    FakeMenuNavDriver* m_pDriver;
+
+    bool Grow();
+    void BuildSelectable();
+    void FreeSelectable();
+    void Open(FakeMenuNavDriver* pDriver, bool fKeyboard);
+    void CloseTree();
+
+    virtual int NavGetCount();
+    virtual unsigned NavGetItemFlags(int iItem);
+    virtual int NavGetNextSelectable(int iItem, bool bNext);
+    virtual bool NavIsSubMenuOpen();
+    virtual FakeMenuNav* NavGetParent();
+    virtual void NavSetCurSel(int iItem, bool bEnsureVisible);
+    virtual void NavOpenSubMenu(int iItem, bool fKeyboard);
+    virtual void NavClose();
+    virtual void NavChoose(int iItem, FakeMenuNav* pRoot);
+};
+
+// Tracks a headless tree like FakeMenu_TrackPopup with the scripted input
+class FakeMenuNavDriver
+{
+public:
+    FakeMenuNavDriver() : m_pRoot(NULL), m_pActive(NULL), m_idResult(0), m_bDone(true) { }
+
+    void Begin(FakeMenuHeadless* pRoot, bool fKeyboard = false);
+    bool Input(const FAKEMENU_NAV_EVENT& event);    // Returns false if done
+    size_t Run(const FAKEMENU_NAV_EVENT* pEvents, size_t cEvents); // Returns the # of consumed
+    bool IsDone() const { return m_bDone; }
+    int GetResult() const { return m_idResult; } // The chosen ID, or zero
+    FakeMenuHeadless* GetActive() const { return m_pActive; }
+    FakeMenuHeadless* GetMenuAt(int iLevel) const;
+
+protected:
+    friend class FakeMenuHeadless;
+
+    FakeMenuHeadless* m_pRoot;
+    FakeMenuHeadless* m_pActive;    // Gets the keys
+    int m_idResult;
+    bool m_bDone;
+};
+
+// Parse the script such as "down down right return" or "press 0 3 release 0 3".
+// Returns the number of the events, or -1 on error
+int FakeMenuNav_ParseScript(const char* pszScript, FAKEMENU_NAV_EVENT* pEvents, int cEventsMax);
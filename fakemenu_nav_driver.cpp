@@ -0,0 +1,171 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     The headless driver of the FakeMenu navigation (portable)
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#include "fakemenu_nav.h"
+#include "fakemenu_gen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+// Usage: fakemenu_nav_driver [--items N] [--depth D] [--iterations N] [--keyboard]
+//                            [--expect ID] (--script "SCRIPT" | --script-file FILE)
+// Replays the script against a generated tree again and again and reports the result.
+// Exits with 1 if the result is not the expected one.
+
+#define DRIVER_MAX_EVENTS 65536
+#define DRIVER_MAX_SCRIPT 65536
+
+// Builds the headless menus with FakeMenuGen_Build
+struct HEADLESS_BUILDER
+{
+    typedef FakeMenuHeadless* Menu;
+
+    FakeMenuHeadless* NewMenu()
+    {
+        return new FakeMenuHeadless();
+    }
+
+    void AddSeparator(FakeMenuHeadless* pMenu)
+    {
+        pMenu->AddItem(0, FAKEMENU_NAV_SEPARATOR);
+    }
+
+    void AddItem(FakeMenuHeadless* pMenu, int nID, bool bGrayed, bool /*bChecked*/)
+    {
+        pMenu->AddItem(nID, bGrayed ? FAKEMENU_NAV_GRAYED : 0);
+    }
+
+    void AddSubMenu(FakeMenuHeadless* pMenu, FakeMenuHeadless* pSubMenu, int /*nID*/, bool bGrayed)
+    {
+        pMenu->AddSubMenu(pSubMenu, bGrayed ? FAKEMENU_NAV_GRAYED : 0);
+    }
+};
+
+// The tree of fakemenu_bench, with every 7th ID grayed to test the skipping
+static FakeMenuHeadless* BuildTree(int nItems, int nDepth)
+{
+    HEADLESS_BUILDER builder;
+    FAKEMENU_GEN_OPTIONS options = { 7, 0 };
+    return FakeMenuGen_Build(builder, nItems, nDepth, options);
+}
+
+static bool LoadScript(const char* pszFileName, char* pszScript, size_t cchScript)
+{
+    FILE* fp = fopen(pszFileName, "rb");
+    if (!fp)
+        return false;
+
+    size_t cch = fread(pszScript, 1, cchScript - 1, fp);
+    pszScript[cch] = 0;
+    fclose(fp);
+
+    // Strip the comments ('#' to the end of line)
+    for (char* pch = pszScript; *pch; ++pch)
+    {
+        if (*pch == '#')
+        {
+            while (*pch && *pch != '\n')
+                *pch++ = ' ';
+            if (!*pch)
+                break;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int nItems = 1000, nDepth = 4, cIterations = 1000000, idExpected = -1;
+    bool fKeyboard = false;
+    static char s_szScript[DRIVER_MAX_SCRIPT] = "";
+
+    for (int iarg = 1; iarg < argc; ++iarg)
+    {
+        const char* pszArg = argv[iarg];
+        const char* pszValue = (iarg + 1 < argc) ? argv[iarg + 1] : NULL;
+        if (strcmp(pszArg, "--keyboard") == 0)
+        {
+            fKeyboard = true;
+            continue;
+        }
+
+        if (!pszValue)
+        {
+            fprintf(stderr, "fakemenu_nav_driver: %s needs a value\n", pszArg);
+            return 2;
+        }
+        ++iarg;
+
+        if (strcmp(pszArg, "--items") == 0)
+            nItems = atoi(pszValue);
+        else if (strcmp(pszArg, "--depth") == 0)
+            nDepth = atoi(pszValue);
+        else if (strcmp(pszArg, "--iterations") == 0)
+            cIterations = atoi(pszValue);
+        else if (strcmp(pszArg, "--expect") == 0)
+            idExpected = atoi(pszValue);
+        else if (strcmp(pszArg, "--script") == 0)
+            snprintf(s_szScript, sizeof(s_szScript), "%s", pszValue);
+        else if (strcmp(pszArg, "--script-file") == 0)
+        {
+            if (!LoadScript(pszValue, s_szScript, sizeof(s_szScript)))
+            {
+                fprintf(stderr, "fakemenu_nav_driver: cannot read %s\n", pszValue);
+                return 2;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "fakemenu_nav_driver: unknown option %s\n", pszArg);
+            return 2;
+        }
+    }
+
+    if (nItems < 1 || nDepth < 1 || cIterations < 1)
+    {
+        fprintf(stderr, "fakemenu_nav_driver: invalid size\n");
+        return 2;
+    }
+
+    static FAKEMENU_NAV_EVENT s_aEvents[DRIVER_MAX_EVENTS];
+    int cEvents = FakeMenuNav_ParseScript(s_szScript, s_aEvents, DRIVER_MAX_EVENTS);
+    if (cEvents <= 0)
+    {
+        fprintf(stderr, "fakemenu_nav_driver: bad or empty script\n");
+        return 2;
+    }
+
+    FakeMenuHeadless* pRoot = BuildTree(nItems, nDepth);
+    FakeMenuNavDriver driver;
+
+    int idResult = 0;
+    size_t cConsumed = 0;
+    unsigned long long cTotalEvents = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int iIteration = 0; iIteration < cIterations; ++iIteration)
+    {
+        driver.Begin(pRoot, fKeyboard);
+        cConsumed = driver.Run(s_aEvents, (size_t)cEvents);
+        cTotalEvents += cConsumed;
+        idResult = driver.GetResult();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+    double seconds = elapsed.count();
+    printf("result=%d done=%d events=%d consumed=%u iterations=%d seconds=%.3f events_per_sec=%.0f\n",
+           idResult, (int)driver.IsDone(), cEvents, (unsigned)cConsumed, cIterations, seconds,
+           (seconds > 0) ? cTotalEvents / seconds : 0.0);
+
+    delete pRoot;
+
+    if (idExpected >= 0 && idResult != idExpected)
+    {
+        fprintf(stderr, "fakemenu_nav_driver: expected %d but got %d\n", idExpected, idResult);
+        return 1;
+    }
+    return 0;
+}
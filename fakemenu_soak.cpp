@@ -0,0 +1,747 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     The open/close soak test of FakeMenu with the handle-leak detection
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#include <windows.h>
+#include <psapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#if defined(_MSC_VER) && defined(_DEBUG)
+    #include <crtdbg.h>
+#endif
+#include "fakemenu.h"
+#include "fakemenu_gen.h"
+
+// Usage: fakemenu_soak [--quick] [--cycles N] [--items N] [--depth D] [--sample N]
+//                      [--warmup N] [--max-gdi N] [--max-user N] [--max-heap KB] [--reopen N]
+//                      [--threads N] [--thread-cycles N] [--owner-data N]
+// Builds, tracks with the scripted keys and destroys a tree again and again.
+// The GDI objects, the USER objects and the private bytes are sampled every --sample cycles.
+// Exits with 1 if they grow more than the limits after --warmup cycles, or if a tracking
+// doesn't end within SOAK_MAX_PUMPS pumps (stuck).
+// Then does the same on --threads threads at once, --thread-cycles times each.
+// Exits with 1 if a thread cannot track, if the threads never track at the same time,
+// if a tracking is stuck, or if they hang.
+// Then reopens a prepared tree --reopen times. Exits with 1 if the library allocates
+// or creates GDI objects there. The allocations are counted by the hooks of this program
+// (operator new, and malloc of the debug CRT of MSVC), and by FAKEMENU_ENABLE_STATS if built.
+// Then tracks an owner-data menu of --owner-data rows. Exits with 1 if End and Return or
+// a click near the end chooses a wrong row, if the navigation allocates, or if the tree
+// takes more heap than SOAK_OWNERDATA_MAX_HEAP.
+// Then runs SOAK_FRAMES frames of a host loop with an asynchronous menu that gets a key every
+// frame. Exits with 1 if a frame takes more than SOAK_MAX_FRAME_TIME or the tracking ends.
+// Then chooses an item with the real Down and Return keys (SendInput) over a host window.
+// Exits with 1 if the host gets the key-up of Return, or doesn't get it without the menu.
+// Runs unattended, also under Wine (wine fakemenu_soak.exe --quick).
+
+#define SOAK_HOVER_DELAY 60000  // Don't open the sub-menus by hovering
+#define SOAK_MAX_PUMPS 1000     // Cancel the tracking if the script didn't end it
+#define SOAK_MAX_THREADS MAXIMUM_WAIT_OBJECTS
+#define SOAK_THREAD_TIMEOUT 50  // The time limit of a cycle of the threads, in milliseconds
+#define SOAK_OWNERDATA_NAVS 50  // The End and Home pairs of the owner-data menu
+#define SOAK_OWNERDATA_MAX_HEAP (256 * 1024) // The heap bytes of the owner-data tree
+#define SOAK_FRAMES 120
+#define SOAK_FRAME_TIME 16      // The frame of the host loop, in milliseconds
+#define SOAK_MAX_FRAME_TIME 100 // The limit of a frame with the menu, in milliseconds
+#define SOAK_KEY_WAIT 200       // The wait for the sent keys, in milliseconds
+#define SOAK_HOST_CLASS L"FakeMenu Soak Host"
+
+static INT s_cCycles = 200000;
+static INT s_nItems = 200;
+static INT s_nDepth = 3;
+static INT s_cSample = 1000;
+static INT s_cWarmup = 2000;
+static LONG s_cMaxGdi = 4;
+static LONG s_cMaxUser = 4;
+static LONG s_cMaxHeapKB = 4096;
+static INT s_cReopen = 1000;
+static INT s_cThreads = 4;
+static INT s_cThreadCycles = 5000;
+static INT s_cOwnerData = 1000000;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The allocation hooks
+
+static volatile LONG s_bCountAllocations = FALSE;
+static volatile LONG s_cAllocations = 0;
+
+static inline VOID CountAllocation(VOID)
+{
+    if (s_bCountAllocations)
+        InterlockedIncrement(&s_cAllocations);
+}
+
+void *operator new(size_t cb)
+{
+    CountAllocation();
+    void *pv = malloc(cb ? cb : 1);
+    if (!pv)
+        throw std::bad_alloc();
+    return pv;
+}
+
+void *operator new[](size_t cb)
+{
+    return operator new(cb);
+}
+
+void *operator new(size_t cb, const std::nothrow_t&) noexcept
+{
+    CountAllocation();
+    return malloc(cb ? cb : 1);
+}
+
+void *operator new[](size_t cb, const std::nothrow_t& tag) noexcept
+{
+    return operator new(cb, tag);
+}
+
+void operator delete(void *pv) noexcept
+{
+    free(pv);
+}
+
+void operator delete[](void *pv) noexcept
+{
+    free(pv);
+}
+
+void operator delete(void *pv, size_t) noexcept
+{
+    free(pv);
+}
+
+void operator delete[](void *pv, size_t) noexcept
+{
+    free(pv);
+}
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+// malloc, realloc and _wcsdup of the library
+static int __cdecl OnCrtAlloc(int nAllocType, void *pvData, size_t nSize, int nBlockUse,
+                              long lRequest, const unsigned char *szFileName, int nLine)
+{
+    if (nAllocType != _HOOK_FREE && nBlockUse != _CRT_BLOCK)
+        CountAllocation();
+    return TRUE;
+}
+#endif
+
+static VOID BeginCountAllocations(VOID)
+{
+#if defined(_MSC_VER) && defined(_DEBUG)
+    _CrtSetAllocHook(OnCrtAlloc);
+#endif
+    s_cAllocations = 0;
+    InterlockedExchange(&s_bCountAllocations, TRUE);
+}
+
+static LONG EndCountAllocations(VOID)
+{
+    InterlockedExchange(&s_bCountAllocations, FALSE);
+#if defined(_MSC_VER) && defined(_DEBUG)
+    _CrtSetAllocHook(NULL);
+#endif
+    return s_cAllocations;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The tracking
+
+static FAKEMENU_GEN_TRACK s_track;
+
+// Pump until the tracking ends. Cancel it if it doesn't
+static VOID WaitForTrack(HFAKEMENU hFakeMenu, FAKEMENU_GEN_TRACK *pTrack)
+{
+    for (INT iPump = 0; FakeMenuGen_IsTracking(pTrack) && iPump < SOAK_MAX_PUMPS; ++iPump)
+    {
+        if (iPump == SOAK_MAX_PUMPS / 2)
+            FakeMenu_Cancel(hFakeMenu);
+        MsgWaitForMultipleObjects(0, NULL, FALSE, 1, QS_ALLINPUT);
+        FakeMenuGen_PumpMessages();
+    }
+}
+
+// The scripts: choose an item in a sub-menu, escape, or FakeMenu_Cancel
+static VOID RunScript(HFAKEMENU hFakeMenu, FAKEMENU_GEN_TRACK *pTrack, INT iCycle)
+{
+    HWND hwnd = FakeMenuGen_FindMenuWindow();
+    if (hwnd)
+    {
+        switch (iCycle % 3)
+        {
+            case 0:
+                FakeMenuGen_PostKey(hwnd, VK_DOWN);
+                FakeMenuGen_PostKey(hwnd, VK_RIGHT);
+                FakeMenuGen_PostKey(hwnd, VK_DOWN);
+                FakeMenuGen_PostKey(hwnd, VK_RETURN);
+                break;
+            case 1:
+                FakeMenuGen_PostKey(hwnd, VK_END);
+                FakeMenuGen_PostKey(hwnd, VK_RIGHT);
+                FakeMenuGen_PostKey(hwnd, VK_ESCAPE);
+                FakeMenuGen_PostKey(hwnd, VK_ESCAPE);
+                break;
+            default:
+                FakeMenuGen_PostKey(hwnd, VK_NEXT);
+                FakeMenu_Cancel(hFakeMenu);
+                break;
+        }
+    }
+
+    WaitForTrack(hFakeMenu, pTrack);
+}
+
+// Track, navigate, choose or cancel, and hide
+static BOOL TrackCycle(HFAKEMENU hFakeMenu, FAKEMENU_GEN_TRACK *pTrack, INT iCycle)
+{
+    POINT pt = { 10, 10 };
+    if (!FakeMenuGen_BeginTrack(hFakeMenu, pTrack, pt))
+        return FALSE;
+    FakeMenuGen_PumpMessages();
+
+    RunScript(hFakeMenu, pTrack, iCycle);
+    return !FakeMenuGen_IsTracking(pTrack);
+}
+
+// Build, track and destroy
+static BOOL RunCycle(HMENU hMenu, FAKEMENU_GEN_TRACK *pTrack, INT iCycle)
+{
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    if (!hFakeMenu)
+        return FALSE;
+
+    // The fonts of the sub-menus
+    if (iCycle % 4 == 0)
+    {
+        LOGFONTW lf;
+        GetObjectW(GetStockObject(DEFAULT_GUI_FONT), sizeof(lf), &lf);
+        lf.lfHeight = -12 - (iCycle / 4) % 4;
+        FakeMenu_SetLogFont(hFakeMenu, &lf);
+    }
+
+    BOOL bDone = TrackCycle(hFakeMenu, pTrack, iCycle);
+
+    FakeMenu_Destroy(hFakeMenu);
+    FakeMenuGen_PumpMessages(); // The trees destroyed after the animations
+    return bDone;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The concurrent tracking
+
+struct SOAK_THREAD
+{
+    INT cCycles;
+    INT cStuck;
+    INT cFailed;    // The cycles that could not build or track the tree
+};
+
+static volatile LONG s_cTracking = 0;       // The threads tracking now
+static volatile LONG s_cMaxTracking = 0;    // The peak of s_cTracking
+
+static DWORD WINAPI SoakThreadProc(LPVOID pParam)
+{
+    SOAK_THREAD *pThread = (SOAK_THREAD *)pParam;
+    HMENU hMenu = FakeMenuGen_BuildMenu(s_nItems, s_nDepth, 5);
+    FAKEMENU_GEN_TRACK track;
+
+    for (INT iCycle = 0; iCycle < s_cThreadCycles; ++iCycle)
+    {
+        HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+        POINT pt = { 10, 10 };
+        if (!hFakeMenu || !FakeMenuGen_BeginTrack(hFakeMenu, &track, pt))
+        {
+            ++pThread->cFailed;
+            if (hFakeMenu)
+                FakeMenu_Destroy(hFakeMenu);
+            continue;
+        }
+
+        LONG cTracking = InterlockedIncrement(&s_cTracking), cMax;
+        while ((cMax = s_cMaxTracking) < cTracking &&
+               InterlockedCompareExchange(&s_cMaxTracking, cTracking, cMax) != cMax)
+        {
+            ;
+        }
+
+        FakeMenuGen_PumpMessages();
+        RunScript(hFakeMenu, &track, iCycle);
+        if (FakeMenuGen_IsTracking(&track))
+            ++pThread->cStuck;
+        InterlockedDecrement(&s_cTracking);
+
+        FakeMenu_Destroy(hFakeMenu);
+        FakeMenuGen_PumpMessages();
+        ++pThread->cCycles;
+    }
+
+    DestroyMenu(hMenu);
+    return 0;
+}
+
+// Track the trees of s_cThreads threads at the same time. Returns FALSE on failure
+static BOOL CheckThreads(VOID)
+{
+    static SOAK_THREAD s_aThreads[SOAK_MAX_THREADS];
+    HANDLE ahThreads[SOAK_MAX_THREADS];
+    INT cThreads = 0;
+    for (INT iThread = 0; iThread < s_cThreads; ++iThread)
+    {
+        ahThreads[cThreads] = CreateThread(NULL, 0, SoakThreadProc, &s_aThreads[cThreads], 0, NULL);
+        if (ahThreads[cThreads])
+            ++cThreads;
+    }
+
+    DWORD dwTimeout = max(60000, s_cThreadCycles * SOAK_THREAD_TIMEOUT);
+    if (WaitForMultipleObjects(cThreads, ahThreads, TRUE, dwTimeout) != WAIT_OBJECT_0)
+    {
+        printf("FAIL threads=%d hung\n", cThreads);
+        fflush(stdout);
+        ExitProcess(1); // The threads still use the library
+    }
+
+    INT cCycles = 0, cStuck = 0, cFailed = 0;
+    for (INT iThread = 0; iThread < cThreads; ++iThread)
+    {
+        CloseHandle(ahThreads[iThread]);
+        cCycles += s_aThreads[iThread].cCycles;
+        cStuck += s_aThreads[iThread].cStuck;
+        cFailed += s_aThreads[iThread].cFailed;
+    }
+
+    printf("threads=%d cycles=%d stuck=%d failed=%d max_concurrent=%ld\n",
+           cThreads, cCycles, cStuck, cFailed, s_cMaxTracking);
+    return cThreads == s_cThreads && cFailed == 0 && cStuck == 0 &&
+           (cThreads < 2 || s_cMaxTracking >= 2);
+}
+
+// The steady state: reopening a prepared tree allocates nothing. Returns FALSE on failure
+static BOOL CheckReopen(HMENU hMenu)
+{
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    if (!hFakeMenu)
+        return FALSE;
+
+    // The first trackings create the windows, measure the items and build the caches
+    for (INT iCycle = 0; iCycle < 3; ++iCycle)
+        TrackCycle(hFakeMenu, &s_track, iCycle);
+
+    // The counters of the library, if built with them
+    FAKEMENU_STATS before = { sizeof(before) }, after = { sizeof(after) };
+    BOOL bStats = FakeMenu_GetStats(NULL, &before);
+    LONG cGdiBefore = (LONG)GetGuiResources(GetCurrentProcess(), GR_GDIOBJECTS);
+
+    BeginCountAllocations();
+    for (INT iCycle = 0; iCycle < s_cReopen; ++iCycle)
+        TrackCycle(hFakeMenu, &s_track, iCycle);
+    ULONGLONG cAllocations = EndCountAllocations();
+
+    LONG cGdiGrowth = (LONG)GetGuiResources(GetCurrentProcess(), GR_GDIOBJECTS) - cGdiBefore;
+    ULONGLONG cGdiObjects = 0, cMeasured = 0;
+    if (bStats && FakeMenu_GetStats(NULL, &after))
+    {
+        cAllocations += after.cAllocations - before.cAllocations;
+        cGdiObjects = after.cGdiObjectsCreated - before.cGdiObjectsCreated;
+        cMeasured = after.cItemsMeasured - before.cItemsMeasured;
+    }
+    FakeMenu_Destroy(hFakeMenu);
+    FakeMenuGen_PumpMessages();
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+    const char *pszHooks = (bStats ? "new,crt,stats" : "new,crt");
+#else
+    const char *pszHooks = (bStats ? "new,stats" : "new");
+#endif
+    printf("reopen=%d allocations=%llu gdi_created=%llu gdi_growth=%ld items_measured=%llu hooks=%s\n",
+           s_cReopen, cAllocations, cGdiObjects, cGdiGrowth, cMeasured, pszHooks);
+    return cAllocations == 0 && cGdiObjects == 0 && cGdiGrowth <= 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The owner data
+
+// The row iItem has the ID iItem + 1
+static BOOL CALLBACK SoakDataProc(HFAKEMENU hFakeMenu, FAKEMENU_OWNERDATA_ITEM *pItem, LPVOID pContext)
+{
+    ++*(LONG *)pContext;
+    pItem->nID = pItem->iItem + 1;
+    wsprintfW(pItem->pszText, L"Row &%d", pItem->iItem);
+    return TRUE;
+}
+
+// Track the rows, run the script and wait. Returns the chosen ID
+static INT TrackRows(HFAKEMENU hFakeMenu, BOOL bClick, LONG *pcAllocations)
+{
+    POINT pt = { 10, 10 };
+    if (!FakeMenuGen_BeginTrack(hFakeMenu, &s_track, pt))
+        return -1;
+    FakeMenuGen_PumpMessages();
+
+    HWND hwnd = FakeMenuGen_FindMenuWindow();
+    if (hwnd && pcAllocations)
+    {
+        // The slots of the cache are filled once. Then the fetches refill them in place
+        FakeMenuGen_PostKey(hwnd, VK_END);
+        FakeMenuGen_PostKey(hwnd, VK_HOME);
+
+        BeginCountAllocations();
+        for (INT iNav = 0; iNav < SOAK_OWNERDATA_NAVS; ++iNav)
+        {
+            FakeMenuGen_PostKey(hwnd, VK_END);
+            FakeMenuGen_PostKey(hwnd, VK_HOME);
+        }
+        *pcAllocations = EndCountAllocations();
+    }
+
+    if (hwnd)
+    {
+        FakeMenuGen_PostKey(hwnd, VK_END);
+        if (bClick) // The hit test of the scrolled rows
+        {
+            RECT rc;
+            GetClientRect(hwnd, &rc);
+            LPARAM lParam = MAKELPARAM(rc.right / 2, rc.bottom / 2);
+            PostMessageW(hwnd, WM_MOUSEMOVE, 0, lParam);
+            PostMessageW(hwnd, WM_LBUTTONDOWN, MK_LBUTTON, lParam);
+            PostMessageW(hwnd, WM_LBUTTONUP, 0, lParam);
+            FakeMenuGen_PumpMessages();
+        }
+        else
+        {
+            FakeMenuGen_PostKey(hwnd, VK_RETURN);
+        }
+    }
+
+    WaitForTrack(hFakeMenu, &s_track);
+    return FakeMenuGen_IsTracking(&s_track) ? -1 : s_track.idResult;
+}
+
+// The owner data of s_cOwnerData rows fetches and keeps a few of them. Returns FALSE on failure
+static BOOL CheckOwnerData(VOID)
+{
+    HFAKEMENU hFakeMenu = FakeMenu_Create();
+    LONG cFetched = 0;
+    if (!hFakeMenu || !FakeMenu_SetOwnerData(hFakeMenu, s_cOwnerData, SoakDataProc, 0, &cFetched))
+    {
+        FakeMenu_Destroy(hFakeMenu);
+        return FALSE;
+    }
+
+    LONG cAllocations = -1;
+    INT idReturn = TrackRows(hFakeMenu, FALSE, &cAllocations);
+    INT idClick = TrackRows(hFakeMenu, TRUE, NULL);
+
+    FAKEMENU_MEMORY memory = { sizeof(memory) };
+    BOOL bMemory = FakeMenu_GetMemoryUsage(hFakeMenu, &memory);
+
+    FakeMenu_Destroy(hFakeMenu);
+    FakeMenuGen_PumpMessages();
+
+    // The click is on a row shown at the end
+    BOOL bClickOK = (s_cOwnerData - 1000 < idClick && idClick <= s_cOwnerData);
+    printf("owner_data rows=%d end_return=%d click=%d fetched=%ld nav_allocations=%ld heap_kb=%lu\n",
+           s_cOwnerData, idReturn, idClick, cFetched, cAllocations,
+           (ULONG)(memory.cbHeap / 1024));
+    return idReturn == s_cOwnerData && bClickOK && cAllocations == 0 &&
+           bMemory && memory.cbHeap <= SOAK_OWNERDATA_MAX_HEAP;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The host frames
+
+// The asynchronous tracking keeps the frames of the host loop. Returns FALSE on failure
+static BOOL CheckHostFrames(HMENU hMenu)
+{
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    POINT pt = { 10, 10 };
+    if (!hFakeMenu)
+        return FALSE;
+    if (!FakeMenuGen_BeginTrack(hFakeMenu, &s_track, pt))
+    {
+        FakeMenu_Destroy(hFakeMenu);
+        return FALSE;
+    }
+    FakeMenuGen_PumpMessages();
+
+    static LONGLONG s_aqwFrames[SOAK_FRAMES];
+    HWND hwnd = FakeMenuGen_FindMenuWindow();
+    if (hwnd)
+        FakeMenuGen_RunFrames(hwnd, s_aqwFrames, SOAK_FRAMES, SOAK_FRAME_TIME);
+    BOOL bTracking = FakeMenuGen_IsTracking(&s_track);
+
+    FakeMenuGen_EndTrack(hFakeMenu, &s_track);
+    FakeMenu_Destroy(hFakeMenu);
+    FakeMenuGen_PumpMessages();
+
+    LARGE_INTEGER liFreq;
+    QueryPerformanceFrequency(&liFreq);
+    LONGLONG qwMax = 0;
+    for (INT iFrame = 0; hwnd && iFrame < SOAK_FRAMES; ++iFrame)
+        qwMax = max(qwMax, s_aqwFrames[iFrame]);
+    double msMax = (double)qwMax * 1000 / liFreq.QuadPart;
+
+    printf("host_frames frames=%d ms_frame=%d ms_frame_max=%.1f tracking=%d\n",
+           SOAK_FRAMES, SOAK_FRAME_TIME, msMax, bTracking);
+    return hwnd && bTracking && msMax <= SOAK_MAX_FRAME_TIME;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The key-ups of the host
+
+static INT s_cHostKeyUps = 0;   // The key-ups of Return that the host got
+
+static LRESULT CALLBACK SoakHostProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    if (uMsg == WM_KEYUP && wParam == VK_RETURN)
+        ++s_cHostKeyUps;
+    return DefWindowProcW(hwnd, uMsg, wParam, lParam);
+}
+
+static VOID SendKey(WORD vk, BOOL bUp)
+{
+    INPUT input;
+    ZeroMemory(&input, sizeof(input));
+    input.type = INPUT_KEYBOARD;
+    input.ki.wVk = vk;
+    input.ki.dwFlags = (bUp ? KEYEVENTF_KEYUP : 0);
+    SendInput(1, &input, sizeof(input));
+}
+
+// Keep the low-level hooks and the timers working for a while
+static VOID PumpFor(DWORD dwTimeout)
+{
+    DWORD dwStart = GetTickCount();
+    for (;;)
+    {
+        FakeMenuGen_PumpMessages();
+        DWORD dwElapsed = GetTickCount() - dwStart;
+        if (dwElapsed >= dwTimeout)
+            break;
+        MsgWaitForMultipleObjects(0, NULL, FALSE, dwTimeout - dwElapsed, QS_ALLINPUT);
+    }
+}
+
+// Return chooses the item and its key-up doesn't reach the host. Returns FALSE on failure
+static BOOL CheckKeyUp(VOID)
+{
+    WNDCLASSEXW wc = { sizeof(wc) };
+    wc.lpfnWndProc = SoakHostProc;
+    wc.hInstance = GetModuleHandleW(NULL);
+    wc.lpszClassName = SOAK_HOST_CLASS;
+    RegisterClassExW(&wc);
+
+    HWND hwndHost = CreateWindowExW(0, SOAK_HOST_CLASS, SOAK_HOST_CLASS, WS_POPUP | WS_VISIBLE,
+                                    0, 0, 100, 100, NULL, NULL, wc.hInstance, NULL);
+    if (!hwndHost)
+        return FALSE;
+    SetForegroundWindow(hwndHost);
+    SetFocus(hwndHost);
+    PumpFor(SOAK_KEY_WAIT);
+
+    // Without the menu, the host gets the key-up
+    SendKey(VK_RETURN, FALSE);
+    SendKey(VK_RETURN, TRUE);
+    PumpFor(SOAK_KEY_WAIT);
+    INT cKeyUpsAlone = s_cHostKeyUps;
+
+    // "Item 1" of a flat tree
+    HMENU hMenu = FakeMenuGen_BuildMenu(10, 1);
+    HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
+    POINT pt = { 10, 10 };
+    BOOL bTracked = (hFakeMenu && FakeMenuGen_BeginTrack(hFakeMenu, &s_track, pt));
+    INT idResult = 0, cKeyUps = 0;
+    if (bTracked)
+    {
+        PumpFor(SOAK_KEY_WAIT);
+        s_cHostKeyUps = 0;
+        SendKey(VK_DOWN, FALSE);
+        SendKey(VK_DOWN, TRUE);
+        PumpFor(SOAK_KEY_WAIT);
+        SendKey(VK_RETURN, FALSE);
+        PumpFor(SOAK_KEY_WAIT); // The tracking ends before the key-up
+        SendKey(VK_RETURN, TRUE);
+        PumpFor(SOAK_KEY_WAIT);
+        cKeyUps = s_cHostKeyUps;
+
+        if (FakeMenuGen_IsTracking(&s_track))
+            FakeMenuGen_EndTrack(hFakeMenu, &s_track);
+        idResult = s_track.idResult;
+    }
+    FakeMenu_Destroy(hFakeMenu);
+    DestroyMenu(hMenu);
+    DestroyWindow(hwndHost);
+    FakeMenuGen_PumpMessages();
+
+    printf("key_up alone=%d result=%d host_key_ups=%d\n", cKeyUpsAlone, idResult, cKeyUps);
+    return cKeyUpsAlone == 1 && idResult == 1 && cKeyUps == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The sampling
+
+struct SOAK_SAMPLE
+{
+    LONG cGdi;
+    LONG cUser;
+    LONG cHeapKB;   // The private bytes
+};
+
+static VOID TakeSample(SOAK_SAMPLE *pSample)
+{
+    HANDLE hProcess = GetCurrentProcess();
+    pSample->cGdi = (LONG)GetGuiResources(hProcess, GR_GDIOBJECTS);
+    pSample->cUser = (LONG)GetGuiResources(hProcess, GR_USEROBJECTS);
+
+    PROCESS_MEMORY_COUNTERS_EX pmc = { sizeof(pmc) };
+    GetProcessMemoryInfo(hProcess, (PROCESS_MEMORY_COUNTERS *)&pmc, sizeof(pmc));
+    pSample->cHeapKB = (LONG)(pmc.PrivateUsage / 1024);
+}
+
+static BOOL ParseArgs(int argc, char **argv)
+{
+    for (int iarg = 1; iarg < argc; ++iarg)
+    {
+        const char *pszArg = argv[iarg];
+        if (strcmp(pszArg, "--quick") == 0)
+        {
+            s_cCycles = 5000;
+            s_cWarmup = 500;
+            s_cSample = 500;
+            s_cReopen = 100;
+            s_cThreadCycles = 500;
+            continue;
+        }
+
+        if (iarg + 1 >= argc)
+            return FALSE;
+        INT nValue = atoi(argv[++iarg]);
+
+        if (strcmp(pszArg, "--cycles") == 0)
+            s_cCycles = nValue;
+        else if (strcmp(pszArg, "--items") == 0)
+            s_nItems = nValue;
+        else if (strcmp(pszArg, "--depth") == 0)
+            s_nDepth = nValue;
+        else if (strcmp(pszArg, "--sample") == 0)
+            s_cSample = nValue;
+        else if (strcmp(pszArg, "--warmup") == 0)
+            s_cWarmup = nValue;
+        else if (strcmp(pszArg, "--max-gdi") == 0)
+            s_cMaxGdi = nValue;
+        else if (strcmp(pszArg, "--max-user") == 0)
+            s_cMaxUser = nValue;
+        else if (strcmp(pszArg, "--max-heap") == 0)
+            s_cMaxHeapKB = nValue;
+        else if (strcmp(pszArg, "--reopen") == 0)
+            s_cReopen = nValue;
+        else if (strcmp(pszArg, "--threads") == 0)
+            s_cThreads = nValue;
+        else if (strcmp(pszArg, "--thread-cycles") == 0)
+            s_cThreadCycles = nValue;
+        else if (strcmp(pszArg, "--owner-data") == 0)
+            s_cOwnerData = nValue;
+        else
+            return FALSE;
+    }
+
+    return s_cCycles > 0 && s_nItems > 0 && s_nDepth > 0 && s_cSample > 0 && s_cWarmup >= 0 &&
+           s_cReopen >= 0 && 0 <= s_cThreads && s_cThreads <= SOAK_MAX_THREADS &&
+           s_cThreadCycles > 0 && 0 <= s_cOwnerData && s_cOwnerData <= FAKEMENU_OWNERDATA_MAX;
+}
+
+int main(int argc, char **argv)
+{
+    if (!ParseArgs(argc, argv))
+    {
+        fprintf(stderr, "Usage: fakemenu_soak [--quick] [--cycles N] [--items N] [--depth D] "
+                        "[--sample N] [--warmup N] [--max-gdi N] [--max-user N] [--max-heap KB] "
+                        "[--reopen N] [--threads N] [--thread-cycles N] [--owner-data N]\n");
+        return 2;
+    }
+
+    FakeMenu_InitInstance();
+    FakeMenu_SetHoverDelay(SOAK_HOVER_DELAY);
+
+    // Every 5th one is checked, for MaskedDrawFrameControl
+    HMENU hMenu = FakeMenuGen_BuildMenu(s_nItems, s_nDepth, 5);
+
+    LARGE_INTEGER liFreq, liStart, liNow;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liStart);
+
+    SOAK_SAMPLE baseline = { 0 }, sample = { 0 }, peak = { 0 };
+    BOOL bBaseline = FALSE, bFailed = FALSE;
+    INT cStuck = 0;
+    INT iCycle;
+    for (iCycle = 0; iCycle < s_cCycles && !bFailed; ++iCycle)
+    {
+        if (!RunCycle(hMenu, &s_track, iCycle)) // Stuck?
+        {
+            ++cStuck;
+            bFailed = TRUE;
+        }
+
+        if (iCycle + 1 == s_cWarmup || (s_cWarmup == 0 && iCycle == 0))
+        {
+            TakeSample(&baseline);
+            peak = baseline;
+            bBaseline = TRUE;
+        }
+
+        if (!bBaseline || (iCycle + 1) % s_cSample != 0)
+            continue;
+
+        TakeSample(&sample);
+        peak.cGdi = max(peak.cGdi, sample.cGdi);
+        peak.cUser = max(peak.cUser, sample.cUser);
+        peak.cHeapKB = max(peak.cHeapKB, sample.cHeapKB);
+
+        QueryPerformanceCounter(&liNow);
+        double seconds = (double)(liNow.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+        printf("cycle=%d gdi=%ld user=%ld heap_kb=%ld cycles_per_sec=%.1f\n",
+               iCycle + 1, sample.cGdi, sample.cUser, sample.cHeapKB,
+               (seconds > 0) ? (iCycle + 1) / seconds : 0.0);
+        fflush(stdout);
+
+        if (sample.cGdi - baseline.cGdi > s_cMaxGdi ||
+            sample.cUser - baseline.cUser > s_cMaxUser ||
+            sample.cHeapKB - baseline.cHeapKB > s_cMaxHeapKB)
+        {
+            bFailed = TRUE;
+        }
+    }
+
+    QueryPerformanceCounter(&liNow);
+    double seconds = (double)(liNow.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+
+    if (!bFailed && s_cThreads > 0 && !CheckThreads())
+        bFailed = TRUE;
+
+    if (!bFailed && s_cReopen > 0 && !CheckReopen(hMenu))
+        bFailed = TRUE;
+
+    if (!bFailed && s_cOwnerData > 0 && !CheckOwnerData())
+        bFailed = TRUE;
+
+    if (!bFailed && !CheckHostFrames(hMenu))
+        bFailed = TRUE;
+
+    if (!bFailed && !CheckKeyUp())
+        bFailed = TRUE;
+
+    DestroyMenu(hMenu);
+    FakeMenu_ExitInstance();
+
+    printf("%s cycles=%d stuck=%d seconds=%.1f cycles_per_sec=%.1f "
+           "gdi_growth=%ld user_growth=%ld heap_growth_kb=%ld\n",
+           (bFailed ? "FAIL" : "PASS"), iCycle, cStuck, seconds,
+           (seconds > 0) ? iCycle / seconds : 0.0,
+           peak.cGdi - baseline.cGdi, peak.cUser - baseline.cUser,
+           peak.cHeapKB - baseline.cHeapKB);
+    return bFailed ? 1 : 0;
+}
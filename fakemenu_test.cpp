@@ -13,6 +13,7 @@
 
 static HINSTANCE s_hInst = NULL;
 static WCHAR s_szText[MAX_PATH] = L"(Right-Click me!)";
+static HFAKEMENU s_ahFakeMenus[4] = { NULL }; // Prepared once by the menu ID and reopened
 
 BOOL OnCreate(HWND hwnd, LPCREATESTRUCT lpCreateStruct)
 {
@@ -41,7 +42,7 @@ void OnPaint(HWND hwnd)
     }
 }
 
-VOID OnNotifyMenu(HWND hwnd, POINT pt, INT nMenuID)
+HFAKEMENU PrepareMenu(INT nMenuID)
 {
     HMENU hMenu = LoadMenu(GetModuleHandle(NULL), MAKEINTRESOURCE(nMenuID));
     HFAKEMENU hFakeMenu = FakeMenu_FromHMENU(hMenu);
@@ -55,14 +56,22 @@ VOID OnNotifyMenu(HWND hwnd, POINT pt, INT nMenuID)
     lf.lfQuality = ANTIALIASED_QUALITY;
     FakeMenu_SetLogFont(hFakeMenu, &lf);
 
+    return hFakeMenu;
+}
+
+VOID OnNotifyMenu(HWND hwnd, POINT pt, INT nMenuID)
+{
+    // Reopening an unchanged menu doesn't allocate
+    if (!s_ahFakeMenus[nMenuID])
+        s_ahFakeMenus[nMenuID] = PrepareMenu(nMenuID);
+    HFAKEMENU hFakeMenu = s_ahFakeMenus[nMenuID];
+
     INT id = FakeMenu_TrackPopup(hFakeMenu, pt);
     if (id != 0)
     {
         FakeMenu_GetItemText(hFakeMenu, id, s_szText, _countof(s_szText), FALSE);
         InvalidateRect(hwnd, NULL, TRUE);
     }
-
-    FakeMenu_Destroy(hFakeMenu);
 }
 
 void OnRButtonUp(HWND hwnd, int x, int y, UINT flags)
@@ -99,6 +108,13 @@ void OnDestroy(HWND hwnd)
     NOTIFYICONDATA data = { NOTIFYICONDATA_V1_SIZE, hwnd, 1 };
     Shell_NotifyIcon(NIM_DELETE, &data);
 
+    for (INT i = 0; i < (INT)_countof(s_ahFakeMenus); ++i)
+    {
+        if (s_ahFakeMenus[i])
+            FakeMenu_Destroy(s_ahFakeMenus[i]);
+        s_ahFakeMenus[i] = NULL;
+    }
+
     PostQuitMessage(0);
 }
 
@@ -0,0 +1,269 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     Scoped trace events of FakeMenu (portable)
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#include "fakemenu_trace.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+// The events of a thread are buffered here until it's full or flushed
+#define FAKEMENU_TRACE_RING 1024
+
+// A spinlock, for std::mutex is missing in the win32 thread model of MinGW
+class FakeMenuTraceLock
+{
+public:
+    explicit FakeMenuTraceLock(std::atomic_flag& lock) : m_lock(lock)
+    {
+        while (m_lock.test_and_set(std::memory_order_acquire))
+            ;
+    }
+
+    ~FakeMenuTraceLock()
+    {
+        m_lock.clear(std::memory_order_release);
+    }
+
+private:
+    std::atomic_flag& m_lock;
+};
+
+// The sink and its context are set and read together under s_lockSink.
+// s_bEnabled is the quick check of the scopes
+struct FAKEMENU_TRACE_SINK_ENTRY
+{
+    FAKEMENU_TRACE_SINK pfnSink;
+    void *pContext;
+};
+static std::atomic_flag s_lockSink = ATOMIC_FLAG_INIT;
+static FAKEMENU_TRACE_SINK_ENTRY s_sink = { nullptr, nullptr };
+static std::atomic<bool> s_bEnabled(false);
+static std::atomic<uint32_t> s_nNextThread(1);
+
+static FAKEMENU_TRACE_SINK_ENTRY GetSink()
+{
+    FakeMenuTraceLock lock(s_lockSink);
+    return s_sink;
+}
+
+// The per-thread ring buffer. Only the owner thread touches it.
+// The sink may record events: the chunk being delivered is kept out of the ring until it returns
+struct FAKEMENU_TRACE_RING_BUFFER
+{
+    FAKEMENU_TRACE_EVENT aEvents[FAKEMENU_TRACE_RING];
+    size_t iHead;       // The first pending event
+    size_t cEvents;     // The number of the pending events
+    size_t cDelivering; // The events just before iHead, being read by the sink
+    uint32_t nThread;
+    bool bFlushing;     // In the sink?
+
+    FAKEMENU_TRACE_RING_BUFFER()
+        : iHead(0), cEvents(0), cDelivering(0), nThread(s_nNextThread++), bFlushing(false)
+    {
+    }
+
+    ~FAKEMENU_TRACE_RING_BUFFER()
+    {
+        Flush();
+    }
+
+    void Flush()
+    {
+        if (bFlushing) // Called in the sink? The outer call delivers the rest
+            return;
+
+        FAKEMENU_TRACE_SINK_ENTRY sink = GetSink();
+        if (!sink.pfnSink)
+        {
+            iHead = cEvents = 0;
+            return;
+        }
+
+        bFlushing = true;
+        while (cEvents && sink.pfnSink)
+        {
+            // The contiguous part. Take it out of the ring first
+            size_t iChunk = iHead, cChunk = cEvents;
+            if (iChunk + cChunk > FAKEMENU_TRACE_RING)
+                cChunk = FAKEMENU_TRACE_RING - iChunk;
+            iHead = (iHead + cChunk) % FAKEMENU_TRACE_RING;
+            cEvents -= cChunk;
+
+            cDelivering = cChunk;
+            sink.pfnSink(&aEvents[iChunk], cChunk, sink.pContext);
+            cDelivering = 0;
+
+            sink = GetSink(); // Changed in the sink?
+        }
+        if (!sink.pfnSink)
+            cEvents = 0;
+        bFlushing = false;
+    }
+
+    void Push(const FAKEMENU_TRACE_EVENT& event)
+    {
+        if (cEvents + cDelivering == FAKEMENU_TRACE_RING) // Full?
+        {
+            Flush();
+            if (cEvents + cDelivering == FAKEMENU_TRACE_RING) // Still full in the sink?
+            {
+                if (!cEvents)
+                    return; // All are being delivered. Drop this one
+
+                // Drop the oldest pending one. The slot after the last one is being delivered,
+                // so the rest move down
+                for (size_t i = 0; i + 1 < cEvents; ++i)
+                {
+                    aEvents[(iHead + i) % FAKEMENU_TRACE_RING] =
+                        aEvents[(iHead + i + 1) % FAKEMENU_TRACE_RING];
+                }
+                --cEvents;
+            }
+        }
+
+        aEvents[(iHead + cEvents) % FAKEMENU_TRACE_RING] = event;
+        ++cEvents;
+    }
+};
+
+static thread_local FAKEMENU_TRACE_RING_BUFFER s_ring;
+
+extern "C"
+{
+
+void FakeMenuTrace_SetSink(FAKEMENU_TRACE_SINK pfnSink, void *pContext)
+{
+    FakeMenuTraceLock lock(s_lockSink);
+    s_sink.pfnSink = pfnSink;
+    s_sink.pContext = pContext;
+    s_bEnabled.store(pfnSink != nullptr, std::memory_order_relaxed);
+}
+
+int FakeMenuTrace_IsEnabled(void)
+{
+    return s_bEnabled.load(std::memory_order_relaxed);
+}
+
+void FakeMenuTrace_Flush(void)
+{
+    s_ring.Flush();
+}
+
+uint64_t FakeMenuTrace_Now(void)
+{
+    using namespace std::chrono;
+    return (uint64_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void FakeMenuTrace_Record(const char *pszName, uint64_t usStart, int32_t nArg)
+{
+    FAKEMENU_TRACE_EVENT event;
+    event.pszName = pszName;
+    event.usStart = usStart;
+    event.usDuration = FakeMenuTrace_Now() - usStart;
+    event.nThread = s_ring.nThread;
+    event.nArg = nArg;
+    s_ring.Push(event);
+}
+
+size_t FakeMenuTrace_FormatJson(const FAKEMENU_TRACE_EVENT *pEvent, char *pszBuf, size_t cchBuf)
+{
+    // Escape the name
+    char szName[128];
+    size_t ich = 0;
+    for (const char *pch = pEvent->pszName; *pch && ich < sizeof(szName) - 7; ++pch)
+    {
+        unsigned char ch = (unsigned char)*pch;
+        if (ch == '"' || ch == '\\')
+        {
+            szName[ich++] = '\\';
+            szName[ich++] = (char)ch;
+        }
+        else if (ch < 0x20)
+        {
+            ich += snprintf(&szName[ich], sizeof(szName) - ich, "\\u%04x", ch);
+        }
+        else
+        {
+            szName[ich++] = (char)ch;
+        }
+    }
+    szName[ich] = 0;
+
+    int cch = snprintf(pszBuf, cchBuf,
+                       "{\"name\":\"%s\",\"cat\":\"fakemenu\",\"ph\":\"X\","
+                       "\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%u,\"args\":{\"n\":%d}}",
+                       szName, (unsigned long long)pEvent->usStart,
+                       (unsigned long long)pEvent->usDuration,
+                       (unsigned)pEvent->nThread, (int)pEvent->nArg);
+    if (cch < 0)
+        return 0;
+    return (size_t)cch;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The JSON sink
+
+// The sinks of the threads share the file
+static std::atomic_flag s_lockJson = ATOMIC_FLAG_INIT;
+static FILE *s_fpJson = NULL;
+static bool s_bJsonFirst = true;
+
+static void JsonSink(const FAKEMENU_TRACE_EVENT *pEvents, size_t cEvents, void * /*pContext*/)
+{
+    FakeMenuTraceLock lock(s_lockJson);
+    if (!s_fpJson)
+        return;
+
+    char szBuf[256];
+    for (size_t i = 0; i < cEvents; ++i)
+    {
+        size_t cch = FakeMenuTrace_FormatJson(&pEvents[i], szBuf, sizeof(szBuf));
+        if (cch == 0 || cch >= sizeof(szBuf))
+            continue;
+
+        fputs(s_bJsonFirst ? "\n" : ",\n", s_fpJson);
+        fputs(szBuf, s_fpJson);
+        s_bJsonFirst = false;
+    }
+}
+
+int FakeMenuTrace_OpenJson(const char *pszFileName)
+{
+    FakeMenuTrace_CloseJson();
+
+    FakeMenuTraceLock lock(s_lockJson);
+    s_fpJson = fopen(pszFileName, "w");
+    if (!s_fpJson)
+        return 0;
+
+    fputs("{\"traceEvents\":[", s_fpJson);
+    s_bJsonFirst = true;
+    FakeMenuTrace_SetSink(JsonSink, NULL);
+    return 1;
+}
+
+// The rings of the other threads are not flushed here. They are dropped unless the threads
+// call FakeMenuTrace_Flush or exit before this
+void FakeMenuTrace_CloseJson(void)
+{
+    if (GetSink().pfnSink != JsonSink)
+        return;
+
+    FakeMenuTrace_Flush();
+    FakeMenuTrace_SetSink(NULL, NULL);
+
+    FakeMenuTraceLock lock(s_lockJson);
+    if (s_fpJson)
+    {
+        fputs("\n]}\n", s_fpJson);
+        fclose(s_fpJson);
+        s_fpJson = NULL;
+    }
+}
+
+} // extern "C"
@@ -0,0 +1,81 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     Scoped trace events of FakeMenu (portable)
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A complete event (Chrome trace-event phase 'X') */
+typedef struct FAKEMENU_TRACE_EVENT
+{
+    const char *pszName;    /* A static string */
+    uint64_t usStart;       /* The start time in microseconds */
+    uint64_t usDuration;    /* The duration in microseconds */
+    uint32_t nThread;       /* The trace thread number */
+    int32_t nArg;           /* An optional argument (e.g. the number of items) */
+} FAKEMENU_TRACE_EVENT;
+
+/* Called by the thread that recorded the events */
+typedef void (*FAKEMENU_TRACE_SINK)(const FAKEMENU_TRACE_EVENT *pEvents, size_t cEvents,
+                                    void *pContext);
+
+/* Install the sink. NULL to stop tracing */
+void FakeMenuTrace_SetSink(FAKEMENU_TRACE_SINK pfnSink, void *pContext);
+int FakeMenuTrace_IsEnabled(void);
+/* Deliver the buffered events of the calling thread to the sink */
+void FakeMenuTrace_Flush(void);
+uint64_t FakeMenuTrace_Now(void);
+void FakeMenuTrace_Record(const char *pszName, uint64_t usStart, int32_t nArg);
+
+/* The built-in sink writing the Chrome trace-event JSON */
+int FakeMenuTrace_OpenJson(const char *pszFileName);
+/* Flushes the calling thread only. The other threads must call FakeMenuTrace_Flush
+   (or exit) before this, or their buffered events are dropped */
+void FakeMenuTrace_CloseJson(void);
+/* Format one event as a JSON object. Returns the length, or the needed size if too small */
+size_t FakeMenuTrace_FormatJson(const FAKEMENU_TRACE_EVENT *pEvent, char *pszBuf, size_t cchBuf);
+
+#ifdef __cplusplus
+} /* extern "C" */
+
+/* Record the scope as an event if tracing */
+class FakeMenuTraceScope
+{
+public:
+    explicit FakeMenuTraceScope(const char *pszName, int32_t nArg = 0)
+        : m_pszName(NULL), m_usStart(0), m_nArg(nArg)
+    {
+        if (FakeMenuTrace_IsEnabled())
+        {
+            m_pszName = pszName;
+            m_usStart = FakeMenuTrace_Now();
+        }
+    }
+
+    ~FakeMenuTraceScope()
+    {
+        if (m_pszName)
+            FakeMenuTrace_Record(m_pszName, m_usStart, m_nArg);
+    }
+
+private:
+    const char *m_pszName;
+    uint64_t m_usStart;
+    int32_t m_nArg;
+};
+
+#define FAKEMENU_TRACE_CONCAT2(x, y) x##y
+#define FAKEMENU_TRACE_CONCAT(x, y) FAKEMENU_TRACE_CONCAT2(x, y)
+#define FAKEMENU_TRACE_SCOPE(pszName) \
+    FakeMenuTraceScope FAKEMENU_TRACE_CONCAT(traceScope, __LINE__)(pszName)
+#define FAKEMENU_TRACE_SCOPE_ARG(pszName, nArg) \
+    FakeMenuTraceScope FAKEMENU_TRACE_CONCAT(traceScope, __LINE__)(pszName, nArg)
+#endif
@@ -0,0 +1,376 @@
+/*
+ * PROJECT:     ReactOS FakeMenu Library
+ * LICENSE:     LGPL-2.1-or-later (https://spdx.org/licenses/LGPL-2.1-or-later)
+ * PURPOSE:     The tests of the trace events of FakeMenu (portable)
+ * COPYRIGHT:   Copyright 2022 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ */
+#include "fakemenu_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Usage: fakemenu_trace_test
+// Exits with 1 if a check fails.
+
+#define TRACE_RING 1024         // FAKEMENU_TRACE_RING
+#define MAX_DELIVERED 8192
+
+static int s_cFailures = 0;
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            printf("%s(%d): FAILED: %s\n", __FILE__, __LINE__, #expr); \
+            ++s_cFailures; \
+        } \
+    } while (0)
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The sink of the tests
+
+static int32_t s_anDelivered[MAX_DELIVERED];   // The arguments of the delivered events
+static size_t s_cDelivered = 0;
+static int s_cSinkCalls = 0;
+static int s_cReentrantRecords = 0;            // Recorded by the first call of the sink
+
+static void TestSink(const FAKEMENU_TRACE_EVENT *pEvents, size_t cEvents, void *pContext)
+{
+    CHECK(pContext == &s_cDelivered);
+    ++s_cSinkCalls;
+
+    // Record and flush in the sink
+    int cRecords = s_cReentrantRecords;
+    s_cReentrantRecords = 0;
+    for (int i = 0; i < cRecords; ++i)
+        FakeMenuTrace_Record("reentrant", FakeMenuTrace_Now(), 10000 + i);
+    if (cRecords)
+        FakeMenuTrace_Flush();
+
+    // The events are intact after the recording above
+    for (size_t i = 0; i < cEvents && s_cDelivered < MAX_DELIVERED; ++i)
+        s_anDelivered[s_cDelivered++] = pEvents[i].nArg;
+}
+
+static void ResetSink(void)
+{
+    FakeMenuTrace_Flush();
+    s_cDelivered = 0;
+    s_cSinkCalls = 0;
+    s_cReentrantRecords = 0;
+}
+
+static void RecordRange(int32_t nFirst, int32_t nLast)
+{
+    for (int32_t n = nFirst; n <= nLast; ++n)
+        FakeMenuTrace_Record("event", FakeMenuTrace_Now(), n);
+}
+
+// Were the arguments nFirst to nLast delivered at iFirst?
+static bool IsDelivered(size_t iFirst, int32_t nFirst, int32_t nLast)
+{
+    if (iFirst + (size_t)(nLast - nFirst + 1) > s_cDelivered)
+        return false;
+
+    for (int32_t n = nFirst; n <= nLast; ++n)
+    {
+        if (s_anDelivered[iFirst++] != n)
+            return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The ring
+
+static void TestFullRing(void)
+{
+    ResetSink();
+
+    // Flushed whenever full
+    RecordRange(0, 3 * TRACE_RING - 1);
+    FakeMenuTrace_Flush();
+    CHECK(s_cDelivered == 3 * TRACE_RING);
+    CHECK(IsDelivered(0, 0, 3 * TRACE_RING - 1));
+}
+
+static void TestWrap(void)
+{
+    ResetSink();
+
+    RecordRange(0, 599);
+    FakeMenuTrace_Flush();
+    CHECK(s_cSinkCalls == 1);
+
+    // The next events wrap around the end of the ring and come in two chunks
+    s_cSinkCalls = 0;
+    RecordRange(600, 1199);
+    FakeMenuTrace_Flush();
+    CHECK(s_cSinkCalls == 2);
+    CHECK(s_cDelivered == 1200);
+    CHECK(IsDelivered(0, 0, 1199));
+}
+
+static void TestReentrancy(void)
+{
+    ResetSink();
+
+    // The sink records 30 events while 1000 are being delivered. 24 slots are free,
+    // so the oldest 6 of them are dropped
+    RecordRange(0, 999);
+    s_cReentrantRecords = 30;
+    FakeMenuTrace_Flush();
+    CHECK(s_cDelivered == 1000 + 24);
+    CHECK(IsDelivered(0, 0, 999));
+    CHECK(IsDelivered(1000, 10006, 10029));
+
+    // The whole ring is being delivered. The events of the sink have no room
+    ResetSink();
+    RecordRange(0, TRACE_RING - 1);
+    s_cReentrantRecords = 5;
+    FakeMenuTrace_Flush();
+    CHECK(s_cDelivered == TRACE_RING);
+    CHECK(IsDelivered(0, 0, TRACE_RING - 1));
+
+    // The ring still works. It starts at 100 from now on
+    ResetSink();
+    RecordRange(0, 99);
+    FakeMenuTrace_Flush();
+    CHECK(IsDelivered(0, 0, 99));
+}
+
+static void TestNoSink(void)
+{
+    FakeMenuTrace_SetSink(NULL, NULL);
+    CHECK(!FakeMenuTrace_IsEnabled());
+    RecordRange(0, 2 * TRACE_RING); // Dropped when full
+    FakeMenuTrace_Flush();
+
+    FakeMenuTrace_SetSink(TestSink, &s_cDelivered);
+    CHECK(FakeMenuTrace_IsEnabled());
+    ResetSink();
+    FakeMenuTrace_Flush();
+    CHECK(s_cDelivered == 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// The JSON
+
+// A minimal JSON validator
+static const char *SkipSpaces(const char *pch)
+{
+    while (*pch == ' ' || *pch == '\t' || *pch == '\n' || *pch == '\r')
+        ++pch;
+    return pch;
+}
+
+static const char *ParseValue(const char *pch);
+
+static const char *ParseString(const char *pch)
+{
+    if (*pch != '"')
+        return NULL;
+    for (++pch; *pch != '"'; ++pch)
+    {
+        if ((unsigned char)*pch < 0x20)
+            return NULL;
+        if (*pch != '\\')
+            continue;
+
+        ++pch;
+        if (*pch == 'u')
+        {
+            for (int i = 1; i <= 4; ++i)
+            {
+                if (!strchr("0123456789abcdefABCDEF", pch[i]) || !pch[i])
+                    return NULL;
+            }
+            pch += 4;
+        }
+        else if (!*pch || !strchr("\"\\/bfnrt", *pch))
+        {
+            return NULL;
+        }
+    }
+    return pch + 1;
+}
+
+static const char *ParseContainer(const char *pch, char chEnd)
+{
+    pch = SkipSpaces(pch + 1);
+    if (*pch == chEnd)
+        return pch + 1;
+
+    for (;;)
+    {
+        if (chEnd == '}')
+        {
+            pch = ParseString(pch);
+            if (!pch)
+                return NULL;
+            pch = SkipSpaces(pch);
+            if (*pch != ':')
+                return NULL;
+            pch = SkipSpaces(pch + 1);
+        }
+
+        pch = ParseValue(pch);
+        if (!pch)
+            return NULL;
+
+        pch = SkipSpaces(pch);
+        if (*pch == chEnd)
+            return pch + 1;
+        if (*pch != ',')
+            return NULL;
+        pch = SkipSpaces(pch + 1);
+    }
+}
+
+static const char *ParseValue(const char *pch)
+{
+    pch = SkipSpaces(pch);
+    if (*pch == '{')
+        return ParseContainer(pch, '}');
+    if (*pch == '[')
+        return ParseContainer(pch, ']');
+    if (*pch == '"')
+        return ParseString(pch);
+
+    const char *pchStart = pch;
+    if (*pch == '-')
+        ++pch;
+    while ('0' <= *pch && *pch <= '9')
+        ++pch;
+    return (pch > pchStart) ? pch : NULL;
+}
+
+static bool IsValidJson(const char *psz)
+{
+    const char *pch = ParseValue(psz);
+    return pch && *SkipSpaces(pch) == 0;
+}
+
+static void TestFormatJson(void)
+{
+    FAKEMENU_TRACE_EVENT event = { "a\"b\\c\n\x1f", 10, 20, 3, -4 };
+    char szBuf[256];
+    size_t cch = FakeMenuTrace_FormatJson(&event, szBuf, sizeof(szBuf));
+    CHECK(cch == strlen(szBuf));
+    CHECK(strstr(szBuf, "\"name\":\"a\\\"b\\\\c\\u000a\\u001f\"") != NULL);
+    CHECK(strstr(szBuf, "\"ts\":10,\"dur\":20") != NULL);
+    CHECK(strstr(szBuf, "\"tid\":3") != NULL);
+    CHECK(strstr(szBuf, "\"n\":-4") != NULL);
+    CHECK(IsValidJson(szBuf));
+
+    // The long names are truncated without breaking the escapes
+    static const char *s_apszLong[] =
+    {
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx",
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"",
+        "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13\x14\x15"
+        "\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b",
+    };
+    for (size_t i = 0; i < sizeof(s_apszLong) / sizeof(s_apszLong[0]); ++i)
+    {
+        event.pszName = s_apszLong[i];
+        cch = FakeMenuTrace_FormatJson(&event, szBuf, sizeof(szBuf));
+        CHECK(cch < sizeof(szBuf));
+        CHECK(IsValidJson(szBuf));
+
+        const char *pchName = strstr(szBuf, "\"name\":\"") + 8;
+        const char *pchEnd = ParseString(pchName - 1) - 1;
+        CHECK(pchEnd - pchName < 128);
+    }
+
+    // Too small. The needed size is returned and the buffer is terminated
+    event.pszName = "event";
+    char szSmall[16];
+    memset(szSmall, 'z', sizeof(szSmall));
+    cch = FakeMenuTrace_FormatJson(&event, szSmall, sizeof(szSmall));
+    CHECK(cch >= sizeof(szSmall));
+    CHECK(szSmall[sizeof(szSmall) - 1] == 0);
+}
+
+static char *ReadFileText(const char *pszFileName)
+{
+    FILE *fp = fopen(pszFileName, "rb");
+    if (!fp)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long cb = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *psz = (char *)malloc(cb + 1);
+    if (psz)
+    {
+        size_t cbRead = fread(psz, 1, cb, fp);
+        psz[cbRead] = 0;
+    }
+    fclose(fp);
+    return psz;
+}
+
+static int CountText(const char *psz, const char *pszFind)
+{
+    int count = 0;
+    for (const char *pch = psz; (pch = strstr(pch, pszFind)) != NULL; pch += strlen(pszFind))
+        ++count;
+    return count;
+}
+
+static void TestJsonFile(void)
+{
+    const char *pszFileName = "fakemenu_trace_test.json";
+
+    // No events
+    CHECK(FakeMenuTrace_OpenJson(pszFileName));
+    FakeMenuTrace_CloseJson();
+    char *psz = ReadFileText(pszFileName);
+    CHECK(psz && IsValidJson(psz));
+    free(psz);
+
+    // More events than the ring, some with the escapes
+    CHECK(FakeMenuTrace_OpenJson(pszFileName));
+    CHECK(FakeMenuTrace_IsEnabled());
+    for (int i = 0; i < TRACE_RING + 10; ++i)
+        FakeMenuTrace_Record((i % 3) ? "plain" : "quote\"back\\slash\ttab", FakeMenuTrace_Now(), i);
+    FakeMenuTrace_CloseJson();
+    CHECK(!FakeMenuTrace_IsEnabled());
+
+    psz = ReadFileText(pszFileName);
+    CHECK(psz && IsValidJson(psz));
+    CHECK(psz && CountText(psz, "\"ph\":\"X\"") == TRACE_RING + 10);
+    free(psz);
+
+    // Closing again does nothing
+    FakeMenuTrace_CloseJson();
+    remove(pszFileName);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    FakeMenuTrace_SetSink(TestSink, &s_cDelivered);
+
+    // The ring starts at zero. The order matters to the positions of the chunks
+    TestReentrancy();
+    TestWrap();
+    TestFullRing();
+    TestNoSink();
+    TestFormatJson();
+
+    FakeMenuTrace_SetSink(NULL, NULL);
+    TestJsonFile();
+
+    if (s_cFailures)
+    {
+        printf("FAIL %d check(s)\n", s_cFailures);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}